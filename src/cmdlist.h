@@ -68,6 +68,7 @@ defcmd("RECALL"      , handle_recall_command      , 0)
 defcmd("RECORDLINE"  , handle_recordline_command  , 0)
 defcmd("RELIMIT"     , handle_relimit_command     , 0)
 defcmd("REPEAT"      , handle_repeat_command      , 0)
+defcmd("RESETPROFILE", handle_resetprofile_command, 0)
 defcmd("RESTRICT"    , handle_restrict_command    , 0)
 defcmd("SAVE"        , handle_save_command        , 0)
 defcmd("SAVEWORLD"   , handle_saveworld_command   , 0)
@@ -0,0 +1,179 @@
+/*************************************************************************
+ *  TinyFugue - programmable mud client
+ *  Copyright (C) 1993, 1994, 1995, 1996, 1997, 1998, 1999, 2002, 2003, 2004, 2005, 2006-2007 Ken Keys
+ *
+ *  TinyFugue (aka "tf") is protected under the terms of the GNU
+ *  General Public License.  See the file "COPYING" for details.
+ ************************************************************************/
+static const char RCSid[] = "$Id$";
+
+
+/**************************************************************
+ * Event backend benchmark
+ *
+ * Measures the cost of one main loop wakeup (wait for one
+ * active descriptor) with 10, 100, and 1000 idle sockets
+ * registered, for each backend in tfselect.c.  Each run is
+ * done in a child process so backends don't share state.
+ *
+ * Usage: evbench [iterations]
+ **************************************************************/
+
+#include "tfconfig.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#if HAVE_SETRLIMIT
+# include <sys/resource.h>
+#endif
+#include "port.h"
+#include "tf.h"
+#include "util.h"
+#include "tfselect.h"
+
+const struct timeval tvzero = { 0, 0 };
+
+static const char *backends[] = { "select", "poll", "epoll", NULL };
+static const int nidle[] = { 10, 100, 1000, 0 };
+
+/* tfselect.c allocates through these; we don't need the full malloc.c. */
+void *xmalloc(void *md, long unsigned size, const char *file, const int line)
+{
+    return xrealloc(md, NULL, size, file, line);
+}
+
+void *xrealloc(void *md, void *ptr, long unsigned size,
+    const char *file, const int line)
+{
+    void *result = realloc(ptr, size);
+    if (!result) {
+	fprintf(stderr, "%s:%d: out of memory\n", file, line);
+	exit(1);
+    }
+    return result;
+}
+
+void xfree(void *md, void *ptr, const char *file, const int line)
+{
+    free(ptr);
+}
+
+static double elapsed(struct timeval *start)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1e6 +
+	(now.tv_usec - start->tv_usec);
+}
+
+/* Returns microseconds per wakeup, or a negative value if the backend is not
+ * available or can not handle this many descriptors. */
+static double run(const char *backend, int n, int iterations)
+{
+    int i, sv[2], active[2];
+    char c = 'x';
+    struct timeval start;
+
+#if HAVE_SETRLIMIT && defined(RLIMIT_NOFILE)
+    {
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < 2 * n + 64) {
+	    rl.rlim_cur = 2 * n + 64;
+	    if (rl.rlim_max < rl.rlim_cur) rl.rlim_cur = rl.rlim_max;
+	    setrlimit(RLIMIT_NOFILE, &rl);
+	}
+    }
+#endif
+
+    init_tfselect(backend);
+    if (strcmp(ev_backend, backend) != 0)
+	return -1;
+
+    /* Idle sockets: the peer stays open but never writes. */
+    for (i = 0; i < n; i++) {
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+	    perror("socketpair");
+	    return -1;
+	}
+	if (ev_add(sv[0], EV_READ) < 0)
+	    return -1;
+    }
+
+    /* The active socket, created last so it has the highest fd, as a
+     * newly opened world would. */
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, active) < 0) {
+	perror("socketpair");
+	return -1;
+    }
+    if (ev_add(active[0], EV_READ) < 0)
+	return -1;
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < iterations; i++) {
+	if (write(active[1], &c, 1) != 1) {
+	    perror("write");
+	    return -1;
+	}
+	if (ev_wait(NULL) != 1 || !ev_ready(active[0], EV_READ)) {
+	    fprintf(stderr, "%s: unexpected wakeup\n", backend);
+	    return -1;
+	}
+	if (read(active[0], &c, 1) != 1) {
+	    perror("read");
+	    return -1;
+	}
+    }
+    return elapsed(&start) / iterations;
+}
+
+int main(int argc, char **argv)
+{
+    int b, n, status, iterations = 20000;
+    int fds[2];
+    double usec;
+    pid_t pid;
+
+    if (argc > 1) iterations = atoi(argv[1]);
+    if (iterations <= 0) {
+	fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+	return 1;
+    }
+
+    printf("usec per wakeup, %d iterations\n", iterations);
+    printf("%-8s", "backend");
+    for (n = 0; nidle[n]; n++)
+	printf(" %8d", nidle[n]);
+    printf("\n");
+
+    for (b = 0; backends[b]; b++) {
+	printf("%-8s", backends[b]);
+	for (n = 0; nidle[n]; n++) {
+	    fflush(stdout);
+	    usec = -1;
+	    if (pipe(fds) < 0) {
+		perror("pipe");
+		return 1;
+	    }
+	    if ((pid = fork()) < 0) {
+		perror("fork");
+		return 1;
+	    } else if (pid == 0) {
+		close(fds[0]);
+		usec = run(backends[b], nidle[n], iterations);
+		write(fds[1], &usec, sizeof(usec));
+		_exit(0);
+	    }
+	    close(fds[1]);
+	    if (read(fds[0], &usec, sizeof(usec)) != sizeof(usec))
+		usec = -1;
+	    close(fds[0]);
+	    waitpid(pid, &status, 0);
+	    if (usec < 0)
+		printf(" %8s", "n/a");
+	    else
+		printf(" %8.2f", usec);
+	}
+	printf("\n");
+    }
+    return 0;
+}
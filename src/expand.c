@@ -52,6 +52,30 @@ Value *val_blank = NULL;
 static const char *oplabel_table[256];
 static int cmdsub_count = 0;		/* cmdsub nesting count */
 
+/* Programs compiled by macro_run() and expr_value() are kept in an LRU
+ * cache keyed by their text, so text that is run again (by /quote, /repeat,
+ * /eval, etc.) need not be compiled again.  Each entry's Program is compiled
+ * from a private copy of the text, so the caller's String may be changed or
+ * freed at any time.
+ */
+typedef struct ProgCache {
+    struct ProgCache *next, *prev;	/* in LRU order, most recent first */
+    struct ProgCache *hnext;		/* next in hash bucket */
+    unsigned int hash;
+    int subs;				/* subs level, or -1 for an expr */
+    int slash;			/* %oldslash when compiled */
+    int bslash;		/* %backslash when compiled */
+    Program *prog;
+} ProgCache;
+
+#define PROG_CACHE_BUCKETS	256
+#define PROG_CACHE_MAXLEN	1024	/* longer texts are not cached */
+
+static ProgCache prog_lru = { &prog_lru, &prog_lru };	/* list head */
+static ProgCache *prog_bucket[PROG_CACHE_BUCKETS];
+static int prog_cache_count = 0;
+static unsigned long prog_cache_hits = 0, prog_cache_misses = 0;
+
 
 #define KEYWORD_LENGTH	6	/* length of longest keyword */
 static const char *keyword_table[] = {
@@ -93,29 +117,36 @@ void init_expand(void)
 #include "opcodes.h"
 }
 
+static void inst_free(Instruction *inst)
+{
+    switch (op_arg_type(inst->op)) {
+    case OPA_STRP:
+	if (inst->arg.str)
+	    conStringfree(inst->arg.str);
+	break;
+    case OPA_VALP:
+	if (inst->arg.val)
+	    freeval(inst->arg.val);
+	break;
+    }
+}
+
 static void prog_free_tail(Program *prog, int start)
 {
     int i;
 
-    for (i = start; i < prog->len; i++) {
-	switch (op_arg_type(prog->code[i].op)) {
-	case OPA_STRP:
-	    if (prog->code[i].arg.str)
-		conStringfree(prog->code[i].arg.str);
-	    break;
-	case OPA_VALP:
-	    if (prog->code[i].arg.val)
-		freeval(prog->code[i].arg.val);
-	    break;
-	}
-    }
+    for (i = start; i < prog->len; i++)
+	inst_free(&prog->code[i]);
     prog->len = start;
 }
 
 void prog_free(Program *prog)
 {
+    if (--prog->links > 0) return;
     prog_free_tail(prog, 0);
     if (prog->code) FREE(prog->code);
+    if (prog->deps) FREE(prog->deps);
+    if (prog->cache) freeval(prog->cache);
     conStringfree(prog->src);
     FREE(prog);
 }
@@ -206,21 +237,37 @@ static void prog_dump(Program *prog)
 
 struct Value *handle_eval_command(String *args, int offset)
 {
-    int c, subflag = SUB_MACRO;
+    int c, subflag = SUB_MACRO, optflag = 0, result;
     const char *ptr;
+    Program *prog;
 
-    startopt(CS(args), "s:");
+    startopt(CS(args), "s:O");
     while ((c = nextopt(&ptr, NULL, NULL, &offset))) {
         switch (c) {
         case 's':
             if ((subflag = enum2int(ptr, 0, enum_sub, "-s")) < 0)
                 return shareval(val_zero);
             break;
+        case 'O':
+            optflag = 1;
+            break;
         default:
             return shareval(val_zero);
         }
     }
-    if (!macro_run(CS(args), offset, NULL, 0, subflag, "\bEVAL"))
+    if (!optflag) {
+	if (!macro_run(CS(args), offset, NULL, 0, subflag, "\bEVAL"))
+	    return shareval(val_zero);
+	return_user_result();
+    }
+
+    /* compile as if for a macro body, show the code, and run it */
+    if (!(prog = compile_tf(CS(args), offset, subflag, 0, 2)))
+        return shareval(val_zero);
+    if (!(cecho > invis_flag)) prog_dump(prog);  /* else compile_tf() did */
+    result = prog_run(prog, NULL, 0, "\bEVAL", 0);
+    prog_free(prog);
+    if (!result)
         return shareval(val_zero);
     return_user_result();
 }
@@ -367,6 +414,330 @@ static int stringvec(const String *str, int offset, Arg **vector, int vecsize)
     return count;
 }
 
+/* Give each local variable that prog sets with a constant-named /let a slot
+ * in the VarScope that prog_run() pushes, and give that slot to every ID in
+ * prog that names it, so findlocalidvar() can find the variable without
+ * searching for its name.  IDs for other names keep slot -1.
+ */
+static void prog_assign_slots(Program *prog)
+{
+    const char **name = NULL;
+    Value *val;
+    int i, j, n = 0, size = 0;
+
+    for (i = 0; i < prog->len; i++) {
+	if (prog->code[i].op != OP_LET) continue;
+	val = prog->code[i].arg.val;
+	for (j = 0; j < n; j++)
+	    if (strcmp(name[j], val->name) == 0) break;
+	if (j < n) continue;
+	if (n == size)
+	    name = XREALLOC(name, (size += 8) * sizeof(char*));
+	name[n++] = val->name;
+    }
+    if (!n) return;
+
+    for (i = 0; i < prog->len; i++) {
+	if (!op_arg_type_is(prog->code[i].op, VALP)) continue;
+	if (opnum_eq(prog->code[i].op, OP_MACRO)) continue;
+	val = prog->code[i].arg.val;
+	if (!val || val->type != TYPE_ID) continue;
+	for (j = 0; j < n; j++) {
+	    if (strcmp(name[j], val->name) == 0) {
+		val->u.id.slot = j;
+		break;
+	    }
+	}
+    }
+    prog->nslots = n;
+    FREE(name);
+}
+
+/* Returns an array with an element for each instruction of prog and one for
+ * the end, which is true if any jump goes there.  Caller must FREE() it.
+ * (The comefroms counts used by vcode_add() don't include backward jumps.)
+ */
+static char *prog_jump_targets(const Program *prog)
+{
+    char *target;
+    int i;
+
+    target = XMALLOC(prog->len + 1);
+    memset(target, 0, prog->len + 1);
+    for (i = 0; i < prog->len; i++) {
+	if (op_type_is(prog->code[i].op, JUMP) &&
+	    prog->code[i].arg.i >= 0 && prog->code[i].arg.i <= prog->len)
+	    target[prog->code[i].arg.i] = 1;
+    }
+    return target;
+}
+
+#define is_const_push(inst) \
+    ((inst)->op == OP_PUSH && \
+    !((inst)->arg.val->type & (TYPE_ID | TYPE_FUNC | TYPE_CMD)))
+
+/* Apply op to the n values pushed by code[first...first+n-1], which must all
+ * be constants, and return the result, or NULL if it could not be computed
+ * without an error or warning.  Messages are discarded: if there is a
+ * problem, it will be reported when the code runs.
+ */
+static Value *fold_const(Program *prog, int first, opcode_t op, int n)
+{
+    Value *val = NULL;
+    TFILE *old_tferr = tferr;
+    conString *line;
+    int i, old_stacktop = stacktop, ok = 1;
+
+    tferr = tfopen(NULL, "q");
+    for (i = first; i < first + n; i++) {
+	prog->code[i].arg.val->count++;
+	if (!pushval(prog->code[i].arg.val)) {
+	    prog->code[i].arg.val->count--;
+	    ok = 0;
+	    break;
+	}
+    }
+    if (ok && reduce(op, n))
+	val = popval();
+    while (stacktop > old_stacktop)
+	freeval(popval());
+    while ((line = dequeue(tferr->u.queue))) {
+	conStringfree(line);
+	ok = 0;
+    }
+    tfclose(tferr);
+    tferr = old_tferr;
+    if (val && !ok) {
+	freeval(val);
+	val = NULL;
+    }
+    return val;
+}
+
+/* Remove instruction i, which is reachable.  If it is the one that echoes a
+ * statement for %mecho, it is replaced by a NOP instead.
+ */
+static void remove_live(Program *prog, char *gone, int i)
+{
+    inst_free(&prog->code[i]);
+    if (prog->code[i].start && prog->code[i].end)
+	prog->code[i].op = OP_NOP;
+    else
+	gone[i] = 1;
+}
+
+/* Whole program optimizations, which vcode_add() can't do because it sees
+ * only the code before each instruction as it is added.  Repeats until
+ * nothing changes:
+ * Folds calls of pure functions with constant arguments, and then any
+ * constant arithmetic that makes possible.
+ * Replaces a conditional jump on a constant with a JUMP or nothing.
+ * Removes code that can't be reached and jumps to the next instruction.
+ * Merges literal appends, including those made by folding.
+ * Instructions that are jumped to are never merged into the one before.
+ */
+static void prog_optimize(Program *prog)
+{
+    Instruction *inst;
+    char *target, *gone;
+    Value *val;
+    String *str;
+    int i, j, n, changed, taken;
+
+    do {
+	changed = 0;
+	target = prog_jump_targets(prog);
+	gone = XMALLOC(prog->len + 1);
+	memset(gone, 0, prog->len + 1);
+
+	for (i = 0; i < prog->len; i++) {
+	    inst = &prog->code[i];
+
+	    if ((op_type_is(inst->op, EXPR) && !op_has_sideeffect(inst->op)) ||
+		inst->op == OP_FUNC)
+	    {
+		/* e.g. {PUSH FUNC strlen; PUSH "foo"; FUNC 2} to {PUSH 3} */
+		n = inst->arg.i;
+		if (n > i) continue;
+		for (j = i - n; j < i; j++) {
+		    if (gone[j] || (j > i - n && target[j])) break;
+		    if (j == i - n && inst->op == OP_FUNC) {
+			if (prog->code[j].op != OP_PUSH ||
+			    !func_is_pure(prog->code[j].arg.val))
+			    break;
+		    } else if (!is_const_push(&prog->code[j])) {
+			break;
+		    }
+		}
+		if (j < i || target[i]) continue;
+		if (!(val = fold_const(prog, i - n, inst->op, n))) continue;
+		freeval(prog->code[i-n].arg.val);
+		prog->code[i-n].arg.val = val;
+		for (j = i - n + 1; j <= i; j++)
+		    remove_live(prog, gone, j);
+		changed = 1;
+
+	    } else if (opnum_eq(inst->op, OP_JZ) && i > 0 && !target[i] &&
+		!gone[i-1] && is_const_push(inst-1))
+	    {
+		/* e.g. {PUSH 0; JZ x} to {JUMP x}, {PUSH 1; JZ x} to {} */
+		taken = !valbool(inst[-1].arg.val) == !(inst->op & OPF_NEG);
+		freeval(inst[-1].arg.val);
+		inst[-1].arg.val = NULL;
+		if (taken) {
+		    inst[-1].op = OP_JUMP;
+		    inst[-1].arg.i = inst->arg.i;
+		} else {
+		    remove_live(prog, gone, i-1);
+		}
+		remove_live(prog, gone, i);
+		changed = 1;
+
+	    } else if (opnum_eq(inst->op, OP_JZ) && i > 1 && !target[i] &&
+		!target[i-1] && !gone[i-2] && is_const_push(inst-2) &&
+		inst[-1].op == OP_DUP && inst[-1].arg.i == 1)
+	    {
+		/* && and ||: {PUSH 0; DUP 1; JZ x; POP} to {PUSH 0; JUMP x},
+		 * {PUSH 1; DUP 1; JZ x; POP} to {} */
+		taken = !valbool(inst[-2].arg.val) == !(inst->op & OPF_NEG);
+		if (taken) {
+		    remove_live(prog, gone, i-1);
+		    inst->op = OP_JUMP;
+		    changed = 1;
+		} else if (i + 1 < prog->len && inst[1].op == OP_POP &&
+		    !target[i+1])
+		{
+		    for (j = i - 2; j <= i + 1; j++)
+			remove_live(prog, gone, j);
+		    changed = 1;
+		}
+
+	    } else if (opnum_eq(inst->op, OP_JRZ) && i > 0 && !target[i] &&
+		!gone[i-1] && inst[-1].op == OP_TEST && inst[-1].arg.val &&
+		!(inst[-1].arg.val->type & (TYPE_ID | TYPE_FUNC | TYPE_CMD)))
+	    {
+		/* {TEST 1; JRZ x} to {TEST 1} */
+		taken = !valbool(inst[-1].arg.val) == !(inst->op & OPF_NEG);
+		if (taken) {
+		    inst->op = OP_JUMP;
+		} else {
+		    remove_live(prog, gone, i);
+		}
+		changed = 1;
+
+	    } else if ((inst->op == OP_TEST || inst->op == OP_RETURN ||
+		inst->op == OP_RESULT) && !inst->arg.val && i > 0 &&
+		!target[i] && !gone[i-1] && is_const_push(inst-1))
+	    {
+		/* e.g. {PUSH 1; TEST NULL} to {TEST 1} */
+		inst->arg.val = inst[-1].arg.val;
+		inst[-1].arg.val = NULL;
+		remove_live(prog, gone, i-1);
+		changed = 1;
+
+	    } else if (inst->op == OP_APPEND && !inst->arg.str && i > 0 &&
+		!target[i] && !gone[i-1] && is_const_push(inst-1))
+	    {
+		/* e.g. {PUSH 6; APPEND NULL} to {APPEND "6"} */
+		(inst->arg.str = valstr(inst[-1].arg.val))->links++;
+		remove_live(prog, gone, i-1);
+		changed = 1;
+
+	    } else if (inst->op == OP_APPEND && inst->arg.str && i > 0 &&
+		!target[i] && !gone[i-1] && inst[-1].op == OP_APPEND &&
+		inst[-1].arg.str)
+	    {
+		/* e.g. {APPEND "x"; APPEND "y"} to {APPEND "xy"} */
+		str = SStringcat(Stringdup(inst[-1].arg.str), inst->arg.str);
+		conStringfree(inst[-1].arg.str);
+		(inst[-1].arg.str = CS(str))->links++;
+		if (inst->start && !inst[-1].start) {
+		    inst[-1].start = inst->start;
+		    inst[-1].end = inst->end;
+		    inst->start = inst->end = NULL;
+		}
+		remove_live(prog, gone, i);
+		changed = 1;
+
+	    } else if (inst->op == OP_JUMP && inst->arg.i == i + 1) {
+		remove_live(prog, gone, i);
+		changed = 1;
+
+	    } else if (inst->op == OP_JUMP || inst->op == OP_RETURN ||
+		inst->op == OP_RESULT)
+	    {
+		/* code after an unconditional jump is dead until a target */
+		for (j = i + 1; j < prog->len && !target[j]; j++) {
+		    inst_free(&prog->code[j]);
+		    gone[j] = 1;
+		    changed = 1;
+		}
+		i = j - 1;
+	    }
+	}
+
+	if (changed) {
+	    /* remove gone instructions, and renumber jumps past them */
+	    int *newaddr = XMALLOC((prog->len + 1) * sizeof(int));
+	    for (i = j = 0; i < prog->len; i++) {
+		newaddr[i] = j;
+		if (!gone[i]) prog->code[j++] = prog->code[i];
+	    }
+	    newaddr[i] = j;
+	    prog->len = j;
+	    for (i = 0; i < prog->len; i++) {
+		inst = &prog->code[i];
+		if (op_type_is(inst->op, JUMP) && inst->arg.i >= 0)
+		    inst->arg.i = newaddr[inst->arg.i];
+	    }
+	    FREE(newaddr);
+	}
+	FREE(target);
+	FREE(gone);
+    } while (changed);
+}
+
+#define is_compare(op) \
+    ((op) == OP_LT || (op) == OP_GT || (op) == OP_LTE || (op) == OP_GTE || \
+    (op) == OP_EQUAL || (op) == OP_NOTEQ)
+#define is_fusable_append(inst) \
+    (((inst)->op == OP_APPEND && (inst)->arg.str) || \
+    (inst)->op == OP_APARM || (inst)->op == OP_AVAR)
+
+/* Set the xop that prog_interpret() runs for each instruction of prog when
+ * it is not tracing.  That is the instruction's own op, except for these
+ * sequences, which get a superinstruction:
+ * {PUSH b; cmp 2; JZ x} (or JNZ) gets CMPJUMP on the PUSH.
+ * Each instruction in a run of two or more {APPEND str}, {APARM n}, or
+ * {AVAR id} gets APPENDS.
+ * This is done after the whole program is compiled, because the comefroms
+ * counts used by vcode_add() don't include backward jumps.
+ */
+static void prog_fuse(Program *prog)
+{
+    Instruction *inst;
+    char *target;
+    int i;
+
+    for (i = 0; i < prog->len; i++)
+	prog->code[i].xop = prog->code[i].op;
+    if (prog->len < 2) return;
+
+    target = prog_jump_targets(prog);
+    for (i = 0; i < prog->len - 1; i++) {
+	inst = &prog->code[i];
+	if (inst[0].op == OP_PUSH && i < prog->len - 2 &&
+	    is_compare(inst[1].op) && inst[1].arg.i == 2 &&
+	    opnum_eq(inst[2].op, OP_JZ) && !target[i+1] && !target[i+2])
+	{
+	    inst->xop = OP_CMPJUMP;
+	} else if (is_fusable_append(inst) && is_fusable_append(inst+1)) {
+	    inst[0].xop = inst[1].xop = OP_APPENDS;
+	}
+    }
+    FREE(target);
+}
+
 Program *compile_tf(conString *src, int srcstart, int subs, int is_expr,
     int optimize)
 {
@@ -383,10 +754,18 @@ Program *compile_tf(conString *src, int srcstart, int subs, int is_expr,
     prog->srcstart = srcstart;
     prog->mark = src->data + srcstart;
     prog->optimize = optimize_user ? optimize : 0;
+    prog->ndeps = is_expr ? 0 : -1;
+    prog->deps = NULL;
+    prog->cache = NULL;
+    prog->nslots = 0;
+    prog->links = 1;
     ip = src->data + srcstart;
     if (is_expr) {
 	if (expr(prog)) {
 	    if (!*ip) {
+		if (prog->optimize >= 2) prog_optimize(prog);
+		prog_find_deps(prog);
+		prog_fuse(prog);
 		if (cecho > invis_flag) prog_dump(prog);
 		return prog;
 	    }
@@ -395,6 +774,9 @@ Program *compile_tf(conString *src, int srcstart, int subs, int is_expr,
     } else {
 	if (list(prog, subs)) {
 	    if (!*ip) {
+		if (prog->optimize >= 2) prog_optimize(prog);
+		prog_assign_slots(prog);
+		prog_fuse(prog);
 		if (cecho > invis_flag) prog_dump(prog);
 		return prog;
 	    }
@@ -405,13 +787,109 @@ Program *compile_tf(conString *src, int srcstart, int subs, int is_expr,
     return NULL;
 }
 
+static void prog_cache_drop(ProgCache *pc)
+{
+    ProgCache **pcp;
+
+    for (pcp = &prog_bucket[pc->hash % PROG_CACHE_BUCKETS]; *pcp != pc;
+	pcp = &(*pcp)->hnext);
+    *pcp = pc->hnext;
+    pc->prev->next = pc->next;
+    pc->next->prev = pc->prev;
+    prog_free(pc->prog);	/* a caller running it may still hold a link */
+    FREE(pc);
+    prog_cache_count--;
+}
+
+/* Like compile_tf(src, srcstart, subs, is_expr, 0), but returns a cached
+ * Program if the same text was compiled the same way recently.  The caller
+ * must prog_free() the result.
+ */
+Program *prog_cache_get(conString *src, int srcstart, int subs, int is_expr)
+{
+    ProgCache *pc;
+    Program *prog;
+    String *copy;
+    const char *text = src->data + srcstart;
+    int len = src->len - srcstart;
+    unsigned int hash;
+    int i;
+
+    if (is_expr) subs = -1;
+    if (prog_cache <= 0 || len > PROG_CACHE_MAXLEN || src->charattrs ||
+	cecho > invis_flag)  /* so prog_dump() shows every compile */
+    {
+	while (prog_cache_count > 0 && prog_cache_count > prog_cache)
+	    prog_cache_drop(prog_lru.prev);
+	return compile_tf(src, srcstart, subs, is_expr, 0);
+    }
+
+    for (hash = len, i = 0; i < len; i++)
+	hash = (hash << 5) + hash + (unsigned char)text[i];
+
+    for (pc = prog_bucket[hash % PROG_CACHE_BUCKETS]; pc; pc = pc->hnext) {
+	if (pc->hash == hash && pc->subs == subs && pc->slash == oldslash &&
+	    pc->bslash == backslash &&
+	    pc->prog->src->len == len &&
+	    memcmp(pc->prog->src->data, text, len) == 0)
+	{
+	    /* move to front of LRU list */
+	    pc->prev->next = pc->next;
+	    pc->next->prev = pc->prev;
+	    pc->next = prog_lru.next;
+	    pc->prev = &prog_lru;
+	    prog_lru.next->prev = pc;
+	    prog_lru.next = pc;
+	    prog_cache_hits++;
+	    pc->prog->links++;
+	    return pc->prog;
+	}
+    }
+
+    prog_cache_misses++;
+    copy = Stringnew(text, len, 0);
+    if (!(prog = compile_tf(CS(copy), 0, subs, is_expr, 0)))
+	return NULL;  /* compile_tf() freed copy */
+
+    while (prog_cache_count >= prog_cache)
+	prog_cache_drop(prog_lru.prev);
+    pc = XMALLOC(sizeof(ProgCache));
+    pc->hash = hash;
+    pc->subs = subs;
+    pc->slash = oldslash;
+    pc->bslash = backslash;
+    pc->prog = prog;
+    pc->hnext = prog_bucket[hash % PROG_CACHE_BUCKETS];
+    prog_bucket[hash % PROG_CACHE_BUCKETS] = pc;
+    pc->next = prog_lru.next;
+    pc->prev = &prog_lru;
+    prog_lru.next->prev = pc;
+    prog_lru.next = pc;
+    prog_cache_count++;
+    prog->links++;	/* one for the cache, one for the caller */
+    return prog;
+}
+
+/* progcache() function */
+struct Value *prog_cache_stat(const char *field)
+{
+    if (strcmp("hits", field) == 0)
+	return newint(prog_cache_hits);
+    if (strcmp("misses", field) == 0)
+	return newint(prog_cache_misses);
+    if (strcmp("size", field) == 0)
+	return newint(prog_cache_count);
+    eprintf("illegal field name '%s'", field);
+    return shareval(val_blank);
+}
+
 int macro_run(conString *body, int bodystart, String *args, int offset,
     int subs, const char *name)
 {
     Program *prog;
     int result;
 
-    if (!(prog = compile_tf(body, bodystart, subs, 0, 0))) return 0;
+    if (!(prog = prog_cache_get(body, bodystart, subs, 0))) return 0;
     result = prog_run(prog, args, offset, name, 0);
     prog_free(prog);
     return result;
@@ -434,7 +912,7 @@ static int do_parmsub(String *dest, int first, int last, int *emptyp)
 		(dest = Stringnew(NULL, 0, 0))->links++;
 	    orig_len = dest->len;
 	    for (i = first; ; i++) {
-		SStringcat(dest, valstr(stack[argtop-tf_argc+i]));
+		valcat(dest, stack[argtop-tf_argc+i]);
 		if (i == last) break;
 		Stringadd(dest, ' ');
 	    }
@@ -469,16 +947,75 @@ static void do_mecho(const Program *prog, int i)
     }
 }
 
+/* Append the value of the variable named by idval to buf.  Returns true if
+ * the value was empty. */
+static int do_avar(String *buf, Value *idval)
+{
+    Value *val;
+    conString *constr;
+
+    idval->count++;
+    if (!(val = hgetnearestvarval(idval))) {
+	constr = blankline;
+	if (patmatch(&looks_like_special_sub_ic, NULL, idval->name)) {
+	    char upper[64];
+	    int i;
+	    for (i = 0; i < sizeof(upper) && idval->name[i]; i++)
+		upper[i] = ucase(idval->name[i]);
+	    wprintf("\"%%{%s}\" is a variable substitution, "
+		"and is not the same as special substitution "
+		"\"%%{%.*s}\".", idval->name, i, upper);
+	}
+    } else {
+	constr = valstr(val);
+    }
+    SStringcat(buf, constr);
+    freeval(idval);
+    return !constr->len;
+}
+
+/* With GCC's labels as values, each handler jumps directly to the next
+ * instruction's handler through label[]; otherwise, it goes back to the
+ * switch.  NEXT advances to the next instruction, and goes through
+ * prog_interpret_check only every CHECK_INTERVAL instructions or when
+ * exiting or tracing.
+ */
+#if defined(__GNUC__) && !defined(NO_THREADED_CODE)
+# define THREADED_CODE 1
+# define CASE(name)	case OP_##name: op_##name
+# define DISPATCH(x)	goto *label[(x) & OPLABEL_MASK]
+#else
+# define THREADED_CODE 0
+# define CASE(name)	case OP_##name
+# define DISPATCH(x)	do { xop = (x); goto prog_interpret_switch; } while (0)
+#endif
+
+#define CHECK_INTERVAL	64
+
+#define NEXT \
+    do { \
+	if (++cip >= prog->len) goto prog_interpret_done; \
+	if (++instruction_count > checkpoint || exiting || (mecho | iecho)) \
+	    goto prog_interpret_check; \
+	op = prog->code[cip].op; \
+	DISPATCH(prog->code[cip].xop); \
+    } while (0)
+
+/* TYPE_INT, TYPE_POS, or TYPE_ENUM, with no TYPE_STR or TYPE_REGMATCH */
+#define is_plain_int(val) \
+    (((val)->type & (TYPE_INT | TYPE_POS | TYPE_ENUM)) && \
+    !((val)->type & ~(TYPE_INT | TYPE_POS | TYPE_ENUM)))
+
 Value *prog_interpret(const Program *prog, int in_expr)
 {
     Value *val, *val2, *result = NULL;
     String *str, *tbuf;
-    conString *constr;
-    int cip, stackbot, no_arg;
+    conString *constr = NULL;
+    int cip, stackbot, no_arg = 0;
     int empty;	/* for varsub default */
-    opcode_t op;
+    opcode_t op, xop = 0;
     int first, last, n;
-    int instruction_count = 0;
+    int instruction_count = 0, checkpoint;
     String *buf;
     const char *cstr, *old_cmd;
     struct tf_frame {
@@ -491,6 +1028,14 @@ Value *prog_interpret(const Program *prog, int in_expr)
 #define which_tfile_p(c) \
     (c=='i' ? &tfin : c=='o' ? &tfout : c=='e' ? &tferr : NULL)
 #endif
+#if THREADED_CODE
+    static const void *const label[OPLABEL_MASK + 1] = {
+	[0 ... OPLABEL_MASK] = &&op_invalid,
+#define defopcode(name, num, optype, argtype, flag) \
+	[(num) | OPF_##flag] = &&op_##name,
+#include "opcodes.h"
+    };
+#endif
 
     frame = &first_frame;
     frame->local_tfin = frame->orig_tfin = tfin;
@@ -500,26 +1045,35 @@ Value *prog_interpret(const Program *prog, int in_expr)
     (buf = Stringnew(NULL, 0, 0))->links++;
     stackbot = stacktop;
 
-    for (cip = 0; cip < prog->len; cip++) {
-	if (exiting) break;
+    cip = -1;
+    checkpoint = 0;	/* do all the checks before the first instruction */
+    NEXT;
+
+prog_interpret_check:
+    /* Reached from NEXT when it's time to check for an interrupt or the
+     * instruction limit, or when exiting or tracing. */
+    if (exiting) goto prog_interpret_done;
+    if (instruction_count > checkpoint) {
 	if (interrupted()) {
 	    eprintf("Macro execution interrupted.");
 	    goto prog_interpret_exit;
 	}
-	if (max_instr > 0 && instruction_count > max_instr) {
+	if (max_instr > 0 && instruction_count > max_instr + 1) {
 	    eprintf("instruction count exceeded %max_instr (%d).", max_instr);
 	    goto prog_interpret_exit;
 	}
-	instruction_count++;
-	op = prog->code[cip].op;
+	checkpoint = instruction_count + CHECK_INTERVAL;
+	if (max_instr > 0 && checkpoint > max_instr + 1)
+	    checkpoint = max_instr + 1;
+    }
+    op = prog->code[cip].op;
+    if (mecho | iecho) {
 	if (mecho > invis_flag) do_mecho(prog, cip);
 	if (iecho > invis_flag) inst_dump(prog, cip, 'i');
-
-	if (op_type_is(op, EXPR)) {
-	    if (!reduce(op, prog->code[cip].arg.i))
-		goto prog_interpret_exit;
-	    continue;
-	}
+	/* run the original instructions, so every one is echoed */
+	DISPATCH(op);
+    }
+    DISPATCH(prog->code[cip].xop);
 
 #define setup_next_io() \
     do { \
@@ -539,379 +1093,432 @@ Value *prog_interpret(const Program *prog, int in_expr)
 	} \
     } while (0)
 
-	switch (op) {
-	case OP_PIPE:
-	    tfout = frame->outpipe = tfopen(NULL, "q");
-	    break;
-
-	case OP_EXECUTE:
-	    constr = prog->code[cip].arg.str;
-	    if ((no_arg = !constr)) constr = CS(buf);
-	    handle_command(constr);
-	    if (no_arg) Stringtrunc(buf, 0);
-	    setup_next_io();
-	    break;
-
-	case OP_ARG:
-	    constr = prog->code[cip].arg.str;
-	    if ((no_arg = !constr)) constr = CS(buf);
-	    /* no_arg and constr will be used by BUILTIN, MACRO, SET, ... */
-	    break;
-
-	case OP_LET:
-	case OP_SET:
-	case OP_SETENV:
-	    /* no_arg and constr were set by OP_ARG */
-	    do_set(prog->code[cip].arg.val->name,
-		prog->code[cip].arg.val->u.hash,
-		constr, 0, op == OP_SETENV, op == OP_LET);
-	    if (no_arg) Stringtrunc(buf, 0);
-	    break;
-
-	case OP_BUILTIN: case OP_NBUILTIN:
-	case OP_COMMAND: case OP_NCOMMAND:
-	    /* no_arg and constr were set by OP_ARG */
-	    str = execute_start(constr, &old_cmd); /*XXX optimize: don't dup buf */
-	    execute_command(prog->code[cip].arg.cmd, str, 0,
-		opnum_eq(op, OP_BUILTIN));
-	    execute_end(old_cmd, !(op & OPF_NEG), str);
-	    if (no_arg) Stringtrunc(buf, 0);
-	    setup_next_io();
-	    break;
-
-	case OP_MACRO: case OP_NMACRO:
-	    /* no_arg and constr were set by OP_ARG */
-	    str = execute_start(constr, &old_cmd); /*XXX optimize: don't dup buf */
-	    execute_macro(prog->code[cip].arg.val->name,
-		prog->code[cip].arg.val->u.hash, str, 0);
-	    execute_end(old_cmd, !(op & OPF_NEG), str);
-	    if (no_arg) Stringtrunc(buf, 0);
-	    setup_next_io();
-	    break;
-
-	case OP_SEND:
-	    constr = prog->code[cip].arg.str;
-	    if ((no_arg = !constr)) constr = CS(buf);
-	    if (constr->len || !snarf) {
+#if !THREADED_CODE
+prog_interpret_switch:
+#endif
+    switch (xop) {
+    /* expression operators */
+#define defopcode(name, num, optype, argtype, flag)	EXPR_CASE_##optype(name)
+#define EXPR_CASE_EXPR(name)	CASE(name):
+#define EXPR_CASE_SUB(name)
+#define EXPR_CASE_JUMP(name)
+#define EXPR_CASE_CTRL(name)
+#include "opcodes.h"
+#undef EXPR_CASE_EXPR
+#undef EXPR_CASE_SUB
+#undef EXPR_CASE_JUMP
+#undef EXPR_CASE_CTRL
+	if (!reduce(op, prog->code[cip].arg.i))
+	    goto prog_interpret_exit;
+	NEXT;
+
+    CASE(PIPE):
+	tfout = frame->outpipe = tfopen(NULL, "q");
+	NEXT;
+
+    CASE(EXECUTE):
+	constr = prog->code[cip].arg.str;
+	if ((no_arg = !constr)) constr = CS(buf);
+	handle_command(constr);
+	if (no_arg) Stringtrunc(buf, 0);
+	setup_next_io();
+	NEXT;
+
+    CASE(ARG):
+	constr = prog->code[cip].arg.str;
+	if ((no_arg = !constr)) constr = CS(buf);
+	/* no_arg and constr will be used by BUILTIN, MACRO, SET, ... */
+	NEXT;
+
+    CASE(LET):
+	/* no_arg and constr were set by OP_ARG */
+	do_let(prog->code[cip].arg.val, constr);
+	if (no_arg) Stringtrunc(buf, 0);
+	NEXT;
+
+    CASE(SET):
+    CASE(SETENV):
+	/* no_arg and constr were set by OP_ARG */
+	do_set(prog->code[cip].arg.val->name,
+	    prog->code[cip].arg.val->u.id.hash,
+	    constr, 0, op == OP_SETENV, 0);
+	if (no_arg) Stringtrunc(buf, 0);
+	NEXT;
+
+    CASE(BUILTIN): CASE(NBUILTIN):
+    CASE(COMMAND): CASE(NCOMMAND):
+	/* no_arg and constr were set by OP_ARG */
+	str = execute_start(constr, &old_cmd); /*XXX optimize: don't dup buf */
+	execute_command(prog->code[cip].arg.cmd, str, 0,
+	    opnum_eq(op, OP_BUILTIN));
+	execute_end(old_cmd, !(op & OPF_NEG), str);
+	if (no_arg) Stringtrunc(buf, 0);
+	setup_next_io();
+	NEXT;
+
+    CASE(MACRO): CASE(NMACRO):
+	/* no_arg and constr were set by OP_ARG */
+	str = execute_start(constr, &old_cmd); /*XXX optimize: don't dup buf */
+	execute_macro(prog->code[cip].arg.val->name,
+	    prog->code[cip].arg.val->u.id.hash, str, 0);
+	execute_end(old_cmd, !(op & OPF_NEG), str);
+	if (no_arg) Stringtrunc(buf, 0);
+	setup_next_io();
+	NEXT;
+
+    CASE(SEND):
+	constr = prog->code[cip].arg.str;
+	if ((no_arg = !constr)) constr = CS(buf);
+	if (constr->len || !snarf) {
 #if 0
-		if (/*(subs == SUB_MACRO) &&*//*XXX*/ (mecho > invis_flag))
-		    tfprintf(tferr, "%S%s%S%A", do_mprefix(), "SEND: ", constr,
-			mecho_attr);
+	    if (/*(subs == SUB_MACRO) &&*//*XXX*/ (mecho > invis_flag))
+		tfprintf(tferr, "%S%s%S%A", do_mprefix(), "SEND: ", constr,
+		    mecho_attr);
 #endif
-		if (!do_hook(H_SEND, NULL, "%S", constr)) {
-		    set_user_result(newint(send_line(constr->data, constr->len,
-			TRUE)));
-		}
+	    if (!do_hook(H_SEND, NULL, "%S", constr)) {
+		set_user_result(newint(send_line(constr->data, constr->len,
+		    TRUE)));
 	    }
-	    if (no_arg) Stringtrunc(buf, 0);
-	    setup_next_io();
-	    break;
-
-	case OP_APPEND:
-	    constr = prog->code[cip].arg.str;
-	    if (!constr) {
-		SStringcat(buf, valstr(popval()));
-		freeval(opd(0));
+	}
+	if (no_arg) Stringtrunc(buf, 0);
+	setup_next_io();
+	NEXT;
+
+    CASE(APPEND):
+	constr = prog->code[cip].arg.str;
+	if (!constr) {
+	    valcat(buf, popval());
+	    freeval(opd(0));
+	} else {
+	    SStringcat(buf, constr);
+	}
+	NEXT;
+    CASE(APPENDS):
+	/* a run of {APPEND str}, {APARM n}, and {AVAR id} */
+	while (1) {
+	    if (op == OP_APPEND) {
+		SStringcat(buf, prog->code[cip].arg.str);
+	    } else if (op == OP_APARM) {
+		first = prog->code[cip].arg.i - 1;
+		if (!do_parmsub(buf, first, first, &empty))
+		    goto prog_interpret_exit;
 	    } else {
-		SStringcat(buf, constr);
+		empty = do_avar(buf, prog->code[cip].arg.val);
 	    }
-	    break;
+	    if (cip + 1 >= prog->len || prog->code[cip+1].xop != OP_APPENDS)
+		break;
+	    op = prog->code[++cip].op;
+	    instruction_count++;
+	}
+	NEXT;
 
 #define jumpaddr(prog) \
-	((prog->code[cip].arg.i < 0) ? prog->len : prog->code[cip].arg.i - 1)
+    ((prog->code[cip].arg.i < 0) ? prog->len : prog->code[cip].arg.i - 1)
 
-	case OP_JUMP:
+    CASE(JUMP):
+	cip = jumpaddr(prog);
+	NEXT;
+    CASE(JZ):
+	if (!valbool(popval()))
 	    cip = jumpaddr(prog);
-	    break;
-	case OP_JZ:
-	    if (!valbool(popval()))
-		cip = jumpaddr(prog);
-	    freeval(opd(0));
-	    break;
-	case OP_JNZ:
-	    if (valbool(popval()))
-		cip = jumpaddr(prog);
-	    freeval(opd(0));
-	    break;
-	case OP_JRZ:
-	    if (!valbool(user_result))
-		cip = jumpaddr(prog);
-	    break;
-	case OP_JRNZ:
-	    if (valbool(user_result))
-		cip = jumpaddr(prog);
-	    break;
-	case OP_JNEMPTY:
-	    /* empty was set by one of the varsub operators */
-	    if (!empty)
-		cip = jumpaddr(prog);
-	    break;
-
-	case OP_EXPR:
-	    /* Evaulate the expression contained in buf and push its value */
-	    val = expr_value(buf->data);
-	    Stringtrunc(buf, 0);
-	    val = val ? valval(val) : shareval(val_zero);
-	    if (!pushval(val)) goto prog_interpret_exit;
-	    break;
-
-	case OP_RETURN:
-	case OP_RESULT:
-	    if ((val = prog->code[cip].arg.val))
-		val->count++;
-	    else
-		val = popval();
-	    set_user_result(valval(val));
-	    if (op == OP_RESULT && !argtop) {
-		constr = valstr(val);
-		oputline(constr ? constr : blankline);
-	    }
-	    cip = prog->len - 1;
-	    setup_next_io();
-	    break;
-	case OP_TEST:
-	    if ((val = prog->code[cip].arg.val))
-		val->count++;
-	    else
-		val = popval();
-	    set_user_result(valval(val));
-	    setup_next_io();
-	    break;
-	case OP_PUSHBUF:
-	    if (!pushval(newptr(buf))) /* XXX optimize */
-		goto prog_interpret_exit;
-	    (buf = Stringnew(NULL, 0, 0))->links++;
-	    break;
-	case OP_POPBUF:
-	    Stringfree(buf);
-	    buf = valptr(popval()); /* XXX optimize */
-	    freeval(opd(0));
-	    break;
-	case OP_CMDSUB:
-	    if (!pushval(newptr(frame))) /* XXX optimize */
-		goto prog_interpret_exit;
-	    frame = XMALLOC(sizeof(*frame));
-	    frame->local_tfout = tfout = tfopen(NULL, "q");
-	    frame->local_tfin = tfin;
-	    frame->inpipe = frame->outpipe = NULL;
-	    break;
+	freeval(opd(0));
+	NEXT;
+    CASE(JNZ):
+	if (valbool(popval()))
+	    cip = jumpaddr(prog);
+	freeval(opd(0));
+	NEXT;
+    CASE(JRZ):
+	if (!valbool(user_result))
+	    cip = jumpaddr(prog);
+	NEXT;
+    CASE(JRNZ):
+	if (valbool(user_result))
+	    cip = jumpaddr(prog);
+	NEXT;
+    CASE(JNEMPTY):
+	/* empty was set by one of the varsub operators */
+	if (!empty)
+	    cip = jumpaddr(prog);
+	NEXT;
+    CASE(CMPJUMP):
+	/* {PUSH b; compare 2; JZ or JNZ}, with the other operand on the
+	 * stack.  Plain integers are compared here; anything else goes
+	 * through PUSH, reduce(), and JZ. */
+	val = opd(1);
+	if (val->type == TYPE_ID && !(val = hgetnearestvarval(val)))
+	    val = val_zero;
+	val2 = prog->code[cip].arg.val;
+	if (val2->type == TYPE_ID && !(val2 = hgetnearestvarval(val2)))
+	    val2 = val_zero;
+	if (!is_plain_int(val) || !is_plain_int(val2))
+	    DISPATCH(op);
+	switch (prog->code[cip+1].op) {
+	case OP_LT:	n = val->u.ival < val2->u.ival;		break;
+	case OP_GT:	n = val->u.ival > val2->u.ival;		break;
+	case OP_LTE:	n = val->u.ival <= val2->u.ival;	break;
+	case OP_GTE:	n = val->u.ival >= val2->u.ival;	break;
+	case OP_EQUAL:	n = val->u.ival == val2->u.ival;	break;
+	default:	n = val->u.ival != val2->u.ival;	break;
+	}
+	freeval(popval());
+	instruction_count += 2;
+	cip += 2;
+	if (!n == !(prog->code[cip].op & OPF_NEG))
+	    cip = jumpaddr(prog);
+	NEXT;
+
+    CASE(EXPR):
+	/* Evaulate the expression contained in buf and push its value */
+	val = expr_value(buf->data);
+	Stringtrunc(buf, 0);
+	val = val ? valval(val) : shareval(val_zero);
+	if (!pushval(val)) goto prog_interpret_exit;
+	NEXT;
+
+    CASE(RETURN):
+    CASE(RESULT):
+	if ((val = prog->code[cip].arg.val))
+	    val->count++;
+	else
+	    val = popval();
+	set_user_result(valval(val));
+	if (op == OP_RESULT && !argtop) {
+	    constr = valstr(val);
+	    oputline(constr ? constr : blankline);
+	}
+	cip = prog->len - 1;
+	setup_next_io();
+	NEXT;
+    CASE(TEST):
+	if ((val = prog->code[cip].arg.val))
+	    val->count++;
+	else
+	    val = popval();
+	set_user_result(valval(val));
+	setup_next_io();
+	NEXT;
+    CASE(PUSHBUF):
+	if (!pushval(newptr(buf))) /* XXX optimize */
+	    goto prog_interpret_exit;
+	(buf = Stringnew(NULL, 0, 0))->links++;
+	NEXT;
+    CASE(POPBUF):
+	Stringfree(buf);
+	buf = valptr(popval()); /* XXX optimize */
+	freeval(opd(0));
+	NEXT;
+    CASE(CMDSUB):
+	if (!pushval(newptr(frame))) /* XXX optimize */
+	    goto prog_interpret_exit;
+	frame = XMALLOC(sizeof(*frame));
+	frame->local_tfout = tfout = tfopen(NULL, "q");
+	frame->local_tfin = tfin;
+	frame->inpipe = frame->outpipe = NULL;
+	NEXT;
 #if 0
-	case OP_POPFILE:
-	    filep = which_tfile_p(prog->code[cip].arg.c);
-	    tfclose(*filep);
-	    *filep = (TFILE*)valptr(popval()); /* XXX optimize */
-	    freeval(opd(0));
-	    break;
+    CASE(POPFILE):
+	filep = which_tfile_p(prog->code[cip].arg.c);
+	tfclose(*filep);
+	*filep = (TFILE*)valptr(popval()); /* XXX optimize */
+	freeval(opd(0));
+	NEXT;
 #endif
-	case OP_ACMDSUB:
-	case OP_PCMDSUB:
-	    if (op_is_push(op))
-		(tbuf = Stringnew(NULL, 0, 0))->links++;
-	    else
-		tbuf = buf;
-	    first = 1;
-	    while ((constr = dequeue((tfout)->u.queue))) {
-		if (!((constr->attrs & F_GAG) && gag)) {
-		    if (!first) {
-			Stringadd(tbuf, ' ');
-			if (tbuf->charattrs) tbuf->charattrs[tbuf->len] = 0;
-		    }
-		    first = 0;
-		    SStringcat(tbuf, constr);
+    CASE(ACMDSUB):
+    CASE(PCMDSUB):
+	if (op_is_push(op))
+	    (tbuf = Stringnew(NULL, 0, 0))->links++;
+	else
+	    tbuf = buf;
+	first = 1;
+	while ((constr = dequeue((tfout)->u.queue))) {
+	    if (!((constr->attrs & F_GAG) && gag)) {
+		if (!first) {
+		    Stringadd(tbuf, ' ');
+		    if (tbuf->charattrs) tbuf->charattrs[tbuf->len] = 0;
 		}
-		conStringfree(constr);
+		first = 0;
+		SStringcat(tbuf, constr);
 	    }
-	    tfclose(tfout);
-	    FREE(frame);
-	    frame = valptr(popval()); /* XXX optimize */
-	    tfout = frame->outpipe ? frame->outpipe : frame->local_tfout;
-	    tfin = frame->inpipe ? frame->inpipe : frame->local_tfin;
-	    freeval(opd(0));
-	    if (op_is_push(op)) {
-		if (!pushval(newSstr(CS(tbuf))))
-		    goto prog_interpret_exit;
-		Stringfree(tbuf);
-	    }
-	    break;
-	case OP_PBUF:
+	    conStringfree(constr);
+	}
+	tfclose(tfout);
+	FREE(frame);
+	frame = valptr(popval()); /* XXX optimize */
+	tfout = frame->outpipe ? frame->outpipe : frame->local_tfout;
+	tfin = frame->inpipe ? frame->inpipe : frame->local_tfin;
+	freeval(opd(0));
+	if (op_is_push(op)) {
+	    if (!pushval(newSstr(CS(tbuf))))
+		goto prog_interpret_exit;
+	    Stringfree(tbuf);
+	}
+	NEXT;
+    CASE(PBUF):
+	constr = CS(buf);
+	buf = valptr(popval()); /* XXX optimize */
+	freeval(opd(0));
+	if (!pushval(newSstr(constr)))
+	    goto prog_interpret_exit;
+	conStringfree(constr);
+	NEXT;
+    CASE(AMAC):
+    CASE(PMAC):
+	if ((constr = prog->code[cip].arg.str)) {
+	    constr->links++;
+	} else {
 	    constr = CS(buf);
 	    buf = valptr(popval()); /* XXX optimize */
 	    freeval(opd(0));
-	    if (!pushval(newSstr(constr)))
-		goto prog_interpret_exit;
-	    conStringfree(constr);
-	    break;
-	case OP_AMAC:
-	case OP_PMAC:
-	    if ((constr = prog->code[cip].arg.str)) {
-		constr->links++;
-	    } else {
-		constr = CS(buf);
-		buf = valptr(popval()); /* XXX optimize */
-		freeval(opd(0));
-	    }
-	    if (!(cstr = macro_body(constr->data))) {
-		tfprintf(tferr, "%% macro not defined: %S", constr);
-	    }
-	    if (op_is_push(op)) {
-		if (!pushval(newstr(cstr ? cstr : "", -1)))
-		    goto prog_interpret_exit;
-	    } else if (cstr) {
-		Stringcat(buf, cstr);
-	    }
-	    if (mecho > invis_flag)
-		tfprintf(tferr, "%S$%S --> %s%A", do_mprefix(), constr, cstr,
-		    mecho_attr);
-	    conStringfree(constr);
-	    break;
-	case OP_AVAR:
-	    (val = (prog->code[cip].arg.val))->count++;
-	    if (!(val2 = hgetnearestvarval(val))) {
-		constr = blankline;
-		if (patmatch(&looks_like_special_sub_ic, NULL, val->name)) {
-		    char upper[64];
-		    int i;
-		    for (i = 0; i < sizeof(upper) && val->name[i]; i++)
-			upper[i] = ucase(val->name[i]);
-		    wprintf("\"%%{%s}\" is a variable substitution, "
-			"and is not the same as special substitution "
-			"\"%%{%.*s}\".", val->name, i, upper);
-		}
-	    } else {
-		constr = valstr(val2);
-	    }
-	    empty = !constr->len;
-	    SStringcat(buf, constr);
-	    freeval(val);
-	    break;
-	case OP_PVAR:
-	    (val = (prog->code[cip].arg.val))->count++;
-	    (val = valval(val))->count++;
-	    if (!pushval(val))
-		goto prog_interpret_exit;
-	    empty = (val->type & TYPE_STR && !val->sval->len);
-	    freeval(val);
-	    break;
-	case OP_AREG:
-	    empty = (regsubstr(buf, prog->code[cip].arg.i) <= 0);
-	    break;
-	case OP_PREG:
-	    str = Stringnew(NULL, 0, 0);
-	    empty = (regsubstr(str, prog->code[cip].arg.i) <= 0);
-	    if (empty) Stringcat(str, "");
-	    if (!pushval(newSstr(CS(str))))
-		goto prog_interpret_exit;
-	    break;
-	case OP_APARM:
-	    first = prog->code[cip].arg.i - 1;
-	    if (!do_parmsub(buf, first, first, &empty))
-		goto prog_interpret_exit;
-	    break;
-	case OP_PPARM:
-	    first = prog->code[cip].arg.i - 1;
-	    if (!do_parmsub(NULL, first, first, &empty))
-		goto prog_interpret_exit;
-	    break;
-	case OP_AXPARM:
-	    if (!do_parmsub(buf, prog->code[cip].arg.i, tf_argc - 1, &empty))
-		goto prog_interpret_exit;
-	    break;
-	case OP_PXPARM:
-	    if (!do_parmsub(NULL, prog->code[cip].arg.i, tf_argc - 1, &empty))
-		goto prog_interpret_exit;
-	    break;
-	case OP_ALPARM:
-	    first = tf_argc - prog->code[cip].arg.i;
-	    if (!do_parmsub(buf, first, first, &empty))
-		goto prog_interpret_exit;
-	    break;
-	case OP_PLPARM:
-	    first = tf_argc - prog->code[cip].arg.i;
-	    if (!do_parmsub(NULL, first, first, &empty))
-		goto prog_interpret_exit;
-	    break;
-	case OP_ALXPARM:
-	    last = tf_argc - prog->code[cip].arg.i - 1;
-	    if (!do_parmsub(buf, 0, last, &empty))
-		goto prog_interpret_exit;
-	    break;
-	case OP_PLXPARM:
-	    last = tf_argc - prog->code[cip].arg.i - 1;
-	    if (!do_parmsub(NULL, 0, last, &empty))
-		goto prog_interpret_exit;
-	    break;
-	case OP_APARM_CNT:
-	    empty = 0;
-	    Sappendf(buf, "%d", tf_argc);
-	    break;
-	case OP_PPARM_CNT:
-	    empty = 0;
-	    if (!pushval(newint(tf_argc)))
-		goto prog_interpret_exit;
-	    break;
-	case OP_ARESULT:
-	    empty = 0;
-	    SStringcat(buf, valstr(user_result));
-	    break;
-	case OP_PRESULT:
-	    empty = 0;
-	    if (!pushval(user_result))
-		goto prog_interpret_exit;
-	    user_result->count++;
-	    break;
-	case OP_ACMDNAME:
-	    if (!(empty = !(current_command && *current_command != '\b')))
-		Stringcat(buf, current_command);
-	    break;
-	case OP_PCMDNAME:
-	    if ((empty = !(current_command && *current_command != '\b')))
-		val = shareval(val_blank);
-	    else
-		val = newstr(current_command, -1);
-	    if (!pushval(val))
-		goto prog_interpret_exit;
-	    break;
-	case OP_APARM_ALL:
-	    if (!do_parmsub(buf, 0, tf_argc - 1, &empty))
-		goto prog_interpret_exit;
-	    break;
-	case OP_PPARM_ALL:
-	    if (!do_parmsub(NULL, 0, tf_argc - 1, &empty))
-		goto prog_interpret_exit;
-	    break;
-	case OP_APARM_RND:
-	    n = tf_argc ? RRAND(0, tf_argc - 1) : -1;
-	    if (!do_parmsub(buf, n, n, &empty))
-		goto prog_interpret_exit;
-	    break;
-	case OP_PPARM_RND:
-	    n = tf_argc ? RRAND(0, tf_argc - 1) : -1;
-	    if (!do_parmsub(NULL, n, n, &empty))
+	}
+	if (!(cstr = macro_body(constr->data))) {
+	    tfprintf(tferr, "%% macro not defined: %S", constr);
+	}
+	if (op_is_push(op)) {
+	    if (!pushval(newstr(cstr ? cstr : "", -1)))
 		goto prog_interpret_exit;
-	    break;
-	case OP_DUP:	/* duplicate the ARGth item from the top of the stack */
-	    (val = opd(prog->code[cip].arg.i))->count++;
-	    if (!pushval(val)) goto prog_interpret_exit;
-	    break;
-	case OP_POP:	/* argument is ignored */
-	    freeval(popval());
-	    break;
-	case OP_PUSH:	/* push (Value*)ARG onto stack */
-	    (val = (prog->code[cip].arg.val))->count++;
-	    if (!pushval(val)) goto prog_interpret_exit;
-	    break;
-	case OP_ENDIF:
-	case OP_DONE:
-	case OP_NOP:
-	    /* no op: place holders for mecho pointers */
-	    break;
-	default:
-	    internal_error(__FILE__, __LINE__, "invalid opcode 0x%04X at %d",
-		op, cip);
-	    goto prog_interpret_exit;
+	} else if (cstr) {
+	    Stringcat(buf, cstr);
 	}
+	if (mecho > invis_flag)
+	    tfprintf(tferr, "%S$%S --> %s%A", do_mprefix(), constr, cstr,
+		mecho_attr);
+	conStringfree(constr);
+	NEXT;
+    CASE(AVAR):
+	empty = do_avar(buf, prog->code[cip].arg.val);
+	NEXT;
+    CASE(PVAR):
+	(val = (prog->code[cip].arg.val))->count++;
+	(val = valval(val))->count++;
+	if (!pushval(val))
+	    goto prog_interpret_exit;
+	empty = (val->type & TYPE_STR && !val->sval->len);
+	freeval(val);
+	NEXT;
+    CASE(AREG):
+	empty = (regsubstr(buf, prog->code[cip].arg.i) <= 0);
+	NEXT;
+    CASE(PREG):
+	str = Stringnew(NULL, 0, 0);
+	empty = (regsubstr(str, prog->code[cip].arg.i) <= 0);
+	if (empty) Stringcat(str, "");
+	if (!pushval(newSstr(CS(str))))
+	    goto prog_interpret_exit;
+	NEXT;
+    CASE(APARM):
+	first = prog->code[cip].arg.i - 1;
+	if (!do_parmsub(buf, first, first, &empty))
+	    goto prog_interpret_exit;
+	NEXT;
+    CASE(PPARM):
+	first = prog->code[cip].arg.i - 1;
+	if (!do_parmsub(NULL, first, first, &empty))
+	    goto prog_interpret_exit;
+	NEXT;
+    CASE(AXPARM):
+	if (!do_parmsub(buf, prog->code[cip].arg.i, tf_argc - 1, &empty))
+	    goto prog_interpret_exit;
+	NEXT;
+    CASE(PXPARM):
+	if (!do_parmsub(NULL, prog->code[cip].arg.i, tf_argc - 1, &empty))
+	    goto prog_interpret_exit;
+	NEXT;
+    CASE(ALPARM):
+	first = tf_argc - prog->code[cip].arg.i;
+	if (!do_parmsub(buf, first, first, &empty))
+	    goto prog_interpret_exit;
+	NEXT;
+    CASE(PLPARM):
+	first = tf_argc - prog->code[cip].arg.i;
+	if (!do_parmsub(NULL, first, first, &empty))
+	    goto prog_interpret_exit;
+	NEXT;
+    CASE(ALXPARM):
+	last = tf_argc - prog->code[cip].arg.i - 1;
+	if (!do_parmsub(buf, 0, last, &empty))
+	    goto prog_interpret_exit;
+	NEXT;
+    CASE(PLXPARM):
+	last = tf_argc - prog->code[cip].arg.i - 1;
+	if (!do_parmsub(NULL, 0, last, &empty))
+	    goto prog_interpret_exit;
+	NEXT;
+    CASE(APARM_CNT):
+	empty = 0;
+	Sappendf(buf, "%d", tf_argc);
+	NEXT;
+    CASE(PPARM_CNT):
+	empty = 0;
+	if (!pushval(newint(tf_argc)))
+	    goto prog_interpret_exit;
+	NEXT;
+    CASE(ARESULT):
+	empty = 0;
+	valcat(buf, user_result);
+	NEXT;
+    CASE(PRESULT):
+	empty = 0;
+	if (!pushval(user_result))
+	    goto prog_interpret_exit;
+	user_result->count++;
+	NEXT;
+    CASE(ACMDNAME):
+	if (!(empty = !(current_command && *current_command != '\b')))
+	    Stringcat(buf, current_command);
+	NEXT;
+    CASE(PCMDNAME):
+	if ((empty = !(current_command && *current_command != '\b')))
+	    val = shareval(val_blank);
+	else
+	    val = newstr(current_command, -1);
+	if (!pushval(val))
+	    goto prog_interpret_exit;
+	NEXT;
+    CASE(APARM_ALL):
+	if (!do_parmsub(buf, 0, tf_argc - 1, &empty))
+	    goto prog_interpret_exit;
+	NEXT;
+    CASE(PPARM_ALL):
+	if (!do_parmsub(NULL, 0, tf_argc - 1, &empty))
+	    goto prog_interpret_exit;
+	NEXT;
+    CASE(APARM_RND):
+	n = tf_argc ? RRAND(0, tf_argc - 1) : -1;
+	if (!do_parmsub(buf, n, n, &empty))
+	    goto prog_interpret_exit;
+	NEXT;
+    CASE(PPARM_RND):
+	n = tf_argc ? RRAND(0, tf_argc - 1) : -1;
+	if (!do_parmsub(NULL, n, n, &empty))
+	    goto prog_interpret_exit;
+	NEXT;
+    CASE(DUP):	/* duplicate the ARGth item from the top of the stack */
+	(val = opd(prog->code[cip].arg.i))->count++;
+	if (!pushval(val)) goto prog_interpret_exit;
+	NEXT;
+    CASE(POP):	/* argument is ignored */
+	freeval(popval());
+	NEXT;
+    CASE(PUSH):	/* push (Value*)ARG onto stack */
+	(val = (prog->code[cip].arg.val))->count++;
+	if (!pushval(val)) goto prog_interpret_exit;
+	NEXT;
+    CASE(ENDIF):
+    CASE(DONE):
+    CASE(NOP):
+	/* no op: place holders for mecho pointers */
+	NEXT;
+    default:
+#if THREADED_CODE
+    op_invalid:
+#endif
+	internal_error(__FILE__, __LINE__, "invalid opcode 0x%04X at %d",
+	    op, cip);
+	goto prog_interpret_exit;
     }
 
+prog_interpret_done:
     if (stacktop == stackbot + in_expr) {
 	if (in_expr) {
 	    result = popval();
@@ -949,7 +1556,7 @@ int prog_run(const Program *prog, const String *args, int offset,
     const conString *saved_argstring;
     const char *saved_command;
     TFILE *saved_tfin, *saved_tfout, *saved_tferr;
-    List scope[1];
+    VarScope scope[1];
 
     if (++recur_count > max_recur && max_recur) {
         eprintf("recursion count exceeded %max_recur (%d)", max_recur);
@@ -969,7 +1576,7 @@ int prog_run(const Program *prog, const String *args, int offset,
     if (name) current_command = name;
     cmdsub_count = 0;
 
-    pushvarscope(scope);
+    pushvarscope(scope, prog->nslots);
     if (kbnumlocal) {
 	/* TODO: make this local %kbnum const */
 	setlocalintvar("kbnum", kbnumlocal);
@@ -1093,30 +1700,25 @@ static void vcode_add(Program *prog, opcode_t op, int use_mark, va_list ap)
 	     * constant operands can be reduced at compile time.
 	     */
 	    /* e.g. {PUSH 3; PUSH 4; +;} to {PUSH 7} */
+	    /* If it fails (e.g. division by zero), leave it for runtime to
+	     * report. */
 	    if (!op_has_sideeffect(inst->op)) {
 		int i, n;
-		int old_stacktop = stacktop;
+		Value *val;
 		n = inst->arg.i;
 		for (i = prog->len - n - 1; i < prog->len - 1; i++) {
 		    if (!inst_is_const(prog->code+i) || prog->code[i+1].comefroms)
 			return;
 		}
-		for (i = prog->len - n - 1; i < prog->len - 1; i++) {
-		    if (!pushval(prog->code[i].arg.val))
-			goto const_expr_error;
-		    prog->code[i].arg.val = NULL;
-		}
-		if (!reduce(inst->op, n))
-		    goto const_expr_error;
+		if (!(val = fold_const(prog, prog->len - n - 1, inst->op, n)))
+		    return;
+		for (i = prog->len - n - 1; i < prog->len - 1; i++)
+		    freeval(prog->code[i].arg.val);
 		prog->len -= n;
 		inst = &prog->code[prog->len - 1];
 		/* inst->op = OP_PUSH; */ /* already true */
-		inst->arg.val = popval();
+		inst->arg.val = val;
 		continue;
-	    const_expr_error:
-		while (stacktop > old_stacktop)
-		    freeval(popval());
-		return /* 0 */; /* XXX */
 	    }
 	    return;
 
@@ -1206,9 +1808,11 @@ static void vcode_add(Program *prog, opcode_t op, int use_mark, va_list ap)
 		    inst->op = inst[1].op ^ OPF_NEG;
 		    inst->arg = inst[1].arg;
 		    continue;
-		} else if (inst_is_const(inst-1)) {
+		} else if (inst_is_const(inst-1) && inst->arg.i >= 0) {
 		    /* e.g., {PUSH INT 0; JZ x;} to {JUMP x;} */
 		    /* e.g., {PUSH INT 1; JZ x;} to {} */
+		    /* Not if x is a place holder: comefrom() would patch the
+		     * wrong instruction.  prog_optimize() gets those. */
 		    int flag;
 		    prog->len--;
 		    inst--;
@@ -1814,7 +2418,7 @@ static int expand(Program *prog, String *dest, int subs, opcmd_t *opcmdp)
 		    /* MACRO: ptr is ID name */
 		    Value *val = newid(dest->data + i, dest->len - i);
 		    if (dest->data[i] == '#') /* macro_hash() */
-			val->u.hash = atoi(dest->data + i + 1);
+			val->u.id.hash = atoi(dest->data + i + 1);
 		    opcmdp->ptr = val;
 		    opcmdp->op = OP_MACRO;
 		}
@@ -2235,6 +2839,8 @@ struct Value *handle_shift_command(String *args, int offset)
 #if USE_DMALLOC
 void free_expand()
 {
+    while (prog_cache_count > 0)
+	prog_cache_drop(prog_lru.prev);
     freeval(user_result);
     freeval(val_blank);
     freeval(val_one);
@@ -34,6 +34,9 @@ extern struct Program *compile_tf(conString *body, int bodystart, int subs,
 extern int macro_run(conString *body, int boffset, String *args, int offset,
     int subs, const char *name);
 extern Value *prog_interpret(const Program *prog, int in_expr);
+extern struct Program *prog_cache_get(conString *src, int srcstart,
+    int subs, int is_expr);
+extern struct Value *prog_cache_stat(const char *field);
 extern String *do_mprefix(void);
 extern const char **keyword(const char *id);
 extern void eat_newline(Program *prog);
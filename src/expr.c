@@ -55,11 +55,12 @@ static Value *valpool = NULL;		/* freelist */
 
 typedef struct ExprFunc {
     const char *name;		/* name invoked by user */
+    int pure;			/* result depends only on args */
     unsigned min, max;		/* allowable argument counts */
 } ExprFunc;
 
 static ExprFunc functab[] = {
-#define funccode(name, pure, min, max)  { #name, min, max }
+#define funccode(name, pure, min, max)  { #name, pure, min, max }
 #include "funclist.h"
 #undef funccode
 };
@@ -100,15 +101,102 @@ Value *expr_value(const char *expression)
 
     if (!expression) return shareval(val_blank);
     str = CS(Stringnew(expression, -1, 0)); /* XXX String should be a param */
-    if (!(prog = compile_tf(str, 0, -1, 1, 0))) return NULL;
+    str->links++;
+    prog = prog_cache_get(str, 0, -1, 1);
+    conStringfree(str);
+    if (!prog) return NULL;
     result = prog_interpret(prog, 1);
     prog_free(prog);
     return result;
 }
 
+/* Returns the value of prog.  If prog reads only global variables and
+ * calls only pure functions, its value is remembered, and returned again
+ * without interpretation until one of those variables changes.  (Not while
+ * a macro is running, since its local variables could hide the globals.)
+ * Caller must freeval() the value.
+ */
 Value *expr_value_safe(Program *prog)
 {
-    return prog_interpret(prog, 1);
+    Value *result;
+    ProgDep *dep;
+    int i;
+
+    if (prog->ndeps < 0 || in_local_scope())
+	return prog_interpret(prog, 1);
+
+    if (prog->cache && prog->cachegen == var_gen) {
+	for (i = 0, dep = prog->deps; i < prog->ndeps; i++, dep++) {
+	    if (dep->var && dep->var->version != dep->version)
+		break;
+	}
+	if (i == prog->ndeps)
+	    return shareval(prog->cache);
+    }
+
+    result = prog_interpret(prog, 1);
+    if (result && result->type == TYPE_ID)
+	result = valval(result);  /* don't leave the lookup for later */
+    if (prog->cache) freeval(prog->cache);
+    if ((prog->cache = result)) {
+	result->count++;
+	prog->cachegen = var_gen;
+	for (i = 0, dep = prog->deps; i < prog->ndeps; i++, dep++) {
+	    dep->var = hffindglobalvar(dep->id->name, dep->id->u.id.hash);
+	    dep->version = dep->var ? dep->var->version : 0;
+	}
+    }
+    return result;
+}
+
+/* Find the global variables read by expression prog, so its value can be
+ * cached by expr_value_safe().  prog->ndeps is set to -1 if prog does
+ * anything else that could change its value or have a side effect.
+ */
+void prog_find_deps(Program *prog)
+{
+    int i, n = 0;
+    opcode_t op;
+    Value *val;
+
+    for (i = 0; i < prog->len && prog->ndeps >= 0; i++) {
+	op = prog->code[i].op;
+	val = prog->code[i].arg.val;
+	switch (op) {
+	case OP_PUSH:
+	    if (val->type == TYPE_CMD)
+		prog->ndeps = -1;
+	    else if (val->type == TYPE_ID)
+		n++;
+	    break;
+	case OP_PVAR:
+	    n++;
+	    break;
+	case OP_FUNC: /* purity was checked by unary_expr() */
+	case OP_DUP:
+	case OP_POP:
+	case OP_JZ:
+	case OP_JNZ:
+	case OP_JUMP:
+	    break;
+	default:
+	    if (!op_type_is(op, EXPR) || op_has_sideeffect(op))
+		prog->ndeps = -1;
+	    break;
+	}
+    }
+    if (prog->ndeps < 0 || n == 0) return;
+
+    prog->deps = XMALLOC(n * sizeof(ProgDep));
+    for (i = 0; i < prog->len; i++) {
+	op = prog->code[i].op;
+	val = prog->code[i].arg.val;
+	if ((op == OP_PUSH && val->type == TYPE_ID) || op == OP_PVAR) {
+	    prog->deps[prog->ndeps].id = val;
+	    prog->deps[prog->ndeps].var = NULL;
+	    prog->ndeps++;
+	}
+    }
 }
 
 
@@ -192,7 +280,8 @@ Value *newid_fl(const char *id, int len, const char *file, int line)
     new = strncpy((char *)xmalloc(NULL, len + 1, file, line), id, len);
     new[len] = '\0';
     val->name = new;
-    val->u.hash = hash_string(new);	/* cache hashkey to speed lookup */
+    val->u.id.hash = hash_string(new);	/* cache hashkey to speed lookup */
+    val->u.id.slot = -1;
     return val;
 }
 
@@ -393,77 +482,90 @@ double valfloat(const Value *val)
 }
 #endif /* NO_FLOAT */
 
-/* return String value of item (only valid for lifetime of val!) */
-/* If C had "mutable", sval could be mutable, and val could be const */
-conString *valstr(Value *val)
+/* Append the string form of numeric val to dest. */
+static void numstr(String *dest, const Value *val)
 {
     const char *p;
-    String *sval;
     long sec, usec;
+    int start;
 
-    if (!val) return NULL;
-    if (val->type == TYPE_ID) {
-        if (!(val = hgetnearestvarval(val)))
-            return blankline;
-    }
-
-    /* use existing sval (but floats may be affected by %sigfigs) */
-    if (val->sval && val->type != TYPE_FLOAT)
-        return val->sval;
-
-    /* generate and cache new sval */
     switch (val->type & TYPES_BASIC) {
-        case TYPE_STR:
-        case TYPE_ENUM:
-            val->sval = blankline;
-            break;
         case TYPE_INT:
         case TYPE_POS:
-            sval = Stringnew(NULL, 0, 0);
-            Sprintf(sval, "%ld", val->u.ival);
-            val->sval = CS(sval);
+            Sappendf(dest, "%ld", val->u.ival);
             break;
         case TYPE_DECIMAL:
         case TYPE_ATIME:
 	    /* s.u format */
-            sval = Stringnew(NULL, 0, 0);
-	    tftime(sval, NULL, &val->u.tval);
-            val->sval = CS(sval);
+	    tftime(dest, NULL, &val->u.tval);
             break;
         case TYPE_DTIME:
-            sval = Stringnew(NULL, 0, 0);
             sec = val->u.tval.tv_sec;
 	    if (sec >= 60 || sec <= -60) {
 		/* h:mm:ss.u format */
 		usec = val->u.tval.tv_usec;
 		if (sec < 0) {
-		    Stringadd(sval, '-');
+		    Stringadd(dest, '-');
 		    sec = -sec;
 		    usec = -usec;
 		}
-		Sappendf(sval, "%ld:%02ld", sec/3600, (sec/60)%60);
+		Sappendf(dest, "%ld:%02ld", sec/3600, (sec/60)%60);
 		if (sec % 60 || usec)
-		    Sappendf(sval, ":%02ld", sec % 60);
+		    Sappendf(dest, ":%02ld", sec % 60);
 		if (usec)
-		    append_usec(sval, usec, 1);
+		    append_usec(dest, usec, 1);
 	    } else {
 		/* s.u format */
-		tftime(sval, NULL, &val->u.tval);
+		tftime(dest, NULL, &val->u.tval);
 	    }
-            val->sval = CS(sval);
             break;
 #if !NO_FLOAT
         case TYPE_FLOAT:
-	    if (val->sval) conStringfree(val->sval);
-	    sval = Stringnew(NULL, 0, 0);
-            Sprintf(sval, "%.*g", sigfigs, val->u.fval);
+	    start = dest->len;
+            Sappendf(dest, "%.*g", sigfigs, val->u.fval);
             /* note: appending ".0" could imply more precision than is proper */
-            for (p = sval->data; is_digit(*p); p++) ;
+            for (p = dest->data + start; is_digit(*p); p++) ;
             if (!*p)
-                Stringadd(sval, '.');
-            val->sval = CS(sval);
+                Stringadd(dest, '.');
             break;
 #endif
+    }
+}
+
+/* return String value of item (only valid for lifetime of val!) */
+/* If C had "mutable", sval could be mutable, and val could be const */
+conString *valstr(Value *val)
+{
+    String *sval;
+
+    if (!val) return NULL;
+    if (val->type == TYPE_ID) {
+        if (!(val = hgetnearestvarval(val)))
+            return blankline;
+    }
+
+    /* use existing sval (but floats may be affected by %sigfigs) */
+    if (val->sval && val->type != TYPE_FLOAT)
+        return val->sval;
+
+    /* generate and cache new sval */
+    switch (val->type & TYPES_BASIC) {
+        case TYPE_STR:
+        case TYPE_ENUM:
+            val->sval = blankline;
+            break;
+        case TYPE_INT:
+        case TYPE_POS:
+        case TYPE_DECIMAL:
+        case TYPE_ATIME:
+        case TYPE_DTIME:
+#if !NO_FLOAT
+        case TYPE_FLOAT:
+#endif
+	    if (val->sval) conStringfree(val->sval);  /* old FLOAT sval */
+	    numstr(sval = Stringnew(NULL, 0, 0), val);
+            val->sval = CS(sval);
+            break;
         default:
 	    internal_error(__FILE__, __LINE__, "valstr: impossible type %d",
 		val->type);
@@ -473,6 +575,26 @@ conString *valstr(Value *val)
     return val->sval;
 }
 
+/* Append string value of val to dest.  Like SStringcat(dest, valstr(val)),
+ * but a number with no sval yet is formatted directly into dest, instead of
+ * into a new sval that would be thrown away with a temporary val.
+ */
+String *valcat(String *dest, Value *val)
+{
+    if (!val) return dest;
+    if (val->type == TYPE_ID) {
+        if (!(val = hgetnearestvarval(val)))
+            return dest;
+    }
+    if (val->sval && val->type != TYPE_FLOAT)
+        return SStringcat(dest, val->sval);
+    if (val->type & TYPE_NUM)
+	numstr(dest, val);
+    else
+	SStringcat(dest, valstr(val));
+    return dest;
+}
+
 /* return String data (char*) of item (only valid for lifetime of val!) */
 const char *valstd(Value *val)
 {
@@ -856,9 +978,11 @@ static Value *function_switch(const ExprFunc *func, int n, const char *parent)
 	    return expr_value(opdstd(1));
 
         case FN_addworld:
-    /* addworld(name, type, host, port, char, pass, file, flags, srchost) */
+    /* addworld(name, type, host, port, char, pass, file, flags, srchost,
+     *     weight) */
 	  {
-	    int flags = 0;
+	    int flags = 0, weight = 0;
+	    World *w;
 
             if (restriction >= RESTRICT_WORLD) {
                 eprintf("restricted");
@@ -884,7 +1008,12 @@ static Value *function_switch(const ExprFunc *func, int n, const char *parent)
 		}
             }
 
-            return newint(!!new_world(
+            if (n > 9 && (weight = opdint(n-9)) < 0) {
+                eprintf("invalid weight %d", weight);
+                return shareval(val_zero);
+            }
+
+            w = new_world(
                 opdstd(n-0),                /* name */
                 opdstd(n-1),                /* type */
                 n>2 ? opdstd(n-2) : "",     /* host */
@@ -893,7 +1022,9 @@ static Value *function_switch(const ExprFunc *func, int n, const char *parent)
                 n>5 ? opdstd(n-5) : "",     /* pass */
                 n>6 ? opdstd(n-6) : "",     /* mfile */
                 flags,			    /* flags */
-		n>8 ? opdstd(n-8) : ""));   /* srchost */
+		n>8 ? opdstd(n-8) : "");    /* srchost */
+            if (w && weight) w->weight = weight;
+            return newint(!!w);
 	  }
 
         case FN_columns:
@@ -1251,6 +1382,12 @@ static Value *function_switch(const ExprFunc *func, int n, const char *parent)
             }
             return newstr(str, -1);
 
+        case FN_sockstat:
+            return sockstat(n>=2 ? opdstd(2) : NULL, opdstd(1));
+
+        case FN_progcache:
+            return prog_cache_stat(opdstd(1));
+
         case FN_is_connected:
             return newint(is_connected(n>0 ? opdstd(1) : ""));
 
@@ -1276,7 +1413,7 @@ static Value *function_switch(const ExprFunc *func, int n, const char *parent)
         case FN_strcat:
             Sstr = opdstrdup(n);
             for (n--; n; n--)
-                SStringcat(Sstr, opdstr(n));
+                valcat(Sstr, opd(n));
             return newSstr(CS(Sstr));
 
         case FN_strrep:
@@ -1544,6 +1681,13 @@ static inline ExprFunc *find_builtin_func(const char *name) {
 	sizeof(functab)/sizeof(ExprFunc), sizeof(ExprFunc), strstructcmp);
 }
 
+/* Is val a resolved builtin function whose result depends only on its
+ * arguments? */
+int func_is_pure(const Value *val)
+{
+    return val->type == TYPE_FUNC && ((const ExprFunc *)val->u.p)->pure;
+}
+
 static Value *do_function(int n /* number of operands (including func id) */)
 {
     Value *val, *func_result;
@@ -1585,7 +1729,7 @@ static Value *do_function(int n /* number of operands (including func id) */)
 	cmd = valptr(val);
 	if (cmd->macro)
 	    macro = (cmd->macro);
-    } else if (!(macro = find_hashed_macro(val->name, val->u.hash))) {
+    } else if (!(macro = find_hashed_macro(val->name, val->u.id.hash))) {
 	eprintf("%s: no such function", val->name);
 	return NULL;
     }
@@ -1843,6 +1987,8 @@ static int unary_expr(Program *prog, int could_be_div_or_macro)
                     ++ip;
                 }
             }
+	    if (!funcrec || !funcrec->pure)
+		prog->ndeps = -1;	/* value of prog can't be cached */
 	    if (funcrec && (n-1 < funcrec->min || n-1 > funcrec->max)) {
 		eprintf((funcrec->min == funcrec->max) ?
 		    "%s: found %d arguments, expected %d" :
@@ -9,19 +9,19 @@
 
 /* sorted by name */
 /*	 Name		Pure	Arguments */
-/*			(!used)	Min Max	  */
+/*				Min Max	  */
 
 funccode(abs,		1,	1,  1),
 funccode(acos,		1,	1,  1),
-funccode(addworld,	0,	2,  9),
+funccode(addworld,	0,	2, 10),
 funccode(ascii,		1,	1,  1),
 funccode(asin,		1,	1,  1),
 funccode(atan,		1,	1,  1),
-funccode(char,		1,	1,  1),
+funccode(char,		0,	1,  1), /* !pure: uses locale */
 funccode(columns,	0,	0,  0),
 funccode(cos,		1,	1,  1),
 funccode(cputime,	0,	0,  0),
-funccode(decode_ansi,	1,	1,  1),
+funccode(decode_ansi,	0,	1,  1), /* !pure: uses %tabsize */
 funccode(decode_attr,	1,	1,  3),
 funccode(echo,		0,	1,  4),
 funccode(encode_ansi,	1,	1,  1),
@@ -50,7 +50,7 @@ funccode(kbtail,	0,	0,  0),
 funccode(kbwordleft,	0,	0,  1),
 funccode(kbwordright,	0,	0,  1),
 funccode(keycode,	0,	1,  1),
-funccode(lines,		1,	0,  0),
+funccode(lines,		0,	0,  0),
 funccode(ln,		1,	1,  1),
 funccode(log10,		1,	1,  1),
 funccode(mktime,	0,	1,  7), /* !pure: uses TZ */
@@ -64,6 +64,7 @@ funccode(nmail,		0,	0,  0),
 funccode(nread,		0,	0,  0),
 funccode(pad,		1,	1,  (unsigned)-1),
 funccode(pow,		1,	2,  2),
+funccode(progcache,	0,	1,  1),
 funccode(prompt,	0,	1,  1),
 funccode(rand,		0,	0,  2),
 funccode(read,		0,	0,  0),
@@ -72,9 +73,10 @@ funccode(replace,	1,	3,  3),
 funccode(send,		0,	1,  3),
 funccode(sidle,		0,	0,  1),
 funccode(sin,		1,	1,  1),
+funccode(sockstat,	0,	1,  2),
 funccode(sqrt,		1,	1,  1),
-funccode(status_fields,	1,	0,  1),
-funccode(status_width,	1,	1,  1),
+funccode(status_fields,	0,	0,  1),
+funccode(status_width,	0,	1,  1),
 funccode(strcat,	1,	1,  (unsigned)-1),
 funccode(strchr,	1,	2,  3),
 funccode(strcmp,	1,	2,  2),
@@ -85,7 +87,7 @@ funccode(strncmp,	1,	3,  3),
 funccode(strrchr,	1,	2,  3),
 funccode(strrep,	1,	2,  2),
 funccode(strstr,	1,	2,  3),
-funccode(substitute,	1,	1,  3),
+funccode(substitute,	0,	1,  3), /* !pure: changes trigger text */
 funccode(substr,	1,	2,  3),
 funccode(systype,	1,	0,  0),
 funccode(tan,		1,	1,  1),
@@ -97,9 +99,9 @@ funccode(tfread,	0,	1,  2),
 funccode(tfreadable,	0,	1,  1),
 funccode(tfwrite,	0,	1,  2),
 funccode(time,		0,	0,  0),
-funccode(tolower,	1,	1,  2),
-funccode(toupper,	1,	1,  2),
+funccode(tolower,	0,	1,  2), /* !pure: uses locale */
+funccode(toupper,	0,	1,  2), /* !pure: uses locale */
 funccode(trunc,		1,	1,  1),
 funccode(whatis,	1,	1,  1),
-funccode(winlines,	1,	0,  0),
+funccode(winlines,	0,	0,  0),
 funccode(world_info,	0,	0,  2)
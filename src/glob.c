@@ -0,0 +1,571 @@
+/*************************************************************************
+ *  TinyFugue - programmable mud client
+ *  Copyright (C) 1993, 1994, 1995, 1996, 1997, 1998, 1999, 2002, 2003, 2004, 2005, 2006-2007 Ken Keys
+ *
+ *  TinyFugue (aka "tf") is protected under the terms of the GNU
+ *  General Public License.  See the file "COPYING" for details.
+ ************************************************************************/
+static const char RCSid[] = "$Id$";
+
+
+/*
+ * Glob pattern matching.
+ *
+ * smatch() interprets a glob pattern string directly.  Patterns that will
+ * be matched many times (triggers, hooks, etc.) are instead translated once
+ * by glob_compile() into a GlobProg, a list of ops with lowercased literals
+ * and precomputed character class bitmaps, and matched by glob_exec().
+ * The two must always give the same result.
+ */
+
+#include "tfconfig.h"
+#include "port.h"
+#include "tf.h"
+#include "util.h"
+#include "pattern.h"
+#include "search.h"	/* for tfio.h */
+#include "tfio.h"
+
+enum {
+    GOP_END,	/* end of pattern: matches end of string */
+    GOP_EOW,	/* end of a {...} alternative: matches end of word */
+    GOP_CHAR,	/* literal char, matched ignoring case */
+    GOP_ANY,	/* '?' */
+    GOP_CLASS,	/* '[...]' */
+    GOP_STAR,	/* '*' */
+    GOP_WORD,	/* '{...}'; followed by a GOP_ALT for each alternative */
+    GOP_ALT	/* start of an alternative, ending with GOP_EOW */
+};
+
+typedef struct GlobOp {
+    unsigned char op;	/* GOP_* */
+    unsigned char ch;	/* GOP_CHAR: lowercased char */
+    unsigned char alt;	/* GOP_CHAR: the other char that lcase()s to ch */
+    int arg;		/* GOP_CLASS: index in classes; GOP_WORD: index of op
+			 * after group; GOP_ALT: index of next GOP_ALT, or of
+			 * op after group */
+} GlobOp;
+
+typedef unsigned char GlobClass[256 / 8];
+
+struct GlobProg {
+    GlobOp *ops;
+    GlobClass *classes;
+    int nops, maxops;
+    int nclasses;
+    int simple;		/* no {...}, so glob_exec() needn't recurse */
+    int tail;		/* index of fixed width ops after last '*', or -1 */
+    int tailwidth;	/* chars matched by ops starting at tail */
+};
+
+#define char_is(op, c) \
+    ((unsigned char)(c) == (op)->ch || (unsigned char)(c) == (op)->alt)
+
+#define class_has(gp, op, c) \
+    ((gp)->classes[(op)->arg][(unsigned char)(c) >> 3] & \
+	(1 << ((unsigned char)(c) & 7)))
+
+static const char *cmatch(const char *pat, int ch);
+static int  glob_emit(GlobProg *gp, int op, int ch, int arg);
+static void glob_emit_char(GlobProg *gp, int ch);
+static unsigned char *glob_new_class(GlobProg *gp);
+static const char *glob_compile_class(GlobProg *gp, const char *p);
+static const char *glob_compile_word(GlobProg *gp, const char *p);
+static const char *glob_compile_seq(GlobProg *gp, const char *p, int inword);
+static int  glob_match(const GlobProg *gp, const GlobOp *op,
+    const char *str, const char *start, int inword);
+static int  glob_match_simple(const GlobProg *gp, const char *str);
+
+
+/* class is a pointer to a string of the form "[...]..."
+ * ch is compared against the character class described by class.
+ * If ch matches, cmatch() returns a pointer to the char after ']' in class;
+ * otherwise, cmatch() returns NULL.
+ */
+static const char *cmatch(const char *class, int ch)
+{
+    int not;
+
+    ch = lcase(ch);
+    if ((not = (*++class == '^'))) ++class;
+
+    while (1) {
+        if (*class == ']') return (char*)(not ? class + 1 : NULL);
+        if (*class == '\\') ++class;
+        if (class[1] == '-' && class[2] != ']') {
+            char lo = *class;
+            class += 2;
+            if (*class == '\\') ++class;
+            if (ch >= lcase(lo) && ch <= lcase(*class)) break;
+        } else if (lcase(*class) == ch) break;
+        ++class;
+    }
+    return not ? NULL : (estrchr(++class, ']', '\\') + 1);
+}
+
+/* smatch_check() should be used on pat to check pattern syntax before
+ * calling smatch().
+ */
+/* Based on code by Leo Plotkin. */
+
+int smatch(const char *pat, const char *str)
+{
+    const char *start = str;
+    static int inword = FALSE;
+
+    while (*pat) {
+        switch (*pat) {
+
+        case '\\':
+            pat++;
+            if (lcase(*pat++) != lcase(*str++)) return 1;
+            break;
+
+        case '?':
+            if (!*str || (inword && is_space(*str))) return 1;
+            str++;
+            pat++;
+            break;
+
+        case '*':
+            while (*pat == '*' || *pat == '?') {
+                if (*pat == '?') {
+                    if (!*str || (inword && is_space(*str))) return 1;
+                    str++;
+                }
+                pat++;
+            }
+            if (inword) {
+                while (*str && !is_space(*str))
+                    if (!smatch(pat, str++)) return 0;
+                return smatch(pat, str);
+            } else if (!*pat) {
+                return 0;
+            } else if (*pat == '{') {
+                if (str == start || is_space(str[-1]))
+                    if (!smatch(pat, str)) return 0;
+                for ( ; *str; str++)
+                    if (is_space(*str) && !smatch(pat, str+1)) return 0;
+                return 1;
+            } else if (*pat == '[') {
+                while (*str) if (!smatch(pat, str++)) return 0;
+                return 1;
+            } else {
+                char c = (pat[0] == '\\' && pat[1]) ? pat[1] : pat[0];
+                for (c = lcase(c); *str; str++)
+                    if (lcase(*str) == c && !smatch(pat, str))
+                        return 0;
+                return 1;
+            }
+
+        case '[':
+            if (inword && is_space(*str)) return 1;
+            if (!(pat = cmatch(pat, *str++))) return 1;
+            break;
+
+        case '{':
+            if (str != start && !is_space(*(str - 1))) return 1;
+            {
+                const char *end;
+                int result = 1;
+
+                /* This can't happen if smatch_check is used first. */
+                if (!(end = estrchr(pat, '}', '\\'))) {
+                    eprintf("smatch: unmatched '{'");
+                    return 1;
+                }
+
+                inword = TRUE;
+                for (pat++; pat <= end; pat++) {
+                    if ((result = smatch(pat, str)) == 0) break;
+                    if (!(pat = estrchr(pat, '|', '\\'))) break;
+                }
+                inword = FALSE;
+                if (result) return result;
+                pat = end + 1;
+                while (*str && !is_space(*str)) str++;
+            }
+            break;
+
+        case '}': case '|':
+            if (inword) return (*str && !is_space(*str));
+            /* else FALL THROUGH to default case */
+
+        default:
+            if (lcase(*pat++) != lcase(*str++)) return 1;
+            break;
+        }
+    }
+    return lcase(*pat) - lcase(*str);
+}
+
+/* verify syntax of smatch pattern */
+int smatch_check(const char *pat)
+{
+    int inword = FALSE;
+    const char *patstart = pat;
+
+    while (*pat) {
+        switch (*pat) {
+        case '\\':
+            if (*++pat) pat++;
+            break;
+        case '[':
+            if (!(pat = estrchr(pat, ']', '\\'))) {
+                eprintf("glob error: unmatched '['");
+                return 0;
+            }
+            pat++;
+            break;
+        case '{':
+            if (inword) {
+                eprintf("glob error: nested '{'");
+                return 0;
+            }
+	    if (!(pat==patstart || is_space(pat[-1]) || strchr("*?]", pat[-1])))
+	    {
+                eprintf("glob error: '%c' before '{' can never match", pat[-1]);
+		return 0;
+	    }
+            inword = TRUE;
+            pat++;
+            break;
+        case '}':
+	    if (!(!pat[1] || is_space(pat[1]) || strchr("*?[", pat[1]))) {
+                eprintf("glob error: '%c' after '}' can never match", pat[1]);
+		return 0;
+	    }
+            inword = FALSE;
+            pat++;
+            break;
+        case '?':
+        case '*':
+        default:
+	    if (inword && is_space(*pat)) {
+                eprintf("glob error: space inside '{...}' can never match");
+		return 0;
+	    }
+            pat++;
+            break;
+        }
+    }
+    if (inword) eprintf("glob error: unmatched '{'");
+    return !inword;
+}
+
+
+/* Add an op to gp, and return its index. */
+static int glob_emit(GlobProg *gp, int op, int ch, int arg)
+{
+    if (gp->nops == gp->maxops) {
+	gp->maxops *= 2;
+	gp->ops = XREALLOC(gp->ops, sizeof(GlobOp) * gp->maxops);
+    }
+    gp->ops[gp->nops].op = op;
+    gp->ops[gp->nops].ch = ch;
+    gp->ops[gp->nops].alt = ch;
+    gp->ops[gp->nops].arg = arg;
+    return gp->nops++;
+}
+
+/* Add an empty class to gp, and return its bitmap. */
+static unsigned char *glob_new_class(GlobProg *gp)
+{
+    gp->classes = XREALLOC(gp->classes, sizeof(GlobClass) * (gp->nclasses+1));
+    memset(gp->classes[gp->nclasses], 0, sizeof(GlobClass));
+    return gp->classes[gp->nclasses];
+}
+
+/* Add an op matching any char c with lcase(c) == lcase(ch).  That is
+ * usually just ch and one other char, which can be compared directly;
+ * otherwise (in some locales) a class is used.
+ */
+static void glob_emit_char(GlobProg *gp, int ch)
+{
+    int c, i, n = 0, other = 0;
+    unsigned char *bits;
+
+    ch = lcase(ch);
+    for (c = 1; c < 256; c++) {
+	if (c != ch && lcase(c) == ch) {
+	    other = c;
+	    n++;
+	}
+    }
+    if (n <= 1) {
+	i = glob_emit(gp, GOP_CHAR, ch, 0);
+	gp->ops[i].alt = n ? other : ch;
+	return;
+    }
+    bits = glob_new_class(gp);
+    for (c = 1; c < 256; c++)
+	if (lcase(c) == ch) bits[c >> 3] |= 1 << (c & 7);
+    glob_emit(gp, GOP_CLASS, 0, gp->nclasses++);
+}
+
+/* Compile the class starting at p, which points to '['. */
+static const char *glob_compile_class(GlobProg *gp, const char *p)
+{
+    unsigned char *bits;
+    int c;
+
+    bits = glob_new_class(gp);
+    for (c = 1; c < 256; c++)
+	if (cmatch(p, c)) bits[c >> 3] |= 1 << (c & 7);
+    glob_emit(gp, GOP_CLASS, 0, gp->nclasses++);
+
+    /* find the closing ']' the same way cmatch() does */
+    if (*++p == '^') p++;
+    while (*p && *p != ']') {
+	if (*p == '\\' && p[1]) p++;
+	if (p[1] == '-' && p[2] && p[2] != ']') {
+	    p += 2;
+	    if (*p == '\\' && p[1]) p++;
+	}
+	p++;
+    }
+    return *p ? p + 1 : p;
+}
+
+/* Compile the {...} group starting at p, which points to '{'.  The
+ * alternatives are found the same way smatch() finds them.
+ */
+static const char *glob_compile_word(GlobProg *gp, const char *p)
+{
+    const char *end;
+    int word, alt = -1;
+
+    gp->simple = FALSE;
+    word = glob_emit(gp, GOP_WORD, 0, 0);
+    if (!(end = estrchr(p, '}', '\\'))) {
+	/* can't happen if smatch_check() is used first; never matches */
+	gp->ops[word].arg = gp->nops;
+	return p + strlen(p);
+    }
+    for (p++; p <= end; p++) {
+	if (alt >= 0) gp->ops[alt].arg = gp->nops;
+	alt = glob_emit(gp, GOP_ALT, 0, 0);
+	glob_compile_seq(gp, p, TRUE);
+	glob_emit(gp, GOP_EOW, 0, 0);
+	if (!(p = estrchr(p, '|', '\\'))) break;
+    }
+    gp->ops[alt].arg = gp->ops[word].arg = gp->nops;
+    return end + 1;
+}
+
+/* Compile pattern text up to the end of p, or, if inword, up to the '}' or
+ * '|' that ends the alternative.
+ */
+static const char *glob_compile_seq(GlobProg *gp, const char *p, int inword)
+{
+    while (*p) {
+	switch (*p) {
+	case '\\':
+	    /* a trailing '\' is ignored */
+	    if (*++p) glob_emit_char(gp, *p++);
+	    break;
+	case '?':
+	    glob_emit(gp, GOP_ANY, 0, 0);
+	    p++;
+	    break;
+	case '*':
+	    /* like smatch(), match any '?'s in a run of '*'s and '?'s first */
+	    for ( ; *p == '*' || *p == '?'; p++)
+		if (*p == '?') glob_emit(gp, GOP_ANY, 0, 0);
+	    glob_emit(gp, GOP_STAR, 0, 0);
+	    break;
+	case '[':
+	    p = glob_compile_class(gp, p);
+	    break;
+	case '}': case '|':
+	    if (inword) return p;
+	    glob_emit_char(gp, *p++);
+	    break;
+	case '{':
+	    if (!inword) {
+		p = glob_compile_word(gp, p);
+		break;
+	    }
+	    /* else FALL THROUGH (nested '{' is rejected by smatch_check()) */
+	default:
+	    glob_emit_char(gp, *p++);
+	    break;
+	}
+    }
+    return p;
+}
+
+/* Translate pat, which should have passed smatch_check(), into a GlobProg
+ * for glob_exec().
+ */
+GlobProg *glob_compile(const char *pat)
+{
+    GlobProg *gp;
+    int i;
+
+    gp = XMALLOC(sizeof(GlobProg));
+    gp->maxops = strlen(pat) + 2;
+    gp->ops = XMALLOC(sizeof(GlobOp) * gp->maxops);
+    gp->nops = 0;
+    gp->classes = NULL;
+    gp->nclasses = 0;
+    gp->simple = TRUE;
+    glob_compile_seq(gp, pat, FALSE);
+    glob_emit(gp, GOP_END, 0, 0);
+
+    /* If only fixed width ops follow the last '*', they can only match at
+     * the end of the string, so glob_exec() can go straight there. */
+    gp->tail = -1;
+    gp->tailwidth = 0;
+    if (gp->simple) {
+	for (i = gp->nops - 2; i >= 0 && gp->ops[i].op != GOP_STAR; i--)
+	    gp->tailwidth++;
+	if (i >= 0) gp->tail = i + 1;
+    }
+    return gp;
+}
+
+void glob_free(GlobProg *gp)
+{
+    FREE(gp->ops);
+    if (gp->classes) FREE(gp->classes);
+    FREE(gp);
+}
+
+/* General matcher.  This follows smatch() step for step, including which
+ * positions a '*' tries, so that {...} words behave identically.
+ */
+static int glob_match(const GlobProg *gp, const GlobOp *op,
+    const char *str, const char *start, int inword)
+{
+    const GlobOp *alt;
+
+    while (1) {
+	switch (op->op) {
+	case GOP_END:
+	    return !*str;
+
+	case GOP_EOW:
+	    return !*str || is_space(*str);
+
+	case GOP_CHAR:
+	    if (!char_is(op, *str)) return FALSE;
+	    str++;
+	    break;
+
+	case GOP_ANY:
+	    if (!*str || (inword && is_space(*str))) return FALSE;
+	    str++;
+	    break;
+
+	case GOP_CLASS:
+	    if (!*str || (inword && is_space(*str)) || !class_has(gp, op, *str))
+		return FALSE;
+	    str++;
+	    break;
+
+	case GOP_STAR:
+	    op++;
+	    if (inword) {
+		for ( ; *str && !is_space(*str); str++)
+		    if (glob_match(gp, op, str, str, inword)) return TRUE;
+		return glob_match(gp, op, str, str, inword);
+	    } else if (op->op == GOP_END) {
+		return TRUE;
+	    } else if (op->op == GOP_WORD) {
+		if (str == start || is_space(str[-1]))
+		    if (glob_match(gp, op, str, str, inword)) return TRUE;
+		for ( ; *str; str++)
+		    if (is_space(*str) && glob_match(gp, op, str+1, str+1, inword))
+			return TRUE;
+		return FALSE;
+	    } else if (op->op == GOP_CHAR) {
+		for ( ; *str; str++)
+		    if (char_is(op, *str) && glob_match(gp, op, str, str, inword))
+			    return TRUE;
+		return FALSE;
+	    } else {
+		for ( ; *str; str++)
+		    if (glob_match(gp, op, str, str, inword)) return TRUE;
+		return FALSE;
+	    }
+
+	case GOP_WORD:
+	    if (str != start && !is_space(str[-1])) return FALSE;
+	    for (alt = op + 1; alt->op == GOP_ALT; alt = gp->ops + alt->arg)
+		if (glob_match(gp, alt + 1, str, str, TRUE)) break;
+	    if (alt->op != GOP_ALT) return FALSE;
+	    op = gp->ops + op->arg;
+	    while (*str && !is_space(*str)) str++;
+	    continue;
+	}
+	op++;
+    }
+}
+
+/* Matcher for programs without {...}.  On a mismatch, only the most recent
+ * '*' needs to be retried one char further along, so there is no recursion
+ * and the work is bounded by strlen(str) times the length of the program.
+ */
+static int glob_match_simple(const GlobProg *gp, const char *str)
+{
+    const GlobOp *op = gp->ops;
+    const GlobOp *resume = NULL;	/* op after the last '*' */
+    const char *restart = NULL;		/* where resume was last tried */
+    int len;
+
+    while (1) {
+	switch (op->op) {
+	case GOP_END:
+	    if (!*str) return TRUE;
+	    break;
+	case GOP_CHAR:
+	    if (char_is(op, *str)) {
+		op++, str++;
+		continue;
+	    }
+	    break;
+	case GOP_ANY:
+	    if (*str) {
+		op++, str++;
+		continue;
+	    }
+	    break;
+	case GOP_CLASS:
+	    if (*str && class_has(gp, op, *str)) {
+		op++, str++;
+		continue;
+	    }
+	    break;
+	case GOP_STAR:
+	    op++;
+	    if (op->op == GOP_END) return TRUE;
+	    if (op - gp->ops == gp->tail) {
+		/* the rest can only match the end of str */
+		len = strlen(str);
+		if (len < gp->tailwidth) return FALSE;
+		str += len - gp->tailwidth;
+		resume = NULL;
+	    } else {
+		resume = op;
+		restart = str;
+	    }
+	    continue;
+	}
+
+	/* mismatch: let the last '*' match one more char, and try again */
+	if (!resume || !*restart) return FALSE;
+	restart++;
+	if (resume->op == GOP_CHAR)
+	    while (*restart && !char_is(resume, *restart)) restart++;
+	op = resume;
+	str = restart;
+    }
+}
+
+/* Returns nonzero if str matches gp. */
+int glob_exec(const GlobProg *gp, const char *str)
+{
+    return gp->simple ? glob_match_simple(gp, str) :
+	glob_match(gp, gp->ops, str, str, FALSE);
+}
@@ -54,7 +54,10 @@ typedef union ValueUnion {
     struct RegInfo *ri;		/* compiled regexp (STR|REGEX) */
     struct Program *prog;	/* compiled expression (STR|EXPR) */
     void *p;			/* other pointer type (FILE, FUNC, CMD) */
-    unsigned int hash;		/* hash value (ID) */
+    struct {
+	unsigned int hash;	/* hash value (ID) */
+	int slot;		/* local var slot in its Program's scope, or -1 */
+    } id;
     attr_t attr;		/* attributes (STR|ATTR) */
     struct Value *next;		/* valpool pointer */
 } ValueUnion;
@@ -115,6 +118,7 @@ struct Var {
     short statuses;		/* # of status fields watching this var */
     short statusfmts;		/* # of status fields using this var as fmt */
     short statusattrs;		/* # of status fields using this var as attr */
+    unsigned int version;	/* incremented when value changes */
 };
 
 
@@ -160,6 +164,7 @@ enum Vars {
 #define alert_time	gettimevar(VAR_alert_time)
 #define auto_fg		getintvar(VAR_auto_fg)
 #define background	getintvar(VAR_background)
+#define backlog_warn	getintvar(VAR_backlog_warn)
 #define backslash	getintvar(VAR_backslash)
 #define bamf		getintvar(VAR_bamf)
 #define beep		getintvar(VAR_beep)
@@ -169,6 +174,7 @@ enum Vars {
 #define cecho		getintvar(VAR_cecho)
 #define cleardone	getintvar(VAR_cleardone)
 #define clearfull	getintvar(VAR_clearfull)
+#define connect_delay	gettimevar(VAR_connect_delay)
 #define clock_flag	getintvar(VAR_clock)
 #define defcompile	getintvar(VAR_defcompile)
 #define emulation 	getintvar(VAR_emulation)
@@ -199,6 +205,7 @@ enum Vars {
 #define lpflag		getintvar(VAR_lp)
 #define lpquote		getintvar(VAR_lpquote)
 #define maildelay	gettimevar(VAR_maildelay)
+#define match_threads	getintvar(VAR_match_threads)
 #define matching	getintvar(VAR_matching)
 #define max_hook	getintvar(VAR_max_hook)
 #define max_instr	getintvar(VAR_max_instr)
@@ -211,9 +218,12 @@ enum Vars {
 #define meta_esc	getintvar(VAR_meta_esc)
 #define more		getintvar(VAR_more)
 #define mprefix		getstrvar(VAR_mprefix)
+#define name_cache	gettimevar(VAR_name_cache)
 #define oldslash	getintvar(VAR_oldslash)
 #define optimize_user	getintvar(VAR_optimize)
 #define pedantic	getintvar(VAR_pedantic)
+#define profile_macros	getintvar(VAR_profile_macros)
+#define prog_cache	getintvar(VAR_prog_cache)
 #define prompt_wait	gettimevar(VAR_prompt_wait)
 #define proxy_host	getstdvar(VAR_proxy_host)
 #define proxy_port	getstdvar(VAR_proxy_port)
@@ -222,8 +232,12 @@ enum Vars {
 #define qprefix		getstrvar(VAR_qprefix)
 #define quietflag	getintvar(VAR_quiet)
 #define quitdone	getintvar(VAR_quitdone)
+#define recv_thread	getintvar(VAR_recv_thread)
 #define redef		getintvar(VAR_redef)
 #define refreshtime	getintvar(VAR_refreshtime)
+#define sched_bytes	getintvar(VAR_sched_bytes)
+#define sched_lines	getintvar(VAR_sched_lines)
+#define sched_slice	gettimevar(VAR_sched_slice)
 #define scroll		getintvar(VAR_scroll)
 #define secho		getintvar(VAR_secho)
 #define shpause		getintvar(VAR_shpause)
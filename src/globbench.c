@@ -0,0 +1,170 @@
+/*************************************************************************
+ *  TinyFugue - programmable mud client
+ *  Copyright (C) 1993, 1994, 1995, 1996, 1997, 1998, 1999, 2002, 2003, 2004, 2005, 2006-2007 Ken Keys
+ *
+ *  TinyFugue (aka "tf") is protected under the terms of the GNU
+ *  General Public License.  See the file "COPYING" for details.
+ ************************************************************************/
+static const char RCSid[] = "$Id$";
+
+
+/**************************************************************
+ * Glob matching benchmark
+ *
+ * Matches some typical trigger globs against some typical mud
+ * lines, with smatch() and with glob_compile()/glob_exec(), and
+ * reports nanoseconds per match for each.  Every result is also
+ * compared, so this doubles as a check that the two agree.
+ *
+ * Usage: globbench [iterations]
+ **************************************************************/
+
+#include "tfconfig.h"
+#include <stdarg.h>
+#include "port.h"
+#include "tf.h"
+#include "util.h"
+#include "pattern.h"
+#include "search.h"	/* for tfio.h */
+#include "tfio.h"
+
+static const char *patterns[] = {
+    "*",
+    "You are hungry.",
+    "You feel*",
+    "* tells you *",
+    "*hits you*",
+    "* says, \"*\"",
+    "*[0-9]hp*",
+    "[A-Z]* arrives from the ?*.",
+    "*{north|south|east|west}*",
+    "{*} has arrived.",
+    "*dragon*breathes*fire*at you*",
+    "*a*b*c*d*e*f*",
+    NULL
+};
+
+static const char *lines[] = {
+    "You are hungry.",
+    "You feel a little better.",
+    "Gandalf tells you 'the bridge is out'",
+    "The orc hits you very hard.",
+    "The orc misses you.",
+    "Bob says, \"anyone want to group?\"",
+    "<123hp 45sp 67mv> ",
+    "A large troll arrives from the north.",
+    "Obvious exits: north south west",
+    "Frodo has arrived.",
+    "The red dragon breathes a cone of fire at you!",
+    "There is nothing here.",
+    "a quick brown fox jumps over the lazy dog, abcdefghijklmnopqrstuvwxyz",
+    "",
+    NULL
+};
+
+/* glob.c allocates through these; we don't need the full malloc.c. */
+void *xmalloc(void *md, long unsigned size, const char *file, const int line)
+{
+    return xrealloc(md, NULL, size, file, line);
+}
+
+void *xrealloc(void *md, void *ptr, long unsigned size,
+    const char *file, const int line)
+{
+    void *result = realloc(ptr, size);
+    if (!result) {
+	fprintf(stderr, "%s:%d: out of memory\n", file, line);
+	exit(1);
+    }
+    return result;
+}
+
+void xfree(void *md, void *ptr, const char *file, const int line)
+{
+    free(ptr);
+}
+
+/* and these come from util.c and tfio.c. */
+char *estrchr(register const char *s, register int c, register int e)
+{
+    while (*s) {
+        if (*s == c) return (char *)s;
+        if (*s == e) {
+            if (*++s) s++;
+        } else s++;
+    }
+    return NULL;
+}
+
+void eprintf(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+}
+
+static double elapsed(struct timeval *start)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1e9 +
+	(now.tv_usec - start->tv_usec) * 1e3;
+}
+
+int main(int argc, char **argv)
+{
+    int p, l, i, nlines, iterations = 20000, matches, errors = 0;
+    double interp, compiled;
+    struct timeval start;
+    GlobProg *gp;
+
+    if (argc > 1) iterations = atoi(argv[1]);
+    if (iterations <= 0) {
+	fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+	return 1;
+    }
+    for (nlines = 0; lines[nlines]; nlines++);
+
+    printf("nsec per match, %d lines x %d iterations\n", nlines, iterations);
+    printf("%-32s %5s %9s %9s %7s\n",
+	"pattern", "hits", "smatch", "compiled", "speedup");
+
+    for (p = 0; patterns[p]; p++) {
+	if (!smatch_check(patterns[p])) {
+	    errors++;
+	    continue;
+	}
+	gp = glob_compile(patterns[p]);
+
+	matches = 0;
+	for (l = 0; l < nlines; l++) {
+	    int a = !smatch(patterns[p], lines[l]);
+	    int b = !!glob_exec(gp, lines[l]);
+	    if (a != b) {
+		fprintf(stderr, "MISMATCH: \"%s\" vs \"%s\": smatch %d, "
+		    "compiled %d\n", patterns[p], lines[l], a, b);
+		errors++;
+	    }
+	    matches += a;
+	}
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < iterations; i++)
+	    for (l = 0; l < nlines; l++)
+		smatch(patterns[p], lines[l]);
+	interp = elapsed(&start) / ((double)iterations * nlines);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < iterations; i++)
+	    for (l = 0; l < nlines; l++)
+		glob_exec(gp, lines[l]);
+	compiled = elapsed(&start) / ((double)iterations * nlines);
+
+	printf("%-32s %5d %9.1f %9.1f %6.1fx\n", patterns[p], matches,
+	    interp, compiled, compiled > 0 ? interp / compiled : 0);
+	glob_free(gp);
+    }
+    return errors ? 1 : 0;
+}
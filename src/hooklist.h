@@ -12,6 +12,7 @@
  */
 
 gencode(ACTIVITY,	HT_ALERT | HT_XSOCK),
+gencode(BACKLOG,	HT_WORLD | HT_XSOCK),
 gencode(BAMF,		HT_WORLD | HT_XSOCK),
 gencode(BGTEXT,		0),
 gencode(BGTRIG,		HT_ALERT | HT_XSOCK),
@@ -0,0 +1,50 @@
+;;; Macro interpreter benchmark; not installed.
+;;; "make interpbench" runs it with the tf in this directory:
+;;;     ./tf -n -L`cd ../tf-lib && pwd` -f./interpbench.tf < /dev/null
+;;; Each test is run once, and its cpu time in milliseconds is printed.
+
+/set max_instr=0
+/set max_recur=0
+/set max_hook=0
+/load -q factoral.tf
+/load -q hanoi.tf
+
+; hanoi sends its moves to the server; count them instead.
+/def -i -hSEND ib_send = /test ++ib_sends
+
+/def -i ib_while = \
+    /let i=0%; /let s=0%; \
+    /while (i < 1000000) /test s += 3, ++i%; /done
+
+/def -i ib_ifact = \
+    /let i=0%; \
+    /while (++i <= 100000) /test ifact(12)%; /done
+
+/def -i ib_rfact = \
+    /let i=0%; \
+    /while (++i <= 50000) /test rfact(12)%; /done
+
+/def -i ib_hanoi = \
+    /set ib_sends=0%; \
+    /hanoi 16
+
+/def -i ib_subst = \
+    /let i=0%; /let x=%; \
+    /while (++i <= 200000) /let x=move %{i} to $[i * 2]: %{x}%; /let x=%; /done
+
+/def -i ib_run = \
+    /let t0=$[cputime()]%; \
+    /ib_%1%; \
+    /let t=$[trunc((cputime() - t0) * 1000)]%; \
+    /set ib_total=$[ib_total + t]%; \
+    /echo $[pad({1}, -8, strcat(t), 10)]
+
+/test echo(pad("test", -8, "msec", 10))
+/set ib_total=0
+/ib_run while
+/ib_run ifact
+/ib_run rfact
+/ib_run hanoi
+/ib_run subst
+/test echo(pad("total", -8, strcat(ib_total), 10))
+/quit
@@ -34,21 +34,39 @@ static const char RCSid[] = "$Id: macro.c,v 35004.188 2007/01/13 23:12:39 kkeys
 #include "parse.h"	/* valbool() for /def -E */
 #include "variable.h"	/* set_var_by_id() */
 
+#if HAVE_PTHREAD_H && HAVE_PTHREAD_CREATE
+# include <pthread.h>
+# define THREADED_MATCH
+#endif
+
 typedef struct {
     cattr_t attr;
     short subexp;
 } subattr_t;
 
+/* Costs of a macro, collected while %profile_macros is on.  Times are in
+ * nanoseconds; runtime includes any macros called by the body. */
+typedef struct MacroProf {
+    unsigned long tries;		/* trigger/hook pattern tests */
+    unsigned long hits;			/* successful tests */
+    double matchtime;			/* time spent in tests */
+    double runtime;			/* time spent running body */
+    double maxrun;			/* longest single run */
+} MacroProf;
+
 struct Macro {
     const char *name;
     struct ListEntry *numnode;		/* node in maclist */
     struct ListEntry *hashnode;		/* node in macro_table hash bucket */
     struct ListEntry *trignode;		/* node in one of the triglists */
+    int trigkey;			/* id of trig's literal in trigkeys */
     struct Macro *tnext;		/* temp list ptr for collision/death */
     conString *body, *expr;
     Program *prog, *exprprog;		/* compiled body, expr */
     const char *bind, *keyname;
     Pattern trig, hargs, wtype;		/* trigger/hook/worldtype patterns */
+    unsigned long *wtmap;		/* worlds whose type matches wtype */
+    int wtmaplen;			/* # of longs in wtmap */
     hookvec_t hook;			/* bit vector */
     struct World *world;		/* only trig on text from world */
     int pri, num;
@@ -60,18 +78,101 @@ struct Macro {
     signed char fallthru, quiet;
     struct BuiltinCmd *builtin;		/* builtin cmd with same name, if any */
     int used[USED_N];			/* number of calls by each method */
+    MacroProf prof;			/* costs, if %profile_macros */
 };
 
 typedef struct {
     Pattern name, body, bind, keyname, expr;
 } AuxPat;
 
+/* Flags of a TrigEntry */
+#define TE_BODY		0x01	/* has a body that may be run (for borg) */
+#define TE_HILITE	0x02	/* has hilite attributes (for hilite) */
+#define TE_GAG		0x04	/* has gag attribute (for gag) */
+#define TE_GLOBAL	0x08	/* not world-specific */
+#define TE_MEMO		0x10	/* match result depends only on the text */
+
+typedef struct TrigEntry {
+    Macro *macro;
+    int pri;
+    int trigkey;			/* copy of macro->trigkey */
+    int flags;				/* TE_* */
+} TrigEntry;
+
+/* Positions in the trigger lists just after a TrigEntry's macro */
+typedef struct TrigResume {
+    ListEntry *gnode, *wnode;
+} TrigResume;
+
+/* Results of matching one line against a TrigTable.  The TE_MEMO entries
+ * before <reach> that are not in <hit> are known not to match the line, so
+ * when the line is seen again they can be skipped.
+ */
+typedef struct TrigMemo {
+    char *text;				/* the line, or NULL if slot is free */
+    unsigned int hash;			/* hash_string(text) */
+    attr_t attrs;			/* line attributes */
+    int key;				/* TE_* flags wanted, and TE_GLOBAL */
+    unsigned long used;			/* memo_clock when last used */
+    int busy;				/* number of walks using this slot */
+    int reach;				/* results known for entries < reach */
+    int nhit, size;
+    int *hit;				/* TE_MEMO entries that matched */
+} TrigMemo;
+
+#define MEMO_SETS	64		/* memo is MEMO_WAYS-way set associative */
+#define MEMO_WAYS	4
+#define MEMO_MAXLEN	256		/* longer lines are not memoized */
+
+/* The triggers that can match text from one world, in the order that
+ * find_and_run_matches() tries them.  Dead macros, macros for other worlds,
+ * and macros whose -T<worldtype> does not match have already been left out.
+ */
+typedef struct TrigTable {
+    TrigEntry *entry;
+    TrigResume *resume;			/* parallel to entry */
+    int n;
+    int *uncache;			/* indexes of entries without TE_MEMO */
+    int nuncache;
+    TrigMemo *memo;			/* MEMO_SETS * MEMO_WAYS, or NULL */
+    unsigned long memo_clock;
+    int links;
+    unsigned int gen;			/* trig_gen when built */
+} TrigTable;
+
+/* Results of matching a queued line against the TE_MEMO entries of a
+ * TrigTable ahead of time (see prematch_lines()).
+ */
+typedef struct PreMatch {
+    String *text;			/* the line, or NULL once taken */
+    unsigned long *bits;		/* bit i is set if entry i matched */
+} PreMatch;
+
+/* A partial hilite waiting to be applied to a line */
+typedef struct HiliteSpan {
+    int start, end;
+    cattr_t attr;
+} HiliteSpan;
+
 typedef struct {
     int shortflag;
     int usedflag;
+    int profflag;
     Cmp *cmp;
 } ListOpts;
 
+/* Fields of a MacroProf that /list -o can sort by */
+static conString enum_prof[] = {
+    STRING_LITERAL("tries"),
+    STRING_LITERAL("hits"),
+    STRING_LITERAL("match"),
+    STRING_LITERAL("run"),
+    STRING_LITERAL("max"),
+    STRING_LITERAL("time"),
+    STRING_NULL };
+enum { PROF_TRIES, PROF_HITS, PROF_MATCH, PROF_RUN, PROF_MAX, PROF_TIME };
+static int prof_field;			/* field for profcmp() */
+
 int invis_flag = 0;
 
 static Macro  *macro_spec(String *args, int offset, int *xmflag, ListOpts *opts);
@@ -85,11 +186,18 @@ static Macro  *match_exact(int hooknum, const char *str, attr_t attrs);
 static int     list_defs(TFILE *file, Macro *spec, int mflag, ListOpts *opts);
 static void    apply_attrs_of_match(Macro *macro, String *text, int hooknum,
 		String *line);
+static void    add_partial_hilites(Macro *macro, String *text, String *line);
+static void    flush_hilites(void);
 static int     run_match(Macro *macro, String *text, int hooknum);
 static const String *hook_name(const hookvec_t *hook) PURE;
 static conString *print_def(TFILE *file, String *buffer, Macro *p);
 static int     rpricmp(const Macro *m1, const Macro *m2);
+static int     profcmp(const void *a, const void *b);
 static void    nuke_macro(Macro *macro);
+static void    wtmap_update(Macro *macro, World *w);
+static void    wtmap_world(World *w);
+static TrigTable *get_trigtable(World *world);
+static void    free_trigtable(TrigTable *tt);
 
 
 #define HASH_SIZE 997	/* prime number */
@@ -101,13 +209,40 @@ static void    nuke_macro(Macro *macro);
 
 #define INVALID_SUBEXP	-3
 
+/* Does <macro>'s -T pattern match the type of world <w>? (see wtmap_update) */
+#define wtype_match(macro, w) \
+    ((w)->wtindex / LONGBITS < (macro)->wtmaplen && \
+    ((macro)->wtmap[(w)->wtindex / LONGBITS] & \
+	(1L << ((w)->wtindex % LONGBITS))))
+
 static List maclist[1];			/* list of all (live) macros */
 static List triglist[1];		/* list of macros by trigger */
 static List hooklist[NUM_HOOKS];	/* lists of macros by hook */
+static KWSet trigkeys[1];		/* literals required by triggers */
+static unsigned int trig_gen = 0;	/* changes when any trigger changes */
+static TrigTable *noworld_trigtable = NULL; /* for text from no world */
+unsigned long trig_memo_lookups = 0;	/* lines looked up in a TrigMemo */
+unsigned long trig_memo_hits = 0;	/* lines found in a TrigMemo */
 static Macro *dead_macros;		/* head of list of dead macros */
 static HashTable macro_table[1];	/* macros hashed by name */
 static World NoWorld, AnyWorld;		/* explicit "no" and "any" */
 static int mnum = 0;			/* macro ID number */
+static pcre2_match_data *span_md = NULL; /* for add_partial_hilites() */
+static int span_mdsize = 0;		/* pairs in span_md */
+
+/* Partial hilites of one line, collected from all the triggers that matched
+ * it, and applied all at once by flush_hilites().
+ */
+static struct {
+    String *line;			/* line they apply to, or NULL */
+    HiliteSpan *span;			/* in the order they were found */
+    int n, size;
+    int *edge;				/* next edge at the same offset */
+    int *act;				/* spans covering a run */
+    int *at;				/* first edge at each offset */
+    int nat;
+} hilites;
+static Macro *wtmap_macro;		/* for wtmap_world() */
 
 typedef enum {
     HT_TEXT = 0x00,	/* normal text in fg world */
@@ -139,6 +274,7 @@ void init_macros(void)
     init_hashtable(macro_table, HASH_SIZE, cstrstructcmp);
     init_list(maclist);
     init_list(triglist);
+    init_kwset(trigkeys);
     for (i = 0; i < (int)NUM_HOOKS; i++)
 	init_list(&hooklist[i]);
 }
@@ -220,6 +356,8 @@ static Macro *macro_spec(String *args, int offset, int *xmflag, ListOpts *listop
     init_pattern_str(&spec->trig, NULL);
     init_pattern_str(&spec->hargs, NULL);
     init_pattern_str(&spec->wtype, NULL);
+    spec->wtmap = NULL;
+    spec->wtmaplen = 0;
     spec->world = NULL;
     spec->pri = spec->prob = spec->shots = spec->fallthru = spec->quiet = -1;
     VEC_ZERO(&spec->hook);
@@ -231,11 +369,19 @@ static Macro *macro_spec(String *args, int offset, int *xmflag, ListOpts *listop
     spec->builtin = NULL;
     spec->used[USED_NAME] = spec->used[USED_TRIG] =
 	spec->used[USED_HOOK] = spec->used[USED_KEY] = 0;
+    memset(&spec->prof, 0, sizeof(spec->prof));
 
-    startopt(CS(args), "usSp#c#b:B:E:t:w:h:a:f:P:T:FiIn#1m:q" +
-	(listopts ? 0 : 3));
+    startopt(CS(args), "o:usSp#c#b:B:E:t:w:h:a:f:P:T:FiIn#1m:q" +
+	(listopts ? 0 : 5));
     while (!error && (opt = nextopt(&ptr, &uval, NULL, &offset))) {
         switch (opt) {
+        case 'o':
+            if (!(error = ((i = enum2int(ptr, 0, enum_prof, "-o")) < 0))) {
+		listopts->profflag = 1;
+		listopts->cmp = profcmp;
+		prof_field = i;
+	    }
+            break;
         case 'u':
             listopts->usedflag = 1;
             break;
@@ -248,7 +394,7 @@ static Macro *macro_spec(String *args, int offset, int *xmflag, ListOpts *listop
         case 'm':
             if (!(error = ((i = enum2int(ptr, 0, enum_match, "-m")) < 0))) {
 		if ((error = (mflag >= 0 && mflag != i)))
-		    eprintf("-m option conflicts with earlier -m or -P");
+		    eprintf("-m option conflicts with earlier -m");
 		mflag = i;
 	    }
             break;
@@ -322,8 +468,10 @@ static Macro *macro_spec(String *args, int offset, int *xmflag, ListOpts *listop
             if ((error = (spec->nsubattr > 0))) {
                 eprintf("-P can be given only once per macro.");
 		break;
-	    } else if ((error = (mflag >= 0 && mflag != MATCH_REGEXP))) {
-		eprintf("\"-P\" requires \"-mregexp -t<pattern>\"");
+	    } else if ((error = (mflag >= 0 && mflag != MATCH_REGEXP &&
+		mflag != MATCH_SUBSTR)))
+	    {
+		eprintf("\"-P\" requires \"-mregexp\" or \"-msubstr\"");
 		break;
 	    }
 	    for (n = 0, s = ptr; *s; s++) {
@@ -368,7 +516,6 @@ static Macro *macro_spec(String *args, int offset, int *xmflag, ListOpts *listop
 	    }
 	    FREE(buf);
 	    }
-	    mflag = MATCH_REGEXP;
             break;
         case 'n':
             spec->shots = uval.ival;
@@ -389,7 +536,7 @@ static Macro *macro_spec(String *args, int offset, int *xmflag, ListOpts *listop
         return NULL;
     }
     if (mflag < 0)
-	mflag = matching;
+	mflag = spec->nsubattr ? MATCH_REGEXP : matching;
     if (xmflag) *xmflag = mflag;
     if (!init_pattern_mflag(&spec->trig, mflag, 't') ||
 	!init_pattern_mflag(&spec->hargs, mflag, 'h') ||
@@ -676,6 +823,8 @@ int add_new_macro(const char *trig, const char *bind, const hookvec_t *hook,
     error += !init_pattern(&new->trig, trig, mflag);
     error += !init_pattern(&new->hargs, hargs, mflag);
     init_pattern_str(&new->wtype, NULL);
+    new->wtmap = NULL;
+    new->wtmaplen = 0;
     new->world = NULL;
     new->pri = pri;
     new->prob = prob;
@@ -689,6 +838,7 @@ int add_new_macro(const char *trig, const char *bind, const hookvec_t *hook,
     new->builtin = NULL;
     new->used[USED_NAME] = new->used[USED_TRIG] =
 	new->used[USED_HOOK] = new->used[USED_KEY] = 0;
+    memset(&new->prof, 0, sizeof(new->prof));
 
     if (!error)
 	return add_numbered_macro(new, 0, 0, NULL);
@@ -755,8 +905,20 @@ static int add_numbered_macro(Macro *macro, unsigned int hash, int num,
 	}
     }
     if (macro->trig.str) {
+	char lit[64];
+	/* A -E with side effects must run even for lines without the
+	 * literal, so such a trigger gets no prefilter. */
+	macro->trigkey = (!macro->exprprog || macro->exprprog->ndeps >= 0) &&
+	    pattern_literal(&macro->trig, lit, sizeof(lit)) ?
+	    kwset_add(trigkeys, lit) : -1;
         macro->trignode = sinsert((void *)macro,
 	    macro->world ? macro->world->triglist : triglist, (Cmp *)rpricmp);
+	trig_gen++;
+    }
+    if (macro->wtype.str) {
+	wtmap_macro = macro;
+	mapworld(wtmap_world);
+	if (defaultworld) wtmap_update(macro, defaultworld);
     }
     if (macro->flags & MACRO_HOOK) {
 	int i;
@@ -774,6 +936,55 @@ static int add_numbered_macro(Macro *macro, unsigned int hash, int num,
     return macro->num;
 }
 
+/* Set or clear the bit for world <w> in <macro>'s wtmap, according to
+ * whether its -T pattern matches world_type(w).  Matching a world's type
+ * against every -T macro is done only here, when either one is (re)defined,
+ * instead of for every line.
+ */
+static void wtmap_update(Macro *macro, World *w)
+{
+    const char *type = world_type(w);
+    int i = w->wtindex / LONGBITS;
+
+    if (i >= macro->wtmaplen) {
+	macro->wtmap = XREALLOC(macro->wtmap, (i+1) * sizeof(unsigned long));
+	while (macro->wtmaplen <= i)
+	    macro->wtmap[macro->wtmaplen++] = 0;
+    }
+    if (patmatch(&macro->wtype, NULL, type ? type : ""))
+	macro->wtmap[i] |= (1L << (w->wtindex % LONGBITS));
+    else
+	macro->wtmap[i] &= ~(1L << (w->wtindex % LONGBITS));
+}
+
+static void wtmap_world(World *w)
+{
+    wtmap_update(wtmap_macro, w);
+}
+
+/* The type of <w> has been set, or <w> is new.  If <w> is the default world
+ * (or NULL, if the default world was removed), that may change the type of
+ * any world.
+ */
+void world_type_changed(World *w)
+{
+    ListEntry *node;
+    Macro *macro;
+
+    for (node = maclist->head; node; node = node->next) {
+	macro = MAC(node);
+	if (!macro->wtype.str) continue;
+	if (w && w != defaultworld) {
+	    wtmap_update(macro, w);
+	} else {
+	    wtmap_macro = macro;
+	    mapworld(wtmap_world);
+	    if (w) wtmap_update(macro, w);
+	}
+    }
+    trig_gen++;	/* trigger tables depend on world types */
+}
+
 /* rebind_key_macros
  * Unbinds macros with keynames, and attempts to rebind them.
  */
@@ -813,6 +1024,27 @@ static int rpricmp(const Macro *m1, const Macro *m2)
     else return m2->fallthru - m1->fallthru;
 }
 
+static double prof_value(const MacroProf *prof, int field)
+{
+    switch (field) {
+    case PROF_TRIES:	return prof->tries;
+    case PROF_HITS:	return prof->hits;
+    case PROF_MATCH:	return prof->matchtime;
+    case PROF_RUN:	return prof->runtime;
+    case PROF_MAX:	return prof->maxrun;
+    default:		return prof->matchtime + prof->runtime;
+    }
+}
+
+/* for vector_sort() of macros by cost, most costly first */
+static int profcmp(const void *a, const void *b)
+{
+    double va = prof_value(&(*(const Macro **)a)->prof, prof_field);
+    double vb = prof_value(&(*(const Macro **)b)->prof, prof_field);
+    if (va != vb) return va < vb ? 1 : -1;
+    return (*(const Macro **)a)->num - (*(const Macro **)b)->num;
+}
+
 struct Value *handle_def_command(String *args, int offset)
 {
     Macro *spec;
@@ -868,7 +1100,7 @@ static int complete_macro(Macro *spec, unsigned int hash, int num,
 
     if (spec->body && defcompile) {
 	spec->prog = compile_tf(spec->body, 0, SUB_MACRO, 0,
-	    !spec->shots ? 2 : spec->shots > 10 ? 1 : 0);
+	    spec->shots <= 0 ? 2 : spec->shots > 10 ? 1 : 0);
 	if (!spec->prog) {
             nuke_macro(spec);
 	    return 0;
@@ -886,15 +1118,17 @@ static int complete_macro(Macro *spec, unsigned int hash, int num,
     if (!spec->body) (spec->body = blankline)->links++;
     /*if (!spec->expr) (spec->expr = blankline)->links++;*/
 
-    if (spec->nsubattr > 0 && spec->trig.mflag != MATCH_REGEXP) {
-        eprintf("\"-P\" requires \"-mregexp -t<pattern>\"");
+    if (spec->nsubattr > 0 && spec->trig.mflag != MATCH_REGEXP &&
+	spec->trig.mflag != MATCH_SUBSTR)
+    {
+        eprintf("\"-P\" requires \"-mregexp\" or \"-msubstr\" "
+	    "with \"-t<pattern>\"");
         nuke_macro(spec);
         return 0;
     }
     spec->attr &= ~F_NONE;
     if (spec->nsubattr) {
-	int n;
-	pcre_fullinfo(spec->trig.ri->re, NULL, PCRE_INFO_CAPTURECOUNT, &n);
+	int n = spec->trig.ri ? spec->trig.ri->ovecsize - 1 : 0;
 	for (i = 0; i < spec->nsubattr; i++) {
 	    spec->subattr[i].attr &= ~F_NONE;
 	    if (spec->subattr[i].subexp > n) {
@@ -1026,6 +1260,7 @@ struct Value *handle_edit_command(String *args, int offset)
     spec->used[USED_TRIG] = macro->used[USED_TRIG];
     spec->used[USED_HOOK] = macro->used[USED_HOOK];
     spec->used[USED_KEY] = macro->used[USED_KEY];
+    spec->prof = macro->prof;
 
     if (!error) {
         complete_macro(spec, hash, num, numnode);
@@ -1060,6 +1295,7 @@ void kill_macro(Macro *macro)
 
     if (macro->flags & MACRO_DEAD) return;
     macro->flags |= MACRO_DEAD;
+    if (macro->trignode) trig_gen++;
     macro->tnext = dead_macros;
     dead_macros = macro;
     unlist(macro->numnode, maclist);
@@ -1083,8 +1319,11 @@ static void nuke_macro(Macro *m)
     if (!(m->flags & MACRO_DEAD) && !(m->flags & MACRO_TEMP)) {
         kill_macro(m);
     }
-    if (m->trignode)
+    if (m->trignode) {
 	unlist(m->trignode, m->world ? m->world->triglist : triglist);
+	if (m->trigkey >= 0) kwset_remove(trigkeys, m->trigkey);
+	trig_gen++;
+    }
     if (m->flags & MACRO_HOOK) {
 	int i;
 	ListEntry *node;
@@ -1111,6 +1350,7 @@ static void nuke_macro(Macro *m)
     free_pattern(&m->trig);
     free_pattern(&m->hargs);
     free_pattern(&m->wtype);
+    if (m->wtmap) FREE(m->wtmap);
     if (m->name) FREE(m->name);
     FREE(m);
 }
@@ -1160,6 +1400,35 @@ error:
     return newint(result);
 }
 
+struct Value *handle_resetprofile_command(String *args, int offset)
+{
+    Macro *spec;
+    ListEntry *node;
+    int result = 0;
+    int mflag;
+    AuxPat aux;
+
+    if (!(spec = macro_spec(args, offset, &mflag, NULL)))
+        return shareval(val_zero);
+    if (spec->name && *spec->name == '#') {
+        spec->num = atoi(spec->name + 1);
+        FREE(spec->name);
+        spec->name = NULL;
+    }
+    if (!(init_aux_patterns(spec, mflag, &aux)))
+	goto error;
+    for (node = maclist->head; node; node = node->next) {
+	if (macro_match(spec, MAC(node), &aux)) {
+	    memset(&MAC(node)->prof, 0, sizeof(MacroProf));
+	    result++;
+	}
+    }
+error:
+    free_aux_patterns(&aux);
+    nuke_macro(spec);
+    return newint(result);
+}
+
 /* delete macro by number */
 struct Value *handle_undefn_command(String *args, int offset)
 {
@@ -1338,6 +1607,10 @@ static int list_defs(TFILE *file, Macro *spec, int mflag, ListOpts *listopts)
     if (listopts && listopts->cmp)
 	vector_sort(&macs, listopts->cmp);
 
+    if (listopts && listopts->profflag && macs.size > 0)
+	oputs("%    NUM     TRIES      HITS   MATCH ms     RUN ms    MAX ms  "
+	    "MACRO");
+
     for (i = 0; i < macs.size; i++) {
         p = macs.ptrs[i];
         result = p->num;
@@ -1345,7 +1618,22 @@ static int list_defs(TFILE *file, Macro *spec, int mflag, ListOpts *listopts)
         if (!buffer)
             (buffer = Stringnew(NULL, 0, 0))->links++;
 
-        if (listopts && listopts->shortflag) {
+        if (listopts && listopts->profflag) {
+	    char numbuf[80];
+	    /* (vSprintf() can't do %lu) */
+	    sprintf(numbuf, "%% %6d %9lu %9lu %10.3f %10.3f %9.3f  ", p->num,
+		p->prof.tries, p->prof.hits, p->prof.matchtime / 1e6,
+		p->prof.runtime / 1e6, p->prof.maxrun / 1e6);
+	    Stringcpy(buffer, numbuf);
+	    if (*p->name)
+		Stringcat(buffer, p->name);
+	    else if (p->trig.str)
+		Sappendf(buffer, "-t'%q'", '\'', p->trig.str);
+	    else if (p->flags & MACRO_HOOK)
+		Sappendf(buffer, "-h%S", hook_name(&p->hook));
+	    oputs(buffer->data);
+
+        } else if (listopts && listopts->shortflag) {
             Sprintf(buffer, "%% %d: ", p->num);
             if (p->attr & F_NOHISTORY) Stringcat(buffer, "(nohistory) ");
             if (p->attr & F_NOLOG) Stringcat(buffer, "(nolog) ");
@@ -1466,7 +1754,7 @@ struct Value *handle_list_command(String *args, int offset)
     Macro *spec;
     int result = 1;
     int mflag;
-    ListOpts opts = { 0, 0, NULL };
+    ListOpts opts = { 0, 0, 0, NULL };
 
     if (!(spec = macro_spec(args, offset, &mflag, &opts))) result = 0;
     if (result) result = list_defs(NULL, spec, mflag, &opts);
@@ -1578,6 +1866,392 @@ int do_hook(int hooknum, const char *fmt, const char *argfmt, ...)
     return ran;
 }
 
+/* Build the table of triggers for text from <world> (which may be NULL). */
+static TrigTable *build_trigtable(World *world)
+{
+    TrigTable *tt;
+    TrigEntry *te;
+    ListEntry *gnode, *wnode, **nodep;
+    Macro *macro;
+    int flags;
+
+    tt = XMALLOC(sizeof(TrigTable));
+    tt->n = 1;
+    for (gnode = triglist->head; gnode; gnode = gnode->next) tt->n++;
+    if (world)
+	for (wnode = world->triglist->head; wnode; wnode = wnode->next) tt->n++;
+    tt->entry = XMALLOC(sizeof(TrigEntry) * tt->n);
+    tt->resume = XMALLOC(sizeof(TrigResume) * tt->n);
+    tt->uncache = XMALLOC(sizeof(int) * tt->n);
+    tt->n = tt->nuncache = 0;
+    tt->memo = NULL;
+    tt->memo_clock = 0;
+    tt->links = 1;
+    tt->gen = trig_gen;
+
+    /* Macros are sorted by decreasing priority, with fall-thrus first, so
+     * the global and world lists are merged. */
+    gnode = triglist->head;
+    wnode = world ? world->triglist->head : NULL;
+    while (gnode || wnode) {
+	nodep = (!wnode) ? &gnode : (!gnode) ? &wnode :
+	    (rpricmp(MAC(wnode), MAC(gnode)) > 0) ? &gnode : &wnode;
+	macro = MAC(*nodep);
+	*nodep = (*nodep)->next;
+
+        if (macro->flags & MACRO_DEAD) continue;
+	flags = 0;
+	if (macro->body && macro->prob > 0)
+	    flags |= TE_BODY;
+	if ((macro->attr & F_HWRITE) || macro->nsubattr)
+	    flags |= TE_HILITE;
+	if (macro->attr & F_GAG)
+	    flags |= TE_GAG;
+	if (!flags) continue;
+        if (macro->world && macro->world != world) continue;
+	if (!macro->world)
+	    flags |= TE_GLOBAL;
+        if (macro->wtype.str && (!world || !wtype_match(macro, world)))
+	    continue;
+	/* Regexps are not memoized, because they must set %P for the body */
+	if (macro->trig.mflag != MATCH_REGEXP && !macro->expr &&
+	    macro->prob == 100)
+	    flags |= TE_MEMO;
+	else
+	    tt->uncache[tt->nuncache++] = tt->n;
+
+	tt->resume[tt->n].gnode = gnode;
+	tt->resume[tt->n].wnode = wnode;
+	te = &tt->entry[tt->n++];
+	te->macro = macro;
+	te->pri = macro->pri;
+	te->trigkey = macro->trigkey;
+	te->flags = flags;
+    }
+    return tt;
+}
+
+static void free_trigtable(TrigTable *tt)
+{
+    int i;
+
+    if (--tt->links > 0) return;
+    if (tt->memo) {
+	for (i = 0; i < MEMO_SETS * MEMO_WAYS; i++) {
+	    if (tt->memo[i].text) FREE(tt->memo[i].text);
+	    if (tt->memo[i].hit) FREE(tt->memo[i].hit);
+	}
+	FREE(tt->memo);
+    }
+    FREE(tt->entry);
+    FREE(tt->resume);
+    FREE(tt->uncache);
+    FREE(tt);
+}
+
+/* Find the memo of <text> in <tt>, or start a new one, replacing the least
+ * recently used one in its set.  Returns NULL if every slot in the set is in
+ * use by a walk that has not finished.
+ */
+static TrigMemo *get_trigmemo(TrigTable *tt, const String *text, int key)
+{
+    TrigMemo *set, *memo = NULL;
+    unsigned int hash;
+    int i;
+
+    if (!tt->memo) {
+	tt->memo = XMALLOC(sizeof(TrigMemo) * MEMO_SETS * MEMO_WAYS);
+	memset(tt->memo, 0, sizeof(TrigMemo) * MEMO_SETS * MEMO_WAYS);
+    }
+    hash = hash_string(text->data);
+    set = &tt->memo[(hash % MEMO_SETS) * MEMO_WAYS];
+    trig_memo_lookups++;
+    for (i = 0; i < MEMO_WAYS; i++) {
+	if (set[i].text && set[i].hash == hash && set[i].key == key &&
+	    set[i].attrs == text->attrs && strcmp(set[i].text, text->data) == 0)
+	{
+	    trig_memo_hits++;
+	    memo = &set[i];
+	    goto found;
+	}
+	if (!set[i].busy && (!memo || set[i].used < memo->used))
+	    memo = &set[i];
+    }
+    if (!memo) return NULL;
+    if (memo->text) FREE(memo->text);
+    memo->text = STRDUP(text->data);
+    memo->hash = hash;
+    memo->attrs = text->attrs;
+    memo->key = key;
+    memo->reach = memo->nhit = 0;
+found:
+    memo->used = ++tt->memo_clock;
+    memo->busy++;
+    return memo;
+}
+
+/* Return the trigger table for <world>, rebuilding it if any trigger or
+ * world type has changed since it was built.  The table is owned by the
+ * world; callers that need it to outlive a nested call must link it.
+ */
+static TrigTable *get_trigtable(World *world)
+{
+    TrigTable **ttp = world ? &world->trigtable : &noworld_trigtable;
+
+    if (*ttp) {
+	if ((*ttp)->gen == trig_gen)
+	    return *ttp;
+	free_trigtable(*ttp);
+    }
+    return *ttp = build_trigtable(world);
+}
+
+/* Release <w>'s trigger table.  Called when <w> is freed. */
+void free_world_trigtable(World *w)
+{
+    if (w->trigtable) free_trigtable(w->trigtable);
+    w->trigtable = NULL;
+}
+
+/* A batch of lines from one world is matched against the world's TrigTable
+ * by the main thread and %match_threads helper threads before any of them
+ * is processed.  Only TE_MEMO entries are tried, since their result depends
+ * only on the text, and patmatch() is safe to call from several threads at
+ * once for them; everything else, including running bodies, applying
+ * attributes, and /substitute, is left to find_and_run_matches(), in order.
+ * All memory is allocated and freed by the main thread.
+ */
+#define MAX_MATCH_THREADS	64
+
+static struct {
+    TrigTable *tt;			/* linked while batch exists */
+    PreMatch *line;
+    int n, size;			/* lines in batch, room for */
+    int words;				/* longs in each PreMatch's bits */
+    unsigned long *bits;		/* bits of all lines */
+    int next;				/* next line to claim */
+    int finished;			/* lines done */
+    int busy;				/* walks using bits */
+} prematch;
+
+#ifdef THREADED_MATCH
+typedef struct MatchThread {
+    pthread_t tid;
+    unsigned int *seen;			/* for kwset_scan_into() */
+    int nseen;
+    unsigned int gen;
+} MatchThread;
+
+static MatchThread *matcher = NULL;	/* matcher[0] is the main thread */
+static int nmatchers = 0;
+static int match_quit = FALSE;
+static pthread_mutex_t match_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t match_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t match_done = PTHREAD_COND_INITIALIZER;
+
+/* Match line <k> of the batch against the TE_MEMO entries of prematch.tt. */
+static void prematch_line(MatchThread *self, int k)
+{
+    TrigTable *tt = prematch.tt;
+    const TrigEntry *te;
+    const char *str = prematch.line[k].text->data;
+    unsigned long *bits = prematch.line[k].bits;
+    int i;
+
+    kwset_scan_into(trigkeys, str, self->seen, ++self->gen);
+    for (i = 0; i < tt->n; i++) {
+	te = &tt->entry[i];
+	if (!(te->flags & TE_MEMO)) continue;
+	if (te->trigkey >= 0 && self->seen[te->trigkey] != self->gen)
+	    continue;
+	if (patmatch(&te->macro->trig, NULL, str))
+	    bits[i / LONGBITS] |= 1L << (i % LONGBITS);
+    }
+}
+
+/* Claim and match lines of the batch until there are none left.  Called
+ * with match_lock locked. */
+static void prematch_claim(MatchThread *self)
+{
+    int k;
+
+    while (prematch.next < prematch.n) {
+	k = prematch.next++;
+	pthread_mutex_unlock(&match_lock);
+	prematch_line(self, k);
+	pthread_mutex_lock(&match_lock);
+	if (++prematch.finished == prematch.n)
+	    pthread_cond_signal(&match_done);
+    }
+}
+
+static void *match_thread_main(void *arg)
+{
+    MatchThread *self = arg;
+
+    pthread_mutex_lock(&match_lock);
+    while (!match_quit) {
+	prematch_claim(self);
+	if (!match_quit)
+	    pthread_cond_wait(&match_work, &match_lock);
+    }
+    pthread_mutex_unlock(&match_lock);
+    return NULL;
+}
+
+/* Stop all helper threads. */
+static void stop_matchers(void)
+{
+    int t;
+
+    if (!matcher) return;
+    pthread_mutex_lock(&match_lock);
+    match_quit = TRUE;
+    pthread_cond_broadcast(&match_work);
+    pthread_mutex_unlock(&match_lock);
+    for (t = 1; t < nmatchers; t++)
+	pthread_join(matcher[t].tid, NULL);
+    match_quit = FALSE;
+    for (t = 0; t < nmatchers; t++)
+	if (matcher[t].seen) FREE(matcher[t].seen);
+    FREE(matcher);
+    matcher = NULL;
+    nmatchers = 0;
+}
+
+/* Make sure there are <n> helper threads.  Returns the number there are. */
+static int start_matchers(int n)
+{
+    int err;
+
+    if (n > MAX_MATCH_THREADS) n = MAX_MATCH_THREADS;
+    if (matcher && nmatchers == n + 1) return n;
+    stop_matchers();
+    if (n <= 0) return 0;
+    matcher = XMALLOC(sizeof(MatchThread) * (n + 1));
+    memset(matcher, 0, sizeof(MatchThread) * (n + 1));
+    for (nmatchers = 1; nmatchers <= n; nmatchers++) {
+	err = tf_thread_create(&matcher[nmatchers].tid, match_thread_main,
+	    &matcher[nmatchers]);
+	if (err) {
+	    wprintf("match_threads: pthread_create: %s", strerror(err));
+	    break;
+	}
+    }
+    return nmatchers - 1;
+}
+#endif /* THREADED_MATCH */
+
+/* Match <n> lines of text from <world> against its triggers, using the
+ * %match_threads helper threads, so find_and_run_matches() can use the
+ * results when it gets to them.  The lines stay linked until prematch_done().
+ * Returns the number of lines matched (0 if nothing was done).
+ */
+int prematch_lines(World *world, String **lines, int n)
+{
+#ifdef THREADED_MATCH
+    TrigTable *tt;
+    int k, t;
+
+    prematch_done();
+    if (n < 2 || prematch.busy || start_matchers(match_threads) <= 0)
+	return 0;
+    tt = get_trigtable(world);
+    if (tt->nuncache == tt->n)
+	return 0;
+
+    (prematch.tt = tt)->links++;
+    kwset_ready(trigkeys);
+    for (t = 0; t < nmatchers; t++) {
+	if (matcher[t].nseen < trigkeys->nkeys) {
+	    matcher[t].seen = XREALLOC(matcher[t].seen,
+		sizeof(unsigned int) * trigkeys->nkeys);
+	    memset(matcher[t].seen + matcher[t].nseen, 0,
+		sizeof(unsigned int) * (trigkeys->nkeys - matcher[t].nseen));
+	    matcher[t].nseen = trigkeys->nkeys;
+	}
+    }
+    if (prematch.size < n) {
+	prematch.size = n;
+	prematch.line = XREALLOC(prematch.line, sizeof(PreMatch) * n);
+    }
+    prematch.words = (tt->n + LONGBITS - 1) / LONGBITS;
+    prematch.bits = XREALLOC(prematch.bits,
+	sizeof(unsigned long) * prematch.words * n);
+    memset(prematch.bits, 0, sizeof(unsigned long) * prematch.words * n);
+    for (k = 0; k < n; k++) {
+	(prematch.line[k].text = lines[k])->links++;
+	prematch.line[k].bits = prematch.bits + k * prematch.words;
+    }
+
+    pthread_mutex_lock(&match_lock);
+    prematch.n = n;
+    prematch.next = prematch.finished = 0;
+    pthread_cond_broadcast(&match_work);
+    prematch_claim(&matcher[0]);
+    while (prematch.finished < prematch.n)
+	pthread_cond_wait(&match_done, &match_lock);
+    pthread_mutex_unlock(&match_lock);
+    return n;
+#else
+    return 0;
+#endif
+}
+
+/* Release the batch from prematch_lines(). */
+void prematch_done(void)
+{
+    int k;
+
+    if (!prematch.tt) return;
+    for (k = 0; k < prematch.n; k++)
+	if (prematch.line[k].text) Stringfree(prematch.line[k].text);
+#ifdef THREADED_MATCH
+    pthread_mutex_lock(&match_lock);
+#endif
+    prematch.n = prematch.next = prematch.finished = 0;
+#ifdef THREADED_MATCH
+    pthread_mutex_unlock(&match_lock);
+#endif
+    free_trigtable(prematch.tt);
+    prematch.tt = NULL;
+}
+
+/* If <text> is in the batch and was matched against <tt>, take its results
+ * out of the batch and return them.  The caller must decrement
+ * prematch.busy when it is done with them.
+ */
+static const unsigned long *take_prematch(TrigTable *tt, String *text)
+{
+    int k;
+
+    if (tt != prematch.tt) return NULL;
+    for (k = 0; k < prematch.n; k++) {
+	if (prematch.line[k].text == text) {
+	    Stringfree(text);
+	    prematch.line[k].text = NULL;
+	    prematch.busy++;
+	    return prematch.line[k].bits;
+	}
+    }
+    return NULL;
+}
+
+/* Does text contain the literal with id <key> in trigkeys?  *scannedp and
+ * *scangenp remember what was scanned last, so a line is scanned only once
+ * no matter how many triggers ask.
+ */
+static int trigkey_found(String *text, int key, String **scannedp,
+    unsigned int *scangenp)
+{
+    if (text != *scannedp || trigkeys->gen != *scangenp || trigkeys->dirty) {
+	kwset_scan(trigkeys, text->data);
+	*scannedp = text;
+	*scangenp = trigkeys->gen;
+    }
+    return kwset_found(trigkeys, key);
+}
+
 /* Find and run one or more matches for a hook or trig.
  * text is text to be matched; if NULL, *linep is used.
  * If %Pn subs are to be allowed, text should be NULL.
@@ -1595,12 +2269,27 @@ int find_and_run_matches(String *text, int hooknum, String **linep,
     int lowerlimit = -1;                    /* lowest priority that can match */
     int header = 0;			    /* which headers have we printed? */
     ListEntry *gnode, *wnode, **nodep;
+    TrigTable *tt = NULL;		    /* trigger table, if walking it */
+    TrigEntry *te = NULL;		    /* current entry in tt */
+    int i = 0;				    /* position in tt */
+    int want;				    /* TE_* flags wanted */
+    TrigMemo *memo = NULL;		    /* known results for text */
+    const unsigned long *pmbits = NULL;	    /* results from prematch_lines() */
+    int mh = 0, mu = 0;			    /* positions in hit, uncache */
+    int memohit = FALSE, memorec = FALSE;
     Pattern *pattern;
     Macro *macro;
-    const char *worldtype = NULL;
+    String *scanned = NULL;		    /* text last scanned for trigkeys */
+    unsigned int scangen = 0;
+    int prof;				    /* collect MacroProf? */
+    int matched;
+    double start = 0;
 
     /* Macros are sorted by decreasing priority, with fall-thrus first.  So,
-     * we search the global and world lists in parallel.  For each matching
+     * we search the global and world lists in parallel.  For triggers, that
+     * has usually been done already: the world's trigger table holds the
+     * merged lists, minus macros that could never match here (see
+     * build_trigtable()).  For each matching
      * fall-thru, we apply its attributes; if it's a hook, we add it to a
      * queue, if it's a trigger, we execute it immediately.  When we find a
      * matching non-fall-thru, we collect a list of other non-fall-thru
@@ -1613,16 +2302,25 @@ int find_and_run_matches(String *text, int hooknum, String **linep,
      * The point of the queue is so the line can be printed before any output
      * generated by the macros.  We would like to do this for triggers as well
      * as hooks, but then /substitute wouldn't work.
+     * Most triggers have a literal string that must appear in any line they
+     * match (see pattern_literal()).  One scan of the text finds all of
+     * those that do, and triggers whose literal is missing are skipped
+     * without calling patmatch().  The scan is redone if the text is
+     * /substitute'd, or if a nested call or a new trigger spoiled it.
+     * Lines are often repeated, and for most triggers, whether they match a
+     * line depends only on the line; the table keeps a memo of those results
+     * for recent lines (see get_trigmemo()), so on a repeated line only
+     * triggers that matched before or that must always be tested are tried.
+     * With %match_threads, a busy world's lines may have been matched against
+     * the TE_MEMO entries already, in a batch (see prematch_lines()).
      */
     /* Note: kill_macro() does not remove macros from any lists, so this will
      * work correctly when a macro kills itself, or inserts a new macro just
-     * after itself in a list.
+     * after itself in a list.  If that happens while walking the trigger
+     * table, the rest of the walk is done in the lists themselves, starting
+     * where the table walk would have been in them.
      */
 
-    if (world)
-	worldtype = world_type(world);
-    if (!worldtype)
-	worldtype = "";
     if (!text)
         text = *linep;
     text->links++; /* in case substitute() frees text */
@@ -1633,51 +2331,149 @@ int find_and_run_matches(String *text, int hooknum, String **linep,
     } else {
 	gnode = triglist->head;
 	wnode = world ? world->triglist->head : NULL;
+	(tt = get_trigtable(world))->links++;
+	want = (borg ? TE_BODY : 0) | (hilite ? TE_HILITE : 0) |
+	    (gag ? TE_GAG : 0);
+	if (exec_list_long == 0 && tt->nuncache < tt->n &&
+	    text->len <= MEMO_MAXLEN)
+	{
+	    memo = get_trigmemo(tt, text, want | (globalflag ? TE_GLOBAL : 0));
+	}
+	if (exec_list_long == 0)
+	    pmbits = take_prematch(tt, text);
     }
 
     if (exec_list_long == 0) {
 	init_queue(runq);
     }
+    prof = profile_macros && exec_list_long == 0;
 
-    while (gnode || wnode) {
-	nodep = (!wnode) ? &gnode : (!gnode) ? &wnode :
-	    (rpricmp(MAC(wnode), MAC(gnode)) > 0) ? &gnode : &wnode;
-	macro = MAC(*nodep);
-	*nodep = (*nodep)->next;
-
-	if (macro->pri < lowerlimit && exec_list_long == 0)
-	    break;
-        if (macro->flags & MACRO_DEAD) continue;
-        if (!(
-	    (hooknum<0 && (
-		(borg && macro->body && (macro->prob > 0)) ||
-		(hilite && ((macro->attr & F_HWRITE) || macro->nsubattr)) ||
-		(gag && (macro->attr & F_GAG)))) ||
-	    (hooknum>=0 && VEC_ISSET(hooknum, &macro->hook))))
-	{
-	    continue;
+    while (1) {
+	if (tt && tt->gen != trig_gen) {
+	    /* triggers changed; continue in the lists */
+	    if (i > 0) {
+		gnode = tt->resume[i-1].gnode;
+		wnode = tt->resume[i-1].wnode;
+	    }
+	    if (memo) memo->busy--;
+	    memo = NULL;
+	    if (pmbits) prematch.busy--;
+	    pmbits = NULL;
+	    free_trigtable(tt);
+	    tt = NULL;
 	}
 
-	/* triggers are listed by world, but hooks are not, so we must check */
-        if (macro->world && macro->world != world) continue;
+	if (tt) {
+	    if (memo && i < memo->reach) {
+		/* skip to the next entry that matched or must be tested */
+		int next = memo->reach;
+		while (mh < memo->nhit && memo->hit[mh] < i) mh++;
+		if (mh < memo->nhit && memo->hit[mh] < next)
+		    next = memo->hit[mh];
+		while (mu < tt->nuncache && tt->uncache[mu] < i) mu++;
+		if (mu < tt->nuncache && tt->uncache[mu] < next)
+		    next = tt->uncache[mu];
+		i = next;
+	    }
+	    if (i >= tt->n) break;
+	    te = &tt->entry[i++];
+	    if (te->pri < lowerlimit && exec_list_long == 0)
+		break;
+	    want = (borg ? TE_BODY : 0) | (hilite ? TE_HILITE : 0) |
+		(gag ? TE_GAG : 0);
+	    memohit = memorec = FALSE;
+	    if (memo) {
+		if (want != (memo->key & ~TE_GLOBAL)) {
+		    /* a trigger changed %borg, %hilite, or %gag */
+		    memo->busy--;
+		    memo = NULL;
+		} else if (i - 1 < memo->reach) {
+		    memohit = te->flags & TE_MEMO;
+		} else if (i - 1 == memo->reach) {
+		    memo->reach = i;
+		    memorec = te->flags & TE_MEMO;
+		}
+	    }
+	    if (!(te->flags & want)) continue;
+	    if (!globalflag && (te->flags & TE_GLOBAL)) continue;
+	    if (!memohit && te->trigkey >= 0 &&
+		!(pmbits && (te->flags & TE_MEMO)) &&
+		!trigkey_found(text, te->trigkey, &scanned, &scangen))
+		continue;
+	    macro = te->macro;
 
-        if (!globalflag && !macro->world) continue;
-        if (macro->wtype.str) {
-            if (!world) continue;
-            if (!patmatch(&macro->wtype, NULL, worldtype))
-                continue;
-        }
-        if (macro->exprprog) {
-            struct Value *result = NULL;
-            int expr_condition;
-	    result = expr_value_safe(macro->exprprog);
-            expr_condition = valbool(result);
-            freeval(result);
-            if (!expr_condition) continue;
-        }
-        pattern = hooknum>=0 ? &macro->hargs : &macro->trig;
-        if ((hooknum>=0 && !macro->hargs.str) || patmatch(pattern, CS(text), NULL))
-	{
+	} else {
+	    if (!gnode && !wnode) break;
+	    memohit = memorec = FALSE;
+	    nodep = (!wnode) ? &gnode : (!gnode) ? &wnode :
+		(rpricmp(MAC(wnode), MAC(gnode)) > 0) ? &gnode : &wnode;
+	    macro = MAC(*nodep);
+	    *nodep = (*nodep)->next;
+
+	    if (macro->pri < lowerlimit && exec_list_long == 0)
+		break;
+	    if (macro->flags & MACRO_DEAD) continue;
+	    if (!(
+		(hooknum<0 && (
+		    (borg && macro->body && (macro->prob > 0)) ||
+		    (hilite && ((macro->attr & F_HWRITE) || macro->nsubattr)) ||
+		    (gag && (macro->attr & F_GAG)))) ||
+		(hooknum>=0 && VEC_ISSET(hooknum, &macro->hook))))
+	    {
+		continue;
+	    }
+
+	    /* triggers are listed by world, but hooks are not, so we must
+	     * check */
+	    if (macro->world && macro->world != world) continue;
+
+	    if (!globalflag && !macro->world) continue;
+	    if (hooknum<0 && macro->trigkey >= 0 &&
+		!trigkey_found(text, macro->trigkey, &scanned, &scangen))
+		continue;
+	    if (macro->wtype.str && (!world || !wtype_match(macro, world)))
+		continue;
+	}
+
+	if (memohit) {
+	    /* same result as for the last line; it took no time to find */
+	    matched = 1;
+	    if (prof) {
+		macro->prof.tries++;
+		macro->prof.hits++;
+	    }
+	} else {
+	    if (prof) start = nanotime();
+	    if (pmbits && (te->flags & TE_MEMO)) {
+		matched = !!(pmbits[(i-1) / LONGBITS] &
+		    (1L << ((i-1) % LONGBITS)));
+	    } else {
+		matched = 1;
+		if (macro->exprprog) {
+		    struct Value *result = NULL;
+		    flush_hilites();
+		    result = expr_value_safe(macro->exprprog);
+		    matched = valbool(result);
+		    freeval(result);
+		}
+		pattern = hooknum>=0 ? &macro->hargs : &macro->trig;
+		matched = matched && ((hooknum>=0 && !macro->hargs.str) ||
+		    patmatch(pattern, CS(text), NULL));
+	    }
+	    if (prof) {
+		macro->prof.tries++;
+		macro->prof.hits += matched;
+		macro->prof.matchtime += nanotime() - start;
+	    }
+	    if (memorec && matched) {
+		if (memo->nhit == memo->size) {
+		    memo->size = memo->size ? 2 * memo->size : 8;
+		    memo->hit = XREALLOC(memo->hit, sizeof(int) * memo->size);
+		}
+		memo->hit[memo->nhit++] = i - 1;
+	    }
+	}
+        if (matched) {
 	    if (exec_list_long == 0) {
 		if (macro->fallthru) {
 		    if (linep && *linep)
@@ -1688,6 +2484,14 @@ int find_and_run_matches(String *text, int hooknum, String **linep,
 			ran += run_match(macro, text, hooknum);
 			if (linep && hooknum<0) {
 			    /* in case of /substitute */ /* XXX */
+			    if (memo && *linep != text) {
+				memo->busy--;
+				memo = NULL;
+			    }
+			    if (pmbits && *linep != text) {
+				prematch.busy--;
+				pmbits = NULL;
+			    }
 			    Stringfree(text);
 			    text = *linep;
 			    text->links++;
@@ -1743,6 +2547,8 @@ int find_and_run_matches(String *text, int hooknum, String **linep,
 	    }
 	}
 
+	flush_hilites();
+
 	/* print the line! */
 	if (hooknum>=0 && linep && *linep) {
 	    if (hook_table[hooknum].hooktype & HT_ALERT) {
@@ -1774,12 +2580,159 @@ int find_and_run_matches(String *text, int hooknum, String **linep,
 	    ran, (ran != 1) ? "s" : "");
     }
 
+    if (memo) memo->busy--;
+    if (pmbits) prematch.busy--;
+    if (tt) free_trigtable(tt);
     recur_count--;
     Stringfree(text);
     return ran;
 }
 
 
+/* Add a span of hilites.line to be adjusted by <attr>. */
+static void add_hilite_span(int start, int end, cattr_t attr)
+{
+    if (end > hilites.line->len) end = hilites.line->len;
+    if (start < 0 || start >= end) return;
+    if (hilites.n == hilites.size) {
+	hilites.size = hilites.size ? 2 * hilites.size : 16;
+	hilites.span = XREALLOC(hilites.span,
+	    sizeof(HiliteSpan) * hilites.size);
+	hilites.edge = XREALLOC(hilites.edge, sizeof(int) * 2 * hilites.size);
+	hilites.act = XREALLOC(hilites.act, sizeof(int) * hilites.size);
+    }
+    hilites.span[hilites.n].start = start;
+    hilites.span[hilites.n].end = end;
+    hilites.span[hilites.n].attr = attr;
+    hilites.n++;
+}
+
+/* Add the spans of <macro>'s -P parts for one match of its trigger, whose
+ * subexpression offsets are in <ov>. */
+static void add_match_spans(Macro *macro, const PCRE2_SIZE *ov, int nov)
+{
+    int x, n;
+
+    for (x = 0; x < macro->nsubattr; x++) {
+	n = macro->subattr[x].subexp;
+	if (n == -1)
+	    add_hilite_span(0, ov[0], macro->subattr[x].attr);
+	else if (n == -2)
+	    add_hilite_span(ov[1], hilites.line->len, macro->subattr[x].attr);
+	else if (n < nov && ov[n * 2] != PCRE2_UNSET)
+	    add_hilite_span(ov[n * 2], ov[n * 2 + 1], macro->subattr[x].attr);
+    }
+}
+
+/* Collect the partial hilites of <macro>, whose trigger matched <text>, for
+ * <line>.  Every match in the text counts, not just the first.
+ */
+static void add_partial_hilites(Macro *macro, String *text, String *line)
+{
+    PCRE2_SIZE where[2];
+    const PCRE2_SIZE *ov;
+    RegInfo *ri = macro->trig.ri;
+    const char *p;
+    int offset = 0, len;
+
+    if (hilites.line != line) {
+	flush_hilites();
+	(hilites.line = line)->links++;
+    }
+
+    if (macro->trig.mflag == MATCH_REGEXP) {
+	/* The first match is the one patmatch() already found.  The rest are
+	 * found in span_md, so ri->ovector is still right for %P. */
+	if (span_mdsize < ri->ovecsize) {
+	    if (span_md) pcre2_match_data_free(span_md);
+	    span_md = pcre2_match_data_create(ri->ovecsize, NULL);
+	    span_mdsize = span_md ? ri->ovecsize : 0;
+	}
+	ov = ri->ovector;
+	while (1) {
+	    add_match_spans(macro, ov, ri->ovecsize);
+	    if (offset == ov[1]) break; /* offset wouldn't move */
+	    offset = ov[1];
+	    if (!span_md || offset >= line->len ||
+		!tf_reg_exec_into(ri, text->data, text->len, offset, span_md))
+		break;
+	    ov = pcre2_get_ovector_pointer(span_md);
+	}
+
+    } else if (macro->trig.mflag == MATCH_SUBSTR) {
+	len = strlen(macro->trig.str);
+	for (p = strstr(text->data, macro->trig.str); p;
+	    p = strstr(text->data + offset, macro->trig.str))
+	{
+	    where[0] = p - text->data;
+	    where[1] = offset = where[0] + len;
+	    add_match_spans(macro, where, 1);
+	    if (!len || offset >= line->len) break;
+	}
+    }
+}
+
+/* Apply the collected partial hilites to their line.  The spans' edges cut
+ * the line into runs; each span covering a run adjusts it in turn, which is
+ * the same as adjusting it once by all of their attrs combined.
+ */
+static void flush_hilites(void)
+{
+    String *line = hilites.line;
+    HiliteSpan *span = hilites.span;
+    int *edge = hilites.edge, *act = hilites.act;
+    int i, e, a, x, pos, nact, prev;
+    attr_t attr;
+
+    if (!line) return;
+    if (hilites.n) {
+	check_charattrs(line, line->len, 0, __FILE__, __LINE__);
+
+	/* Bucket the edges by position.  Edge 2x is the start of span x, and
+	 * edge 2x+1 is its end. */
+	if (hilites.nat < line->len + 1) {
+	    hilites.nat = line->len + 1;
+	    hilites.at = XREALLOC(hilites.at, sizeof(int) * hilites.nat);
+	}
+	for (pos = 0; pos <= line->len; pos++)
+	    hilites.at[pos] = -1;
+	for (e = 0; e < 2 * hilites.n; e++) {
+	    pos = (e & 1) ? span[e >> 1].end : span[e >> 1].start;
+	    edge[e] = hilites.at[pos];
+	    hilites.at[pos] = e;
+	}
+
+	/* Sweep, keeping the spans covering the current run in act[], in
+	 * the order they were found. */
+	for (nact = prev = pos = 0; pos <= line->len; pos++) {
+	    if ((e = hilites.at[pos]) < 0) continue;
+	    if (nact) {
+		attr = span[act[0]].attr;
+		for (a = 1; a < nact; a++)
+		    attr = adj_attr(attr, span[act[a]].attr);
+		for (i = prev; i < pos; i++)
+		    line->charattrs[i] = adj_attr(line->charattrs[i], attr);
+	    }
+	    prev = pos;
+	    for ( ; e >= 0; e = edge[e]) {
+		x = e >> 1;
+		if (!(e & 1)) {
+		    for (a = nact++; a > 0 && act[a-1] > x; a--)
+			act[a] = act[a-1];
+		    act[a] = x;
+		} else {
+		    for (a = 0; act[a] != x; a++);
+		    for (nact--; a < nact; a++)
+			act[a] = act[a+1];
+		}
+	    }
+	}
+    }
+    hilites.n = 0;
+    hilites.line = NULL;
+    Stringfree(line);
+}
+
 /* apply attributes of a macro that has been selected by a trigger or hook */
 static void apply_attrs_of_match(
     Macro *macro,	/* macro to apply */
@@ -1787,11 +2740,10 @@ static void apply_attrs_of_match(
     int hooknum,	/* hook number */
     String *line)	/* line to which attributes are applied */
 {
-    RegInfo *old, *ri;
-
     if (!hilite && !gag) return;
 
-    /* Apply attributes (full and partial) to line. */
+    /* Apply attributes to line.  Partial ones are applied later, together
+     * with those of other triggers, by flush_hilites(). */
     if (!hilite)
 	line->attrs = adj_attr(line->attrs, macro->attr & F_GAG);
     else if (!gag)
@@ -1799,53 +2751,8 @@ static void apply_attrs_of_match(
     else
 	line->attrs = adj_attr(line->attrs, macro->attr);
 
-    ri = (hooknum>=0 ? macro->hargs : macro->trig).ri;
-
-    if (hooknum<0 && macro->trig.mflag == MATCH_REGEXP && line->len && hilite
-	&& macro->nsubattr)
-    {
-	int i, x, offset = 0;
-	int start, end;
-	int *saved_ovector = NULL;
-
-	if (text)
-	    old = new_reg_scope(ri, text);
-
-	check_charattrs(line, line->len, 0, __FILE__, __LINE__);
-	do {
-	    for (x = 0; x < macro->nsubattr; x++) {
-		if (macro->subattr[x].subexp == -1) {
-		    start = 0;
-		    end = ri->ovector[0];
-		} else if (macro->subattr[x].subexp == -2) {
-		    start = ri->ovector[1];
-		    end = line->len;
-		} else {
-		    start = ri->ovector[macro->subattr[x].subexp * 2];
-		    end = ri->ovector[macro->subattr[x].subexp * 2 + 1];
-		}
-		for (i = start; i < end; ++i)
-		    line->charattrs[i] =
-			adj_attr(line->charattrs[i], macro->subattr[x].attr);
-	    }
-	    if (offset == ri->ovector[1]) break; /* offset wouldn't move */
-	    offset = ri->ovector[1];
-	    if (!saved_ovector) {
-		saved_ovector = ri->ovector;
-		ri->ovector = NULL;
-	    }
-	} while (offset < line->len &&
-	    tf_reg_exec(ri, CS(text), NULL, offset) > 0);
-	/* restore original startp/endp */
-	if (saved_ovector) {
-	    if (ri->ovector) FREE(ri->ovector);
-	    ri->ovector = saved_ovector;
-	}
-	(ri->Str = CS(line))->links++;
-
-	if (text)
-	    restore_reg_scope(old);
-    }
+    if (hooknum<0 && line->len && hilite && macro->nsubattr)
+	add_partial_hilites(macro, text, line);
 }
 
 typedef struct max_ctr {
@@ -1904,6 +2811,9 @@ static int run_match(
 	callingsock = xsock;
         if (macro->prob == 100 || RRAND(0, 99) < macro->prob) {
             if (macro->shots && !--macro->shots) kill_macro(macro);
+	    /* the body may look at text, or /substitute it */
+	    if (mecho > macro->invis || (macro->body && macro->body->len))
+		flush_hilites();
             if (mecho > macro->invis) {
                 char numbuf[16];
                 if (!*macro->name) sprintf(numbuf, "#%d", macro->num);
@@ -1914,8 +2824,15 @@ static int run_match(
 		    text, mecho_attr);
             }
             if (macro->body && macro->body->len) {
+		double start = profile_macros ? nanotime() : 0;
                 do_macro(macro, text, 0, hooknum>=0 ? USED_HOOK : USED_TRIG, 0);
                 ran += !macro->quiet;
+		if (start) {
+		    /* macro may be dead, but it is not freed yet */
+		    double t = nanotime() - start;
+		    macro->prof.runtime += t;
+		    if (t > macro->prof.maxrun) macro->prof.maxrun = t;
+		}
             }
         }
 
@@ -1936,6 +2853,18 @@ void free_macros(void)
 {
     while (maclist->head) nuke_macro((Macro *)maclist->head->datum);
     free_hash(macro_table);
+    if (noworld_trigtable) free_trigtable(noworld_trigtable);
+    if (span_md) pcre2_match_data_free(span_md);
+    if (hilites.span) FREE(hilites.span);
+    if (hilites.edge) FREE(hilites.edge);
+    if (hilites.act) FREE(hilites.act);
+    if (hilites.at) FREE(hilites.at);
+    prematch_done();
+#ifdef THREADED_MATCH
+    stop_matchers();
+#endif
+    if (prematch.line) FREE(prematch.line);
+    if (prematch.bits) FREE(prematch.bits);
 }
 #endif
 
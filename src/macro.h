@@ -13,6 +13,7 @@
 enum { USED_NAME, USED_TRIG, USED_HOOK, USED_KEY, USED_N }; /* for Macro.used */
 
 extern int invis_flag;
+extern unsigned long trig_memo_lookups, trig_memo_hits;
 
 extern void   init_macros(void);
 extern int    macro_equal(Macro *m1, Macro *m2);
@@ -29,6 +30,10 @@ extern void   nuke_dead_macros(void);
 extern void   kill_macro(struct Macro *macro);
 extern void   rebind_key_macros(void);
 extern void   remove_world_macros(struct World *w);
+extern void   free_world_trigtable(struct World *w);
+extern int    prematch_lines(struct World *world, String **lines, int n);
+extern void   prematch_done(void);
+extern void   world_type_changed(struct World *w);
 extern int    save_macros(String *args, int offset);
 extern int    do_macro(Macro *macro, String *args, int offset,
 		int used_type, int kbnumlocal);
@@ -161,7 +161,11 @@ int main(int argc, char *argv[])
     oputs("Type `/help copyright' for more information.");
     if (*contrib) oputs(contrib);
     if (*mods) oputs(mods);
-    oprintf("Using PCRE version %s", pcre_version());
+    {
+	char pcrever[64];
+	if (pcre2_config(PCRE2_CONFIG_VERSION, pcrever) < 0) *pcrever = '\0';
+	oprintf("Using PCRE2 version %s", pcrever);
+    }
     oputs("Type `/help', `/help topics', or `/help intro' for help.");
     oputs("Type `/quit' to quit tf.");
     oputs("");
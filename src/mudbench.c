@@ -0,0 +1,571 @@
+/*************************************************************************
+ *  TinyFugue - programmable mud client
+ *  Copyright (C) 1993, 1994, 1995, 1996, 1997, 1998, 1999, 2002, 2003, 2004, 2005, 2006-2007 Ken Keys
+ *
+ *  TinyFugue (aka "tf") is protected under the terms of the GNU
+ *  General Public License.  See the file "COPYING" for details.
+ ************************************************************************/
+static const char RCSid[] = "$Id$";
+
+
+/**************************************************************
+ * Loopback MUD emulator for benchmarking tf
+ *
+ * Listens on 127.0.0.1, runs a headless tf that connects to it,
+ * and sends it a recorded transcript (or a synthetic session with
+ * telnet negotiation, colored text, and GA/EOR prompts), optionally
+ * compressed with MCCP v2, at a given rate.  Every so often a probe
+ * line is sent, which a trigger in tf echoes back; the time until
+ * the echo arrives is the input-to-output latency.  tf reports its
+ * own cputime() at the start and end of the session.
+ *
+ * A transcript is the raw data a server sent (e.g., captured with
+ * "nc host port > file"); it is replayed a line at a time, telnet
+ * commands and all.  It should not itself be MCCP compressed.
+ *
+ * Usage: mudbench [options] [transcript...]
+ **************************************************************/
+
+#include "tfconfig.h"
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#if HAVE_SYS_SELECT_H
+# include <sys/select.h>
+#endif
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include "port.h"
+#if HAVE_MCCP
+# include <zlib.h>
+#endif
+
+#define IAC		'\377'
+#define DONT		'\376'
+#define DO		'\375'
+#define WONT		'\374'
+#define WILL		'\373'
+#define SB		'\372'
+#define GA		'\371'
+#define EOR		'\357'
+#define SE		'\360'
+#define TELOPT_TTYPE	'\030'
+#define TELOPT_EOR	'\031'
+#define TELOPT_NAWS	'\037'
+#define TELOPT_MCCP2	'\126'
+
+#define CHUNK		65536	/* most unsent output to generate at once */
+#define TIMEOUT		30	/* seconds without progress before giving up */
+
+typedef struct Buf {
+    char *data;
+    size_t len, size;
+} Buf;
+
+static const char *tfpath = "./tf";
+static const char *libdir = "../tf-lib";
+static const char *trigfile = NULL;
+static double rate = 0;		/* lines per second; 0 means no limit */
+static long nlines = 100000;	/* length of synthetic session */
+static int loops = 1;		/* times to replay transcripts */
+static int probe_every = 100;	/* lines between latency probes */
+static int zflag = 0;
+static int verbose = 0;
+
+static Buf transcript;		/* concatenated transcript files */
+static Buf out;			/* bytes waiting to be sent to tf */
+static Buf in;			/* partial line received from tf */
+static pid_t tfpid = -1;
+static char scriptname[64] = "";
+
+/* state of session, as seen by the server */
+static int eor = 0;		/* tf agreed to EOR */
+static int mccp = 0;		/* tf answered COMPRESS2: 1 = DO, -1 = DONT */
+static int zactive = 0;		/* output is being compressed */
+static int started = 0;		/* tf sent "start" */
+static int finished = 0;	/* tf sent "done" */
+static double cpu_start, cpu_end;
+
+static double *probe_sent;	/* when each probe was sent */
+static double *latency;		/* round trip of each echoed probe */
+static long nprobes = 0, nechoes = 0, probe_size = 0;
+
+#if HAVE_MCCP
+static z_stream zs;
+#endif
+
+static double now(void)
+{
+#if HAVE_CLOCK_GETTIME && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+    {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+    }
+}
+
+static void cleanup(void)
+{
+    if (*scriptname) unlink(scriptname);
+    if (tfpid > 0) kill(tfpid, SIGTERM);
+}
+
+static void fail(const char *fmt, const char *arg)
+{
+    fprintf(stderr, "mudbench: ");
+    fprintf(stderr, fmt, arg);
+    fprintf(stderr, "\n");
+    cleanup();
+    exit(1);
+}
+
+static void bufadd(Buf *buf, const char *data, size_t len)
+{
+    if (buf->len + len > buf->size) {
+	buf->size = (buf->len + len) * 2 + 1024;
+	if (!(buf->data = realloc(buf->data, buf->size)))
+	    fail("out of memory", NULL);
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+static void bufdrop(Buf *buf, size_t len)
+{
+    memmove(buf->data, buf->data + len, buf->len - len);
+    buf->len -= len;
+}
+
+/* Queue data for tf, compressed once MCCP has started. */
+static void emit(const char *data, size_t len)
+{
+#if HAVE_MCCP
+    if (zactive) {
+	char zbuf[CHUNK];
+	zs.next_in = (Bytef *)data;
+	zs.avail_in = len;
+	do {
+	    zs.next_out = (Bytef *)zbuf;
+	    zs.avail_out = sizeof(zbuf);
+	    if (deflate(&zs, Z_SYNC_FLUSH) != Z_OK)
+		fail("deflate failed", NULL);
+	    bufadd(&out, zbuf, sizeof(zbuf) - zs.avail_out);
+	} while (zs.avail_out == 0);
+	return;
+    }
+#endif
+    bufadd(&out, data, len);
+}
+
+static void emit3(char c1, char c2, char c3)
+{
+    char cmd[3];
+    cmd[0] = c1;  cmd[1] = c2;  cmd[2] = c3;
+    emit(cmd, 3);
+}
+
+static void send_probe(void)
+{
+    char line[64];
+
+    if (nprobes == probe_size) {
+	probe_size = probe_size * 2 + 1024;
+	probe_sent = realloc(probe_sent, probe_size * sizeof(double));
+	latency = realloc(latency, probe_size * sizeof(double));
+	if (!probe_sent || !latency) fail("out of memory", NULL);
+    }
+    sprintf(line, "mudbench probe %ld\r\n", nprobes);
+    probe_sent[nprobes++] = now();
+    emit(line, strlen(line));
+}
+
+/* Line <n> of the synthetic session: a rotation of room text, colored
+ * chatter, and combat spam, with a prompt every 10 lines. */
+static void synthetic_line(long n)
+{
+    static const char *text[] = {
+	"You are standing in a narrow alley between two tall stone buildings.",
+	"\033[1;32mAlyssa gossips, 'anyone want to group for the crypt?'\033[0m",
+	"The goblin scout misses you with its rusty dagger.",
+	"You slash the goblin scout.  It staggers under the blow!",
+	"\033[36mA cold wind blows through the alley.\033[0m",
+	"Obvious exits: north, east, down.",
+	"\033[1;33mYou receive 42 experience points.\033[0m",
+	"The goblin scout is in awful condition.",
+	"Bartholomew tells you, 'meet me at the fountain in 5'",
+	"\033[31mThe goblin scout hits you very hard.\033[0m",
+    };
+    char buf[256];
+    int i = n % 10;
+
+    sprintf(buf, "%s\r\n", text[i]);
+    emit(buf, strlen(buf));
+    if (i == 9) {
+	sprintf(buf, "<%ldhp %ldm %ldmv> ", 100 + n % 37, 50 + n % 11,
+	    80 + n % 23);
+	emit(buf, strlen(buf));
+	buf[0] = IAC;
+	buf[1] = eor ? EOR : GA;
+	emit(buf, 2);
+    }
+}
+
+/* Queue lines until <due> lines have been sent (or CHUNK bytes are
+ * waiting).  Returns the number of lines sent so far. */
+static long generate(long sent, long total, long due)
+{
+    static const char *pos = NULL;
+    const char *end;
+
+    if (!pos) pos = transcript.data;
+    while (sent < due && sent < total && out.len < CHUNK) {
+	if (probe_every && sent % probe_every == 0)
+	    send_probe();
+	if (!transcript.len) {
+	    synthetic_line(sent);
+	} else {
+	    if (pos == transcript.data + transcript.len)
+		pos = transcript.data;
+	    end = memchr(pos, '\n', transcript.data + transcript.len - pos);
+	    end = end ? end + 1 : transcript.data + transcript.len;
+	    emit(pos, end - pos);
+	    pos = end;
+	}
+	sent++;
+    }
+    return sent;
+}
+
+static void handle_line(char *line)
+{
+    long n;
+    double cpu;
+
+    if (sscanf(line, "mudbench probe %ld", &n) == 1) {
+	if (n >= 0 && n < nprobes)
+	    latency[nechoes++] = now() - probe_sent[n];
+    } else if (sscanf(line, "mudbench start %lf", &cpu) == 1) {
+	cpu_start = cpu;
+	started = 1;
+    } else if (sscanf(line, "mudbench done %lf", &cpu) == 1) {
+	cpu_end = cpu;
+	finished = 1;
+    }
+}
+
+/* Process data from tf: answer telnet negotiation, collect lines. */
+static void receive(const char *data, int len)
+{
+    static enum { TEXT, CMD, OPT, SUB, SUBIAC } state = TEXT;
+    static char cmd;
+    int i;
+
+    for (i = 0; i < len; i++) {
+	char c = data[i];
+	switch (state) {
+	case TEXT:
+	    if (c == IAC) {
+		state = CMD;
+	    } else if (c == '\n') {
+		bufadd(&in, "", 1);
+		handle_line(in.data);
+		in.len = 0;
+	    } else if (c != '\r') {
+		bufadd(&in, &c, 1);
+	    }
+	    break;
+	case CMD:
+	    cmd = c;
+	    state = (c == SB) ? SUB : (c == WILL || c == WONT || c == DO ||
+		c == DONT) ? OPT : TEXT;
+	    break;
+	case OPT:
+	    if (c == TELOPT_EOR && cmd == DO) eor = 1;
+	    if (c == TELOPT_MCCP2) mccp = (cmd == DO) ? 1 : -1;
+	    if (c == TELOPT_TTYPE && cmd == WILL) {
+		emit3(IAC, SB, TELOPT_TTYPE);
+		emit3('\001', IAC, SE);
+	    }
+	    state = TEXT;
+	    break;
+	case SUB:
+	    if (c == IAC) state = SUBIAC;
+	    break;
+	case SUBIAC:
+	    state = (c == SE) ? TEXT : SUB;
+	    break;
+	}
+    }
+}
+
+/* tf wants an absolute library path, and /load should not depend on
+ * tf's idea of the current directory. */
+static const char *absolute(const char *name)
+{
+    char cwd[1024], *path;
+
+    if (*name == '/' || !getcwd(cwd, sizeof(cwd)))
+	return name;
+    if (!(path = malloc(strlen(cwd) + strlen(name) + 2)))
+	fail("out of memory", NULL);
+    sprintf(path, "%s/%s", cwd, name);
+    return path;
+}
+
+static void write_script(int port)
+{
+    FILE *file;
+    int fd;
+    const char *tmpdir = getenv("TMPDIR");
+
+    sprintf(scriptname, "%.40s/mudbenchXXXXXX", tmpdir ? tmpdir : "/tmp");
+    if ((fd = mkstemp(scriptname)) < 0 || !(file = fdopen(fd, "w")))
+	fail("can't create script: %s", strerror(errno));
+    fprintf(file, "/set more=off\n");
+    fprintf(file, "/set max_trig=0\n");
+    fprintf(file, "/def -i -F -p2147483647 -mglob -t'mudbench probe *' "
+	"mudbench_probe = /send mudbench probe %%3\n");
+    fprintf(file, "/def -i -F -p2147483647 -mglob -t'mudbench done' "
+	"mudbench_done = /send mudbench done $[cputime()]\n");
+    fprintf(file, "/def -i -F -p2147483647 -hCONNECT "
+	"mudbench_start = /send mudbench start $[cputime()]\n");
+    fprintf(file, "/def -i -F -p2147483647 -hDISCONNECT "
+	"mudbench_quit = /quit -y\n");
+    if (trigfile)
+	fprintf(file, "/load %s\n", trigfile);
+    fprintf(file, "/addworld -Ttelnet mudbench 127.0.0.1 %d\n", port);
+    fprintf(file, "/connect mudbench\n");
+    fclose(file);
+}
+
+static void start_tf(void)
+{
+    char libopt[2048], scriptopt[128];
+    int fd;
+
+    sprintf(libopt, "-L%.2040s", libdir);
+    sprintf(scriptopt, "-f%s", scriptname);
+    if ((tfpid = fork()) < 0)
+	fail("fork: %s", strerror(errno));
+    if (tfpid == 0) {
+	if ((fd = open("/dev/null", O_RDWR)) >= 0) {
+	    dup2(fd, STDIN_FILENO);
+	    if (!verbose) dup2(fd, STDOUT_FILENO);
+	}
+	execl(tfpath, tfpath, libopt, "-n", scriptopt, (char *)NULL);
+	fprintf(stderr, "mudbench: %s: %s\n", tfpath, strerror(errno));
+	_exit(1);
+    }
+}
+
+static void load_transcript(const char *name)
+{
+    char buf[8192];
+    int fd, len;
+
+    if ((fd = open(name, O_RDONLY)) < 0)
+	fail("%s", strerror(errno));
+    while ((len = read(fd, buf, sizeof(buf))) > 0)
+	bufadd(&transcript, buf, len);
+    close(fd);
+}
+
+static long count_lines(void)
+{
+    const char *p = transcript.data, *end = p + transcript.len;
+    long n = 0;
+
+    while (p < end && (p = memchr(p, '\n', end - p))) { n++; p++; }
+    if (transcript.len && transcript.data[transcript.len - 1] != '\n')
+	n++;
+    return n;
+}
+
+static int cmpdouble(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(int pct)
+{
+    long i = (nechoes * pct + 99) / 100 - 1;
+    return latency[i < 0 ? 0 : i] * 1e3;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+	"usage: %s [-t tf] [-L libdir] [-f file] [-r rate] [-n lines]\n"
+	"       [-l loops] [-p probe] [-z] [-v] [transcript...]\n"
+	"  -t tf      tf binary to run (default %s)\n"
+	"  -L libdir  tf library directory (default %s)\n"
+	"  -f file    trigger set to load into tf\n"
+	"  -r rate    lines per second to send (default 0, unlimited)\n"
+	"  -n lines   length of synthetic session (default %ld)\n"
+	"  -l loops   number of times to replay transcripts (default %d)\n"
+	"  -p probe   lines between latency probes (default %d, 0 for none)\n"
+	"  -z         compress with MCCP v2\n"
+	"  -v         show tf's output\n",
+	prog, tfpath, libdir, nlines, loops, probe_every);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int opt, lfd, fd, len, status, maxfd, one = 1;
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    long total, sent = 0, due;
+    double t_start = 0, t_end, t_last;
+    char buf[CHUNK];
+    fd_set readers, writers;
+    struct timeval tv;
+
+    while ((opt = getopt(argc, argv, "t:L:f:r:n:l:p:zvh")) != -1) {
+	switch (opt) {
+	case 't':  tfpath = optarg;  break;
+	case 'L':  libdir = optarg;  break;
+	case 'f':  trigfile = optarg;  break;
+	case 'r':  rate = atof(optarg);  break;
+	case 'n':  nlines = atol(optarg);  break;
+	case 'l':  loops = atoi(optarg);  break;
+	case 'p':  probe_every = atoi(optarg);  break;
+	case 'z':  zflag = 1;  break;
+	case 'v':  verbose = 1;  break;
+	default:   usage(argv[0]);
+	}
+    }
+    if (rate < 0 || nlines <= 0 || loops <= 0 || probe_every < 0)
+	usage(argv[0]);
+#if !HAVE_MCCP
+    if (zflag) fail("MCCP is not supported in this build", NULL);
+#endif
+    libdir = absolute(libdir);
+    if (trigfile) trigfile = absolute(trigfile);
+    for ( ; optind < argc; optind++)
+	load_transcript(argv[optind]);
+    total = transcript.len ? count_lines() * loops : nlines;
+    if (!total) fail("transcript is empty", NULL);
+
+    signal(SIGPIPE, SIG_IGN);
+    if ((lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	fail("socket: %s", strerror(errno));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	listen(lfd, 1) < 0 ||
+	getsockname(lfd, (struct sockaddr *)&addr, &addrlen) < 0)
+    {
+	fail("listen: %s", strerror(errno));
+    }
+
+    write_script(ntohs(addr.sin_port));
+    start_tf();
+
+    FD_ZERO(&readers);
+    FD_SET(lfd, &readers);
+    tv.tv_sec = TIMEOUT;
+    tv.tv_usec = 0;
+    if (select(lfd + 1, &readers, NULL, NULL, &tv) <= 0)
+	fail("tf did not connect", NULL);
+    if ((fd = accept(lfd, NULL, NULL)) < 0)
+	fail("accept: %s", strerror(errno));
+    close(lfd);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    /* Without this, Nagle and tf's delayed acks hold paced lines back
+     * for up to 40ms, which would swamp the latency being measured. */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&one, sizeof(one));
+
+    /* Negotiate like a typical server. */
+    emit3(IAC, WILL, TELOPT_EOR);
+    emit3(IAC, DO, TELOPT_NAWS);
+    emit3(IAC, DO, TELOPT_TTYPE);
+    if (zflag) emit3(IAC, WILL, TELOPT_MCCP2);
+
+    t_last = now();
+    maxfd = fd + 1;
+    while (!finished) {
+	double t = now();
+
+	if (!started || (zflag && !mccp)) {
+	    /* still negotiating */
+	} else if (!t_start) {
+#if HAVE_MCCP
+	    if (zflag && mccp > 0) {
+		emit3(IAC, SB, TELOPT_MCCP2);
+		emit("\377\360", 2);	/* IAC SE */
+		if (deflateInit(&zs, Z_DEFAULT_COMPRESSION) != Z_OK)
+		    fail("deflateInit failed", NULL);
+		zactive = 1;
+	    } else
+#endif
+	    if (zflag)
+		fprintf(stderr, "mudbench: tf refused MCCP\n");
+	    t_start = t;
+	} else if (sent < total) {
+	    due = rate ? (long)((t - t_start) * rate) + 1 : total;
+	    if ((sent = generate(sent, total, due)) == total)
+		emit("mudbench done\r\n", 15);
+	}
+
+	FD_ZERO(&readers);
+	FD_ZERO(&writers);
+	FD_SET(fd, &readers);
+	if (out.len) FD_SET(fd, &writers);
+	tv.tv_sec = 0;
+	tv.tv_usec = (rate && sent < total && out.len < CHUNK) ? 1000 : 100000;
+	if (select(maxfd, &readers, &writers, NULL, &tv) < 0) {
+	    if (errno == EINTR) continue;
+	    fail("select: %s", strerror(errno));
+	}
+
+	if (FD_ISSET(fd, &readers)) {
+	    if ((len = recv(fd, buf, sizeof(buf), 0)) > 0) {
+		receive(buf, len);
+		t_last = now();
+	    } else if (len == 0 || errno != EAGAIN) {
+		fail("tf disconnected", NULL);
+	    }
+	}
+	if (FD_ISSET(fd, &writers)) {
+	    if ((len = send(fd, out.data, out.len, 0)) > 0) {
+		bufdrop(&out, len);
+		t_last = now();
+	    } else if (len < 0 && errno != EAGAIN) {
+		fail("send: %s", strerror(errno));
+	    }
+	}
+	if (now() - t_last > TIMEOUT)
+	    fail("tf stopped responding", NULL);
+    }
+    t_end = now();
+
+    close(fd);	/* tf quits on DISCONNECT */
+    waitpid(tfpid, &status, 0);
+    tfpid = -1;
+    cleanup();
+
+    printf("%ld lines in %.3f s%s%s\n", total, t_end - t_start,
+	mccp > 0 ? ", MCCP" : "", rate ? "" : ", unthrottled");
+    printf("  lines/sec  %10.0f\n", total / (t_end - t_start));
+    printf("  cpu/line   %10.2f us (tf cpu %.3f s)\n",
+	(cpu_end - cpu_start) * 1e6 / total, cpu_end - cpu_start);
+    if (nechoes) {
+	qsort(latency, nechoes, sizeof(double), cmpdouble);
+	printf("  latency    %10.3f ms p50, %.3f ms p90, %.3f ms p99, "
+	    "%.3f ms max (%ld probes)\n", percentile(50), percentile(90),
+	    percentile(99), latency[nechoes - 1] * 1e3, nechoes);
+    }
+    return 0;
+}
@@ -84,6 +84,7 @@ defopcode(JRNZ     ,'1', JUMP, INT,  NEG)   /* jump if user_result != 0 */
 /*defopcode(JEMPTY   ,'2', JUMP, INT,  0)*/ /* jump if empty string */
 defopcode(JNEMPTY  ,'2', JUMP, INT,  NEG)   /* jump if not empty string */
 defopcode(JUMP     ,'3', JUMP, INT,  0)
+defopcode(CMPJUMP  ,'4', JUMP, VALP, 0)     /* xop for {PUSH; cmp; JZ} */
 
 /* control operators.  Flag: negate result. */
 /* STRP defaults to buffer. */
@@ -107,6 +108,7 @@ defopcode(DUP      ,'n', CTRL, INT,  0)
 defopcode(RETURN   ,'o', CTRL, VALP, 0)
 defopcode(RESULT   ,'p', CTRL, VALP, 0)
 defopcode(TEST     ,'q', CTRL, VALP, 0)
+defopcode(APPENDS  ,'r', CTRL, NONE, 0)     /* xop for a run of appends */
 defopcode(DONE     ,'s', CTRL, NONE, 0)
 defopcode(ENDIF    ,'t', CTRL, NONE, 0)
 defopcode(PIPE     ,'u', CTRL, NONE, 0)     /* pipe from this stmt to next */
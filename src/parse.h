@@ -71,6 +71,7 @@ typedef union InstructionArg {
 
 typedef struct Instruction {
     opcode_t op;
+    opcode_t xop;		/* op to run when not tracing; see prog_fuse() */
     union InstructionArg arg;
     const char *start, *end;	/* start/end points in source code, for mecho */
     int comefroms;		/* number of insts that jump to this one */
@@ -85,8 +86,21 @@ struct Program {
     int size;		/* size of code array */
     const char *mark;	/* pointer into source code, for mecho */
     int optimize;	/* opimization level */
+    int ndeps;		/* # of global vars read by expr; -1 if uncacheable */
+    struct ProgDep *deps;	/* global vars read by expr */
+    Value *cache;	/* value of expr, valid while deps are unchanged */
+    unsigned int cachegen;	/* var_gen when cache was set */
+    int nslots;		/* number of /let locals given slots */
+    int links;		/* holders; freed by prog_free() when last lets go */
 };
 
+/* A global variable read by a cacheable expression */
+typedef struct ProgDep {
+    const Value *id;	/* TYPE_ID operand naming the variable */
+    Var *var;		/* the variable, when cache was set */
+    unsigned int version;	/* var->version when cache was set */
+} ProgDep;
+
 typedef struct Arg {
     int start, end;
 } Arg;
@@ -100,6 +114,7 @@ extern int         exprsub(Program *prog, int in_expr);
 extern int         dollarsub(Program *prog, String **destp);
 extern conString  *valstr(Value *val);
 extern const char *valstd(Value *val);
+extern String     *valcat(String *dest, Value *val);
 extern long        valint(const Value *val);
 extern int         valtime(struct timeval *tv, const Value *val);
 extern int         valbool(const Value *val);
@@ -111,8 +126,10 @@ extern int         pushval(Value *val);
 extern void        freeval_fl(Value *val, const char *file, int line);
 extern Value      *expr_value(const char *expression);
 extern Value      *expr_value_safe(Program *prog);
+extern void        prog_find_deps(Program *prog);
 extern void        code_add(Program *prog, opcode_t op, ...);
 extern int         reduce(opcode_t op, int n);
+extern int         func_is_pure(const Value *val);
 extern const char *oplabel(opcode_t op);
 
 extern struct Value *newptr_fl(void *ptr, const char *file, int line);
@@ -9,7 +9,7 @@ static const char RCSid[] = "$Id: pattern.c,v 35004.4 2007/01/13 23:12:39 kkeys
 
 
 /*
- * Regexp wrappers and glob pattern matching.
+ * Regexp wrappers and pattern matching.  Globs are matched in glob.c.
  */
 
 #include "tfconfig.h"
@@ -28,8 +28,11 @@ static const char RCSid[] = "$Id: pattern.c,v 35004.4 2007/01/13 23:12:39 kkeys
 
 static RegInfo *reginfo = NULL;
 static const unsigned char *re_tables = NULL;
+static pcre2_compile_context *re_ccontext = NULL;
+static pcre2_match_context *re_mcontext = NULL;	/* for JIT matches */
+static pcre2_jit_stack *re_jitstack = NULL;	/* shared by all JIT matches */
 
-static const char *cmatch(const char *pat, int ch);
+static const char *skip_re_class(const char *p);
 static RegInfo *tf_reg_compile_fl(const char *pattern, int optimize,
     const char *file, int line);
 
@@ -39,7 +42,9 @@ static RegInfo *tf_reg_compile_fl(const char *pattern, int optimize,
 
 void reset_pattern_locale(void)
 {
-    re_tables = pcre_maketables();
+    re_tables = pcre2_maketables(NULL);
+    if (!re_ccontext) re_ccontext = pcre2_compile_context_create(NULL);
+    if (re_ccontext) pcre2_set_character_tables(re_ccontext, re_tables);
 }
 
 int regmatch_in_scope(Value *val, const char *pattern, String *str)
@@ -91,12 +96,12 @@ int regsubstr(String *dest, int n)
     int idx;
     idx = (n < 0) ? 0 : n * 2;
 
-    if (!(reginfo && reginfo->Str && n < reginfo->ovecsize/3 && reginfo->re &&
-	reginfo->ovector[idx] >= 0))
+    if (!(reginfo && reginfo->Str && n < reginfo->ovecsize && reginfo->re &&
+	reginfo->ovector[idx] != PCRE2_UNSET))
     {
         return -1;
     }
-    if (n < -2 || reginfo->ovector[idx+1] < 0) {
+    if (n < -2 || reginfo->ovector[idx+1] == PCRE2_UNSET) {
         internal_error(__FILE__, __LINE__, "invalid subexp %d", n);
         return -1;
     }
@@ -117,16 +122,21 @@ static RegInfo *tf_reg_compile_fl(const char *pattern, int optimize,
     const char *file, int line)
 {
     RegInfo *ri;
-    const char *emsg, *s;
-    int eoffset, n;
-    /* PCRE_DOTALL optimizes patterns starting with ".*" */
-    int options = PCRE_DOLLAR_ENDONLY | PCRE_DOTALL | PCRE_CASELESS;
+    const char *s;
+    PCRE2_UCHAR emsg[128];
+    PCRE2_SIZE eoffset;
+    int ecode;
+    uint32_t n;
+    /* PCRE2_DOTALL optimizes patterns starting with ".*" */
+    uint32_t options = PCRE2_DOLLAR_ENDONLY | PCRE2_DOTALL | PCRE2_CASELESS;
 
     ri = dmalloc(NULL, sizeof(RegInfo), file, line);
     if (!ri) return NULL;
-    ri->extra = NULL;
+    ri->re = NULL;
+    ri->md = NULL;
     ri->ovector = NULL;
     ri->Str = NULL;
+    ri->jit = 0;
     ri->links = 1;
 
     if (warn_curly_re && (s = estrchr(pattern, '{', '\\')) &&
@@ -139,29 +149,36 @@ static RegInfo *tf_reg_compile_fl(const char *pattern, int optimize,
 	if (*s == '\\') {
 	    if (s[1]) s++;
 	} else if (is_upper(*s)) {
-	    options &= ~PCRE_CASELESS;
+	    options &= ~PCRE2_CASELESS;
 	    break;
 	}
     }
 
-    ri->re = pcre_compile((char*)pattern, options, &emsg, &eoffset, re_tables);
+    ri->re = pcre2_compile((PCRE2_SPTR)pattern, PCRE2_ZERO_TERMINATED, options,
+	&ecode, &eoffset, re_ccontext);
     if (!ri->re) {
-	/* don't trust emsg to be non-NULL or NUL-terminated */
-	eprintf("regexp error: character %d: %.128s", eoffset,
-	    emsg ? emsg : "unknown error");
+	if (pcre2_get_error_message(ecode, emsg, sizeof(emsg)) < 0)
+	    strcpy((char*)emsg, "unknown error");
+	eprintf("regexp error: character %d: %s", (int)eoffset, (char*)emsg);
 	goto tf_reg_compile_error;
     }
-    pcre_fullinfo(ri->re, NULL, PCRE_INFO_CAPTURECOUNT, &n);
-    if (n < 0) goto tf_reg_compile_error;
-    ri->ovecsize = 3 * (n + 1);
-    ri->ovector = dmalloc(NULL, sizeof(int) * ri->ovecsize, file, line);
-    if (!ri->ovector) goto tf_reg_compile_error;
-    if (optimize) {
-	ri->extra = pcre_study(ri->re, 0, &emsg);
-	if (emsg) {
-	    eprintf("regexp study error: %.128s", emsg);
-	    goto tf_reg_compile_error;
+    if (pcre2_pattern_info(ri->re, PCRE2_INFO_CAPTURECOUNT, &n) < 0)
+	goto tf_reg_compile_error;
+    ri->ovecsize = n + 1;
+    ri->md = pcre2_match_data_create(ri->ovecsize, NULL);
+    if (!ri->md) goto tf_reg_compile_error;
+    ri->ovector = pcre2_get_ovector_pointer(ri->md);
+    /* Patterns that will be matched repeatedly (triggers, hooks, saved
+     * regmatch() patterns) are JIT compiled.  If JIT is unavailable or
+     * fails, pcre2_match() falls back to the interpreter. */
+    if (optimize && pcre2_jit_compile(ri->re, PCRE2_JIT_COMPLETE) == 0) {
+	if (!re_mcontext) {
+	    re_mcontext = pcre2_match_context_create(NULL);
+	    re_jitstack = pcre2_jit_stack_create(32*1024, 512*1024, NULL);
+	    if (re_mcontext && re_jitstack)
+		pcre2_jit_stack_assign(re_mcontext, NULL, re_jitstack);
 	}
+	ri->jit = !!re_mcontext;
     }
     return ri;
 
@@ -177,10 +194,11 @@ int tf_reg_exec(RegInfo *ri,
 {
     int result, len;
 
-    /* If ovector was stolen by find_and_run_matches(), make a new one. */
-    if (!ri->ovector) {
-	ri->ovector = MALLOC(sizeof(int) * ri->ovecsize);
-	if (!ri->ovector) return 0;
+    /* If md was stolen by find_and_run_matches(), make a new one. */
+    if (!ri->md) {
+	ri->md = pcre2_match_data_create(ri->ovecsize, NULL);
+	if (!ri->md) return 0;
+	ri->ovector = pcre2_get_ovector_pointer(ri->md);
     }
 
     /* Free old saved Str. */
@@ -195,23 +213,48 @@ int tf_reg_exec(RegInfo *ri,
     } else {
 	len = strlen(str);
     }
-    result = pcre_exec(ri->re, ri->extra, str, len, startoffset,
-	startoffset ? PCRE_NOTBOL : 0, ri->ovector, ri->ovecsize);
+    if (ri->jit) {
+	/* skips pcre2_match()'s argument checks and JIT dispatch */
+	result = pcre2_jit_match(ri->re, (PCRE2_SPTR)str, len, startoffset,
+	    startoffset ? PCRE2_NOTBOL : 0, ri->md, re_mcontext);
+    } else {
+	result = pcre2_match(ri->re, (PCRE2_SPTR)str, len, startoffset,
+	    startoffset ? PCRE2_NOTBOL : 0, ri->md, NULL);
+    }
     if (result < 0) {
 	result = 0;
     } else {
-	if (result == 0) result = 1; /* shouldn't happen, with ovector */
+	if (result == 0) result = 1; /* shouldn't happen, with md */
 	if (Sstr) (ri->Str = Sstr)->links++;	/* save, for regsubstr() */
     }
     return result;
 }
 
+/* Like tf_reg_exec(), but puts the results in <md> instead of ri->md and
+ * does not save <str> for regsubstr(); for callers that only want to know
+ * where the matches are.  <md> should have room for ri->ovecsize pairs.
+ */
+int tf_reg_exec_into(const RegInfo *ri, const char *str, int len,
+    int startoffset, pcre2_match_data *md)
+{
+    int result;
+
+    if (ri->jit) {
+	result = pcre2_jit_match(ri->re, (PCRE2_SPTR)str, len, startoffset,
+	    startoffset ? PCRE2_NOTBOL : 0, md, re_mcontext);
+    } else {
+	result = pcre2_match(ri->re, (PCRE2_SPTR)str, len, startoffset,
+	    startoffset ? PCRE2_NOTBOL : 0, md, NULL);
+    }
+    if (result < 0) return 0;
+    return result ? result : 1;
+}
+
 void tf_reg_free(RegInfo *ri)
 {
     if (--ri->links > 0) return;
-    if (ri->ovector) FREE(ri->ovector);
-    if (ri->re) pcre_free(ri->re);
-    if (ri->extra) pcre_free(ri->extra);
+    if (ri->md) pcre2_match_data_free(ri->md);
+    if (ri->re) pcre2_code_free(ri->re);
     if (ri->Str) conStringfree(ri->Str);
     FREE(ri);
 }
@@ -228,6 +271,7 @@ int init_pattern(Pattern *pat, const char *str, int mflag)
 int init_pattern_str(Pattern *pat, const char *str)
 {
     pat->ri = NULL;
+    pat->gp = NULL;
     pat->mflag = -1;
     pat->str = (!str) ? NULL : STRDUP(str);
     return 1;
@@ -242,7 +286,10 @@ int init_pattern_mflag(Pattern *pat, int mflag, int opt)
     pat->mflag = mflag;
     switch (mflag) {
     case MATCH_GLOB:
-        if (smatch_check(pat->str)) goto ok;
+        if (smatch_check(pat->str)) {
+	    pat->gp = glob_compile(pat->str);
+	    goto ok;
+	}
 	break;
     case MATCH_REGEXP:
 #if 0
@@ -269,8 +316,10 @@ void free_pattern(Pattern *pat)
 {
     if (pat->str) FREE(pat->str);
     if (pat->ri) tf_reg_free(pat->ri);
+    if (pat->gp) glob_free(pat->gp);
     pat->str = NULL;
     pat->ri  = NULL;
+    pat->gp  = NULL;
 }
 
 int patmatch(
@@ -284,7 +333,7 @@ int patmatch(
     switch (pat->mflag) {
     /* Even a blank regexp must be exec'd, so Pn will work. */
     case MATCH_REGEXP: return !!tf_reg_exec(pat->ri, Sstr, str, 0);
-    case MATCH_GLOB:   return !smatch(pat->str, str);
+    case MATCH_GLOB:   return glob_exec(pat->gp, str);
     case MATCH_SIMPLE: return !strcmp(pat->str, str);
     case MATCH_SUBSTR: return !!strstr(str, pat->str);
     default: eprintf("internal error: pat->mflag == %d", pat->mflag);
@@ -293,180 +342,205 @@ int patmatch(
     return 0;
 }
 
-/* class is a pointer to a string of the form "[...]..."
- * ch is compared against the character class described by class.
- * If ch matches, cmatch() returns a pointer to the char after ']' in class;
- * otherwise, cmatch() returns NULL.
- */
-static const char *cmatch(const char *class, int ch)
+/* State for collecting runs of literal characters in pattern_literal(). */
+typedef struct LitRun {
+    char *best;		/* longest complete run so far */
+    int bestlen;
+    char *cur;		/* run being collected */
+    int len;
+    int size;		/* size of best and cur */
+    int lastlit;	/* last thing added to cur was a literal char */
+} LitRun;
+
+static void litrun_end(LitRun *run)
 {
-    int not;
-
-    ch = lcase(ch);
-    if ((not = (*++class == '^'))) ++class;
-
-    while (1) {
-        if (*class == ']') return (char*)(not ? class + 1 : NULL);
-        if (*class == '\\') ++class;
-        if (class[1] == '-' && class[2] != ']') {
-            char lo = *class;
-            class += 2;
-            if (*class == '\\') ++class;
-            if (ch >= lcase(lo) && ch <= lcase(*class)) break;
-        } else if (lcase(*class) == ch) break;
-        ++class;
+    if (run->len > run->bestlen) {
+	memcpy(run->best, run->cur, run->len);
+	run->bestlen = run->len;
     }
-    return not ? NULL : (estrchr(++class, ']', '\\') + 1);
+    run->len = 0;
+    run->lastlit = FALSE;
 }
 
-/* smatch_check() should be used on pat to check pattern syntax before
- * calling smatch().
- */
-/* Based on code by Leo Plotkin. */
+static void litrun_add(LitRun *run, int ch)
+{
+    /* A long run is split; each piece is still required. */
+    if (run->len == run->size - 1)
+	litrun_end(run);
+    run->cur[run->len++] = ch;
+    run->lastlit = TRUE;
+}
 
-int smatch(const char *pat, const char *str)
+/* Skip a regexp character class starting at p, which points to '['. */
+static const char *skip_re_class(const char *p)
 {
-    const char *start = str;
-    static int inword = FALSE;
-
-    while (*pat) {
-        switch (*pat) {
-
-        case '\\':
-            pat++;
-            if (lcase(*pat++) != lcase(*str++)) return 1;
-            break;
-
-        case '?':
-            if (!*str || (inword && is_space(*str))) return 1;
-            str++;
-            pat++;
-            break;
-
-        case '*':
-            while (*pat == '*' || *pat == '?') {
-                if (*pat == '?') {
-                    if (!*str || (inword && is_space(*str))) return 1;
-                    str++;
-                }
-                pat++;
-            }
-            if (inword) {
-                while (*str && !is_space(*str))
-                    if (!smatch(pat, str++)) return 0;
-                return smatch(pat, str);
-            } else if (!*pat) {
-                return 0;
-            } else if (*pat == '{') {
-                if (str == start || is_space(str[-1]))
-                    if (!smatch(pat, str)) return 0;
-                for ( ; *str; str++)
-                    if (is_space(*str) && !smatch(pat, str+1)) return 0;
-                return 1;
-            } else if (*pat == '[') {
-                while (*str) if (!smatch(pat, str++)) return 0;
-                return 1;
-            } else {
-                char c = (pat[0] == '\\' && pat[1]) ? pat[1] : pat[0];
-                for (c = lcase(c); *str; str++)
-                    if (lcase(*str) == c && !smatch(pat, str))
-                        return 0;
-                return 1;
-            }
-
-        case '[':
-            if (inword && is_space(*str)) return 1;
-            if (!(pat = cmatch(pat, *str++))) return 1;
-            break;
-
-        case '{':
-            if (str != start && !is_space(*(str - 1))) return 1;
-            {
-                const char *end;
-                int result = 1;
-
-                /* This can't happen if smatch_check is used first. */
-                if (!(end = estrchr(pat, '}', '\\'))) {
-                    eprintf("smatch: unmatched '{'");
-                    return 1;
-                }
-
-                inword = TRUE;
-                for (pat++; pat <= end; pat++) {
-                    if ((result = smatch(pat, str)) == 0) break;
-                    if (!(pat = estrchr(pat, '|', '\\'))) break;
-                }
-                inword = FALSE;
-                if (result) return result;
-                pat = end + 1;
-                while (*str && !is_space(*str)) str++;
-            }
-            break;
-
-        case '}': case '|':
-            if (inword) return (*str && !is_space(*str));
-            /* else FALL THROUGH to default case */
-
-        default:
-            if (lcase(*pat++) != lcase(*str++)) return 1;
-            break;
-        }
+    const char *end;
+
+    if (*++p == '^') p++;
+    if (*p == ']') p++;
+    while (*p && *p != ']') {
+	if (*p == '\\' && p[1]) {
+	    p += 2;
+	} else if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+	    char term[3];
+	    term[0] = p[1];  term[1] = ']';  term[2] = '\0';
+	    p = (end = strstr(p + 2, term)) ? end + 2 : p + 1;
+	} else {
+	    p++;
+	}
     }
-    return lcase(*pat) - lcase(*str);
+    return *p ? p + 1 : p;
 }
 
-/* verify syntax of smatch pattern */
-int smatch_check(const char *pat)
+/* Collect the literal runs of a regexp.  Gives up (leaving nothing) on
+ * anything it does not fully understand: top level alternation, options
+ * like (?x), and escapes other than punctuation and simple classes.
+ */
+static void regexp_literal(const char *p, LitRun *run)
 {
-    int inword = FALSE;
-    const char *patstart = pat;
-
-    while (*pat) {
-        switch (*pat) {
-        case '\\':
-            if (*++pat) pat++;
-            break;
-        case '[':
-            if (!(pat = estrchr(pat, ']', '\\'))) {
-                eprintf("glob error: unmatched '['");
-                return 0;
-            }
-            pat++;
-            break;
-        case '{':
-            if (inword) {
-                eprintf("glob error: nested '{'");
-                return 0;
-            }
-	    if (!(pat==patstart || is_space(pat[-1]) || strchr("*?]", pat[-1])))
-	    {
-                eprintf("glob error: '%c' before '{' can never match", pat[-1]);
-		return 0;
+    const char *start = p, *q;
+    int depth = 0;
+
+    /* first pass: check for things that make literals unreliable */
+    while (*p) {
+	if (*p == '\\') {
+	    if (is_alnum(p[1]) && !strchr("dDsSwWbBAZzGhHvVRXKnrtefa", p[1]))
+		return;
+	    if (p[1]) p++;
+	    p++;
+	} else if (*p == '[') {
+	    p = skip_re_class(p);
+	} else {
+	    if (*p == '(') {
+		if (p[1] == '?') return;
+		depth++;
+	    } else if (*p == ')') {
+		depth--;
+	    } else if (*p == '|' && depth == 0) {
+		return;
 	    }
-            inword = TRUE;
-            pat++;
-            break;
-        case '}':
-	    if (!(!pat[1] || is_space(pat[1]) || strchr("*?[", pat[1]))) {
-                eprintf("glob error: '%c' after '}' can never match", pat[1]);
-		return 0;
+	    p++;
+	}
+    }
+
+    for (p = start, depth = 0; *p; ) {
+	if (depth > 0) {
+	    if (*p == '\\' && p[1]) p++;
+	    else if (*p == '[') { p = skip_re_class(p); continue; }
+	    else if (*p == '(') depth++;
+	    else if (*p == ')') depth--;
+	    p++;
+	    continue;
+	}
+	switch (*p) {
+	case '\\':
+	    if (!is_alnum(p[1]) && p[1]) {
+		litrun_add(run, p[1]);
+	    } else {
+		litrun_end(run);
+		if (!p[1]) return;
+	    }
+	    p += 2;
+	    break;
+	case '[':
+	    litrun_end(run);
+	    p = skip_re_class(p);
+	    break;
+	case '(':
+	    litrun_end(run);
+	    depth++;
+	    p++;
+	    break;
+	case '{':
+	    /* '{' is literal unless it starts a quantifier */
+	    q = p + 1 + strspn(p + 1, "0123456789,");
+	    if (!is_digit(p[1]) || *q != '}') {
+		litrun_add(run, *p++);
+		break;
 	    }
-            inword = FALSE;
-            pat++;
-            break;
-        case '?':
-        case '*':
-        default:
-	    if (inword && is_space(*pat)) {
-                eprintf("glob error: space inside '{...}' can never match");
-		return 0;
+	    p = q;
+	    /* FALL THROUGH */
+	case '*': case '?':
+	    /* the preceding char may occur zero times */
+	    if (run->lastlit) run->len--;
+	    litrun_end(run);
+	    p++;
+	    break;
+	case '+': case '.': case '^': case '$': case ')':
+	    litrun_end(run);
+	    p++;
+	    break;
+	default:
+	    litrun_add(run, *p++);
+	    break;
+	}
+    }
+}
+
+/* Collect the literal runs of a glob pattern. */
+static void glob_literal(const char *p, LitRun *run)
+{
+    const char *end;
+
+    while (*p) {
+	switch (*p) {
+	case '\\':
+	    if (p[1]) {
+		litrun_add(run, p[1]);
+		p += 2;
+	    } else {
+		litrun_end(run);
+		p++;
 	    }
-            pat++;
-            break;
-        }
+	    break;
+	case '*': case '?':
+	    litrun_end(run);
+	    p++;
+	    break;
+	case '[': case '{':
+	    litrun_end(run);
+	    end = estrchr(p, *p == '[' ? ']' : '}', '\\');
+	    p = end ? end + 1 : p + strlen(p);
+	    break;
+	default:
+	    litrun_add(run, *p++);
+	    break;
+	}
+    }
+}
+
+/* Put in <buf> (of <size> bytes) a string that must occur, ignoring case, in
+ * any string that matches <pat>, and return its length.  The string is the
+ * longest one found, up to <size>-1 chars, or empty if there is none.  This
+ * lets callers skip patmatch() for strings that can not match.
+ */
+int pattern_literal(const Pattern *pat, char *buf, int size)
+{
+    LitRun run;
+    const char *s;
+
+    *buf = '\0';
+    if (!pat->str || size < 2) return 0;
+    run.best = buf;
+    run.bestlen = 0;
+    run.cur = XMALLOC(size);
+    run.len = 0;
+    run.size = size;
+    run.lastlit = FALSE;
+
+    switch (pat->mflag) {
+    case MATCH_REGEXP: regexp_literal(pat->str, &run);  break;
+    case MATCH_GLOB:   glob_literal(pat->str, &run);  break;
+    case MATCH_SIMPLE:
+    case MATCH_SUBSTR:
+	for (s = pat->str; *s; s++)
+	    litrun_add(&run, *s);
+	break;
     }
-    if (inword) eprintf("glob error: unmatched '{'");
-    return !inword;
+    litrun_end(&run);
+    FREE(run.cur);
+    buf[run.bestlen] = '\0';
+    return run.bestlen;
 }
 
 #if USE_DMALLOC
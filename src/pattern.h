@@ -10,20 +10,25 @@
 #ifndef PATTERN_H
 #define PATTERN_H
 
-#include <pcre.h>
+#define PCRE2_CODE_UNIT_WIDTH 8
+#include <pcre2.h>
 
 typedef struct RegInfo {
-    pcre *re;
-    pcre_extra *extra;
+    pcre2_code *re;
+    pcre2_match_data *md;	/* reused by every tf_reg_exec() */
     conString *Str;
     int links;
-    int *ovector;
-    int ovecsize;
+    int jit;			/* re was JIT compiled */
+    PCRE2_SIZE *ovector;	/* in md; unset pairs are PCRE2_UNSET */
+    int ovecsize;		/* number of pairs in ovector */
 } RegInfo;
 
+typedef struct GlobProg GlobProg;	/* compiled glob; private to glob.c */
+
 struct Pattern {
     char *str;
     RegInfo *ri;
+    GlobProg *gp;
     int mflag;
 };
 
@@ -32,6 +37,8 @@ extern void   restore_reg_scope(RegInfo *old);
 extern int    regmatch_in_scope(Value *val, const char *pattern, String *Str);
 extern int    tf_reg_exec(RegInfo *ri, conString *Sstr, const char *str,
 		int offset);
+extern int    tf_reg_exec_into(const RegInfo *ri, const char *str, int len,
+		int offset, pcre2_match_data *md);
 extern RegInfo*new_reg_scope(RegInfo *ri, String *Str);
 extern void   tf_reg_free(RegInfo *ri);
 extern int    regsubstr(struct String *dest, int n);
@@ -40,9 +47,13 @@ extern int    init_pattern_str(Pattern *pat, const char *str);
 extern int    init_pattern_mflag(Pattern *pat, int mflag, int opt);
 #define copy_pattern(dst, src)  (init_pattern(dst, (src)->str, (src)->mflag))
 extern int    patmatch(const Pattern *pat, conString *Sstr, const char *str);
+extern int    pattern_literal(const Pattern *pat, char *buf, int size);
 extern void   free_pattern(Pattern *pat);
 extern int    smatch(const char *pat, const char *str);
 extern int    smatch_check(const char *s);
+extern GlobProg *glob_compile(const char *pat);
+extern int    glob_exec(const GlobProg *gp, const char *str);
+extern void   glob_free(GlobProg *gp);
 extern void   free_patterns(void);
 
 #endif /* PATTERN_H */
@@ -31,6 +31,8 @@ command.$(O): command.c tfconfig.h tfdefs.h port.h tf.h malloc.h dstring.h \
 dmalloc.$(O): dmalloc.c $(BUILDERS)
 dstring.$(O): dstring.c tfconfig.h tfdefs.h port.h malloc.h tf.h dstring.h \
   globals.h varlist.h enumlist.h hooklist.h signals.h $(BUILDERS)
+evbench.$(O): evbench.c tfconfig.h tfdefs.h port.h tf.h malloc.h dstring.h \
+  globals.h varlist.h enumlist.h hooklist.h util.h tfselect.h $(BUILDERS)
 expand.$(O): expand.c tfconfig.h tfdefs.h port.h tf.h malloc.h dstring.h \
   globals.h varlist.h enumlist.h hooklist.h util.h pattern.h \
   search.h tfio.h macro.h signals.h socket.h keyboard.h \
@@ -40,6 +42,12 @@ expr.$(O): expr.c tfconfig.h tfdefs.h port.h tf.h malloc.h dstring.h \
   search.h tfio.h macro.h signals.h socket.h output.h \
   attr.h keyboard.h parse.h opcodes.h expand.h expr.h cmdlist.h command.h \
   variable.h tty.h history.h world.h funclist.h $(BUILDERS)
+glob.$(O): glob.c tfconfig.h tfdefs.h port.h tf.h malloc.h dstring.h \
+  globals.h varlist.h enumlist.h hooklist.h util.h pattern.h \
+  search.h tfio.h $(BUILDERS)
+globbench.$(O): globbench.c tfconfig.h tfdefs.h port.h tf.h malloc.h \
+  dstring.h globals.h varlist.h enumlist.h hooklist.h util.h pattern.h \
+  search.h tfio.h $(BUILDERS)
 help.$(O): help.c tfconfig.h tfdefs.h port.h tf.h malloc.h dstring.h \
   globals.h varlist.h enumlist.h hooklist.h search.h pattern.h \
   tfio.h cmdlist.h variable.h $(BUILDERS)
@@ -63,6 +71,7 @@ main.$(O): main.c tfconfig.h tfdefs.h port.h tf.h malloc.h dstring.h \
   expand.h expr.h process.h $(BUILDERS)
 makehelp.$(O): makehelp.c $(BUILDERS)
 malloc.$(O): malloc.c tfconfig.h tfdefs.h port.h signals.h malloc.h $(BUILDERS)
+mudbench.$(O): mudbench.c tfconfig.h port.h $(BUILDERS)
 myechod.$(O): myechod.c $(BUILDERS)
 output.$(O): output.c tfconfig.h tfdefs.h port.h tf.h malloc.h dstring.h \
   globals.h varlist.h enumlist.h hooklist.h util.h pattern.h \
@@ -89,13 +98,15 @@ tfio.$(O): tfio.c tfconfig.h tfdefs.h port.h tf.h malloc.h dstring.h \
   globals.h varlist.h enumlist.h hooklist.h util.h pattern.h \
   search.h tfio.h tfselect.h output.h attr.h macro.h \
   history.h signals.h variable.h keyboard.h expand.h cmdlist.h $(BUILDERS)
+tfselect.$(O): tfselect.c tfconfig.h tfdefs.h port.h tf.h malloc.h dstring.h \
+  globals.h varlist.h enumlist.h hooklist.h util.h tfselect.h $(BUILDERS)
 timers.$(O): timers.c tfconfig.h tfdefs.h port.h malloc.h search.h $(BUILDERS)
 tty.$(O): tty.c tfconfig.h tfdefs.h port.h tf.h malloc.h dstring.h globals.h \
   varlist.h enumlist.h hooklist.h util.h search.h tty.h output.h macro.h \
   variable.h $(BUILDERS)
 util.$(O): util.c tfconfig.h tfdefs.h port.h tf.h malloc.h dstring.h \
   globals.h varlist.h enumlist.h hooklist.h util.h pattern.h \
-  search.h tfio.h output.h tty.h signals.h variable.h \
+  search.h tfio.h output.h tty.h signals.h socket.h variable.h \
   parse.h opcodes.h $(BUILDERS)
 variable.$(O): variable.c tfconfig.h tfdefs.h port.h tf.h malloc.h dstring.h \
   globals.h varlist.h enumlist.h hooklist.h util.h pattern.h \
@@ -8,9 +8,9 @@
 static const char RCSid[] = "$Id: search.c,v 35004.32 2007/01/13 23:12:39 kkeys Exp $";
 
 
-/**********************************************
- * trie, hash table, and linked list routines *
- **********************************************/
+/**********************************************************
+ * trie, hash table, linked list, and keyword set routines *
+ **********************************************************/
 
 #include "tfconfig.h"
 #include "port.h"
@@ -18,8 +18,25 @@ static const char RCSid[] = "$Id: search.c,v 35004.32 2007/01/13 23:12:39 kkeys
 #include "search.h"
 
 
+typedef struct Keyword {
+    char *str;			/* folded to lower case; must be first */
+    ListEntry *node;		/* node in KWSet's table */
+    int id;
+    int links;
+} Keyword;
+
+typedef struct KWNode {		/* node of Aho-Corasick automaton */
+    int child, sibling;		/* first child, next sibling */
+    int fail;			/* node for longest proper suffix */
+    int match;			/* nearest node on fail chain that ends a key */
+    int key;			/* id of keyword ending here, or -1 */
+    unsigned char ch;
+} KWNode;
+
 static ListEntry *nodepool = NULL;		/* freelist */
 
+static void kwset_build(KWSet *set);
+
 
 /********/
 /* trie */
@@ -320,6 +337,208 @@ int resize_cqueue(CQueue *cq, int maxsize)
 }
 
 
+/***************/
+/* keyword set */
+/***************/
+
+void init_kwset(KWSet *set)
+{
+    init_hashtable(&set->table, 97, cstrstructcmp);
+    set->key = NULL;
+    set->seen = NULL;
+    set->freeid = NULL;
+    set->nkeys = set->maxkeys = set->nfree = 0;
+    set->nlive = set->ndead = 0;
+    set->node = NULL;
+    set->nnodes = set->maxnodes = 0;
+    set->gen = 0;
+    set->dirty = 1;
+}
+
+/* Add a reference to keyword <str>, which must not be empty, and return
+ * its id.
+ */
+int kwset_add(KWSet *set, const char *str)
+{
+    Keyword *kw;
+    char *folded, *p;
+
+    folded = strcpy(XMALLOC(strlen(str) + 1), str);
+    for (p = folded; *p; p++)
+	*p = lcase(*p);
+
+    if ((kw = hash_find(folded, &set->table))) {
+	FREE(folded);
+	if (kw->links++ == 0) {
+	    set->ndead--;
+	    set->nlive++;
+	}
+	return kw->id;
+    }
+
+    kw = XMALLOC(sizeof(Keyword));
+    kw->str = folded;
+    kw->links = 1;
+    if (set->nfree) {
+	kw->id = set->freeid[--set->nfree];
+    } else {
+	if (set->nkeys == set->maxkeys) {
+	    set->maxkeys = set->maxkeys ? 2 * set->maxkeys : 64;
+	    set->key = XREALLOC(set->key, set->maxkeys * sizeof(Keyword*));
+	    set->seen = XREALLOC(set->seen, set->maxkeys * sizeof(unsigned));
+	    set->freeid = XREALLOC(set->freeid, set->maxkeys * sizeof(int));
+	}
+	kw->id = set->nkeys++;
+    }
+    set->key[kw->id] = kw;
+    set->seen[kw->id] = set->gen - 1;
+    kw->node = hash_insert((void *)kw, &set->table);
+    set->nlive++;
+    set->dirty = 1;
+    return kw->id;
+}
+
+/* Remove a reference to keyword <id>.  An unreferenced keyword stays in the
+ * automaton until the next build, so removing is cheap.
+ */
+void kwset_remove(KWSet *set, int id)
+{
+    if (--set->key[id]->links > 0) return;
+    set->nlive--;
+    set->ndead++;
+}
+
+static int kw_child(const KWSet *set, int n, int ch)
+{
+    for (n = set->node[n].child; n >= 0; n = set->node[n].sibling)
+	if (set->node[n].ch == ch) break;
+    return n;
+}
+
+static int kw_newnode(KWSet *set, int parent, int ch)
+{
+    KWNode *node;
+
+    if (set->nnodes == set->maxnodes) {
+	set->maxnodes = set->maxnodes ? 2 * set->maxnodes : 256;
+	set->node = XREALLOC(set->node, set->maxnodes * sizeof(KWNode));
+    }
+    node = &set->node[set->nnodes];
+    node->child = -1;
+    node->fail = 0;
+    node->match = -1;
+    node->key = -1;
+    node->ch = ch;
+    if (parent >= 0) {
+	node->sibling = set->node[parent].child;
+	set->node[parent].child = set->nnodes;
+    } else {
+	node->sibling = -1;
+    }
+    return set->nnodes++;
+}
+
+/* Free unreferenced keywords, and rebuild the automaton from the rest. */
+static void kwset_build(KWSet *set)
+{
+    Keyword *kw;
+    KWNode *node;
+    const unsigned char *p;
+    int id, n, c, f, x, head, tail, *queue;
+
+    for (id = 0; id < set->nkeys && set->ndead; id++) {
+	if (!(kw = set->key[id]) || kw->links > 0) continue;
+	hash_remove(kw->node, &set->table);
+	FREE(kw->str);
+	FREE(kw);
+	set->key[id] = NULL;
+	set->freeid[set->nfree++] = id;
+	set->ndead--;
+    }
+
+    /* trie of keywords */
+    set->nnodes = 0;
+    kw_newnode(set, -1, 0);
+    for (id = 0; id < set->nkeys; id++) {
+	if (!(kw = set->key[id])) continue;
+	for (n = 0, p = (unsigned char *)kw->str; *p; p++) {
+	    if ((x = kw_child(set, n, *p)) < 0)
+		x = kw_newnode(set, n, *p);
+	    n = x;
+	}
+	set->node[n].key = id;
+    }
+
+    /* breadth first, so fail nodes (which are shallower) are done first */
+    for (c = 0; c < 256; c++)
+	set->root[c] = 0;
+    queue = XMALLOC(set->nnodes * sizeof(int));
+    head = tail = 0;
+    for (n = set->node[0].child; n >= 0; n = set->node[n].sibling) {
+	set->root[set->node[n].ch] = n;
+	queue[tail++] = n;
+    }
+    while (head < tail) {
+	n = queue[head++];
+	for (x = set->node[n].child; x >= 0; x = set->node[x].sibling) {
+	    node = &set->node[x];
+	    c = node->ch;
+	    for (f = set->node[n].fail; f; f = set->node[f].fail)
+		if ((node->fail = kw_child(set, f, c)) >= 0) break;
+	    if (!f) node->fail = set->root[c];
+	    f = node->fail;
+	    node->match = set->node[f].key >= 0 ? f : set->node[f].match;
+	    queue[tail++] = x;
+	}
+    }
+    FREE(queue);
+    set->dirty = 0;
+}
+
+/* Find the keywords in <str>.  Afterwards, kwset_found(set, id) is true for
+ * each keyword id that occurred, until the next scan.
+ */
+void kwset_scan(KWSet *set, const char *str)
+{
+    kwset_ready(set);
+    set->gen++;
+    kwset_scan_into(set, str, set->seen, set->gen);
+}
+
+/* Rebuild the automaton of <set>, if needed, so it can be used by
+ * kwset_scan_into().
+ */
+void kwset_ready(KWSet *set)
+{
+    if (set->dirty || set->ndead > set->nlive + 64)
+	kwset_build(set);
+}
+
+/* Like kwset_scan(), but marks found keywords by setting seen[id] to <gen>
+ * instead of using set->seen, and does not modify <set>; so, after
+ * kwset_ready(), several threads can scan with the same set at once.
+ * <seen> must have room for set->nkeys ids.
+ */
+void kwset_scan_into(const KWSet *set, const char *str, unsigned int *seen,
+    unsigned int gen)
+{
+    const KWNode *node;
+    int n, m, x = 0, c;
+
+    if (!set->nlive) return;
+
+    node = set->node;
+    for (n = 0; *str; str++) {
+	c = lcase(*str);
+	while (n && (x = kw_child(set, n, c)) < 0)
+	    n = node[n].fail;
+	n = n ? x : set->root[c];
+	for (m = node[n].key >= 0 ? n : node[n].match; m > 0; m = node[m].match)
+	    seen[node[m].key] = gen;
+    }
+}
+
+
 #if USE_DMALLOC
 void free_search(void)
 {
@@ -37,6 +37,13 @@
  * [c]strcmp() on any structure whose first field is a string; these are
  * useful with bsearch().
  */
+/*
+ * Keyword Set.
+ * kwset_scan() finds which keywords of a set occur in a string, ignoring
+ * case, in a single pass (Aho-Corasick).  Keywords are reference counted
+ * and identified by small integer ids.  The automaton is rebuilt by
+ * kwset_scan() only when keywords have been added since the last build.
+ */
 
 /* Modulo arithmetic: remainder is positive, even if numerator is negative. */
 #define nmod(n, d)   (((n) >= 0) ? ((n)%(d)) : ((d) - ((-(n)-1)%(d)) - 1))
@@ -92,6 +99,22 @@ typedef struct HashTable {
     List **bucket;
 } HashTable;
 
+typedef struct KWSet {
+    HashTable table;		/* struct Keywords, by string */
+    struct Keyword **key;	/* struct Keywords, by id */
+    unsigned int *seen;		/* generation in which each id was found */
+    int *freeid;		/* stack of unused ids */
+    int nkeys, maxkeys, nfree;	/* ids allocated, ids with room, free ids */
+    int nlive, ndead;		/* keywords in use, unused but not freed */
+    struct KWNode *node;	/* automaton; node 0 is the root */
+    int nnodes, maxnodes;
+    int root[256];		/* transitions from the root */
+    unsigned int gen;		/* incremented by each kwset_scan() */
+    int dirty;			/* keywords added since automaton was built */
+} KWSet;
+
+#define kwset_found(set, id)	((set)->seen[id] == (set)->gen)
+
 typedef struct CQueue {		/* circular queue of data */
     void **data;		/* array of pointers to data */
     void (*free)(void*, const char*, int);	/* function to free a datum */
@@ -138,6 +161,14 @@ extern int intrie(TrieNode **root, void *datum,
 extern TrieNode *untrie(TrieNode **root, const unsigned char *s);
 extern void *trie_find(TrieNode *root, const unsigned char *key);
 
+extern void init_kwset(KWSet *set);
+extern int  kwset_add(KWSet *set, const char *str);
+extern void kwset_remove(KWSet *set, int id);
+extern void kwset_scan(KWSet *set, const char *str);
+extern void kwset_ready(KWSet *set);
+extern void kwset_scan_into(const KWSet *set, const char *str,
+    unsigned int *seen, unsigned int gen);
+
 struct CQueue *init_cqueue(CQueue *cq, int maxsize,
     void (*free_f)(void *, const char *, int));
 void free_cqueue(CQueue *cq);
@@ -27,6 +27,7 @@ static const char RCSid[] = "$Id: socket.c,v 35004.288 2007/01/13 23:12:39 kkeys
 #include <fcntl.h>
 #include <sys/file.h>	/* for FNONBLOCK on SVR4, hpux, ... */
 #include <sys/socket.h>
+#include <sys/uio.h>	/* writev() */
 #include <signal.h>	/* for killing resolver child process */
 
 #if HAVE_SSL
@@ -100,6 +101,13 @@ struct sockaddr_in {
 #endif
 
 #ifdef PLATFORM_UNIX
+# if HAVE_PTHREAD_H && HAVE_PTHREAD_CREATE
+#  include <pthread.h>
+#  if HAVE_POLL_H && HAVE_POLL && defined(__ATOMIC_SEQ_CST)
+#   include <poll.h>
+#   define THREADED_RECV
+#  endif
+# endif
 # ifndef __CYGWIN32__
 #  if HAVE_WAITPID
 #   define NONBLOCKING_GETHOST
@@ -114,6 +122,16 @@ struct sockaddr_in {
 # undef HAVE_GETADDRINFO
 #endif
 
+#if defined(PLATFORM_UNIX) && HAVE_PTHREAD_H && HAVE_PTHREAD_CREATE && \
+    HAVE_GETADDRINFO
+  /* Our own tfgetaddrinfo() isn't thread safe, so without the system's
+   * getaddrinfo(), lookups are done in a child process instead. */
+# define THREADED_GETHOST
+# ifndef NONBLOCKING_GETHOST
+#  define NONBLOCKING_GETHOST
+# endif
+#endif
+
 #define TF_EAI_ADDRFAMILY  -1 /* address family for hostname not supported */
 #define TF_EAI_AGAIN       -2 /* temporary failure in name resolution */
 #define TF_EAI_BADFLAGS    -3 /* invalid value for ai_flags */
@@ -191,9 +209,6 @@ static const char *h_errlist[] = {
 #endif /* !HAVE_GETADDRINFO */
 
 #ifdef NONBLOCKING_GETHOST
-# ifndef PLATFORM_OS2
-#  include <sys/uio.h> /* child uses writev() */
-# endif
   static void waitforhostname(int fd, const char *name, const char *port);
   static int nonblocking_gethost(const char *name, const char *port,
       struct addrinfo **addrs, pid_t *pidp, const char **what);
@@ -284,11 +299,63 @@ typedef enum {
 
 VEC_TYPEDEF(telnet_opts, 256);
 
+typedef struct Attempt {	/* connection attempt racing Sock.fd */
+    int fd;			/* socket */
+    struct addrinfo *addr;	/* address it is connecting to */
+} Attempt;
+
+#ifdef THREADED_RECV
+/* Receive ring, filled by a thread that reads the socket (see
+ * start_recv_thread()).  It has a single producer and a single consumer:
+ * head is written only by the thread, and tail only by the main thread.
+ */
+typedef struct RecvRing {
+    char *buf;			/* RECV_RING bytes */
+    unsigned long head;		/* total bytes received (thread) */
+    unsigned long tail;		/* total bytes consumed (main thread) */
+    int fd;			/* socket */
+    int wake[2];		/* pipe from thread to main loop */
+    int signalled;		/* wake pipe has been written */
+    int full;			/* thread is waiting for room */
+    int stop;			/* main thread wants thread to exit */
+    int done;			/* thread has exited */
+    int err;			/* errno of failed recv(), or 0 for EOF */
+    pthread_t tid;
+    pthread_mutex_t lock;	/* only for waiting on room */
+    pthread_cond_t room;
+} RecvRing;
+
+/* descriptor that main_loop() watches for input from sock */
+# define input_fd(sock)	((sock)->ring ? (sock)->ring->wake[0] : (sock)->fd)
+#else
+# define input_fd(sock)	((sock)->fd)
+#endif
+
+#define LATENCY_BUCKETS	24	/* last bucket is >= 2^23 usec (8.4s) */
+
+typedef struct SockStats {	/* counters for /listsockets -v, sockstat() */
+    unsigned long rawbytes;	/* bytes received from network */
+    unsigned long bytes;	/* bytes received, after MCCP inflation */
+    unsigned long lines;	/* lines received, not counting prompts */
+    unsigned long prompts;	/* prompts received */
+    unsigned long telnet;	/* telnet commands received */
+    int queued;			/* lines now in queue */
+    int queuepeak;		/* most lines ever in queue */
+    struct timeval trigtime;	/* time spent in triggers on received lines */
+    unsigned long memolookups;	/* lines looked up in trigger memo */
+    unsigned long memohits;	/* lines whose trigger results were known */
+    unsigned long latency[LATENCY_BUCKETS]; /* # of lines whose time from
+				 * receive to display was 2^i to 2^(i+1) usec */
+} SockStats;
+
 typedef struct Sock {		/* an open connection to a server */
     int fd;			/* socket to server, or pipe to name resolver */
     const char *host, *port;	/* server address, human readable */
     struct addrinfo *addrs;	/* possible server addresses */
     struct addrinfo *addr;	/* actual server address */
+    Attempt *attempts;		/* older connection attempts still pending */
+    int nattempts;		/* number of attempts */
+    struct timeval next_attempt; /* when to start connecting to next addr */
     const char *myhost;		/* explicit client address, human readable */
     struct addrinfo *myaddr;	/* explicit client address */
     telnet_opts tn_us;		/* our telnet options */
@@ -301,8 +368,16 @@ typedef struct Sock {		/* an open connection to a server */
     struct World *world;	/* world to which socket is connected */
     struct Sock *next, *prev;	/* next/prev sockets in linked list */
     Stringp buffer;		/* buffer for incoming characters */
+    char *rbuf;			/* raw receive buffer */
+    int rbufsize;		/* allocated size of rbuf */
+    int rbufsmall;		/* # of consecutive small reads into rbuf */
     Stringp subbuffer;		/* buffer for incoming characters */
     Queue queue;		/* queue of incoming lines */
+    Queue outq;			/* queue of outgoing text chunks */
+    int outqoff;		/* # of bytes of oldest outq chunk already sent */
+    long outqlen;		/* # of bytes in outq not yet sent */
+    long outqpeak;		/* high-water mark of outqlen after a write */
+    char outqwarned;		/* BACKLOG hook called since outq was empty? */
     conString *prompt;		/* prompt from server */
     struct timeval prompt_timeout; /* when does unterm'd line become a prompt */
     int ttype;			/* index into enum_ttype[] */
@@ -315,10 +390,15 @@ typedef struct Sock {		/* an open connection to a server */
     pid_t pid;			/* OS pid of name resolution process */
 #if HAVE_MCCP
     z_stream *zstream;		/* state of compressed stream */
+    char *zbuf;			/* inflated data (same size as rbuf) */
 #endif
 #if HAVE_SSL
     SSL *ssl;			/* SSL state */
 #endif
+#ifdef THREADED_RECV
+    RecvRing *ring;		/* receiving thread, if any */
+#endif
+    SockStats stat;		/* traffic counters */
 } Sock;
 
 typedef struct {
@@ -334,9 +414,23 @@ static int   get_host_address(Sock *sock, const char **what, int *errp);
 static int   tfgetaddrinfo(const char *nodename, const char *port,
 	     const struct addrinfo *hints, struct addrinfo **res);
 #endif
+static struct addrinfo *addr_cache_get(const char *host, const char *port);
+static void  addr_cache_put(const char *host, const char *port,
+	     const struct addrinfo *addrs);
+static void  addr_cache_forget(const char *host, const char *port);
 static int   opensock(World *world, int flags);
 static int   openconn(Sock *new);
 static int   establish(Sock *new);
+static int   connect_result(int fd, struct addrinfo *addr, const char **what);
+static void  schedule_attempt(Sock *sock);
+static void  start_attempts(void);
+static int   check_attempts(void);
+static void  kill_attempts(Sock *sock);
+#ifdef THREADED_RECV
+static void  start_recv_thread(Sock *sock);
+static void  stop_recv_thread(Sock *sock);
+static int   ring_recv(RecvRing *ring, char *buf, int len);
+#endif
 #if 0
 static void  fg_live_sock(void);
 #endif
@@ -347,9 +441,15 @@ static void  handle_implicit_prompt(void);
 static void  unprompt(Sock *sock, int update);
 static void  test_prompt(void);
 static void  schedule_prompt(Sock *sock);
-static void  handle_socket_lines(void);
+static long  sock_budget(Sock *sock, long base);
+static void  handle_socket_lines(long limit);
 static int   handle_socket_input(const char *simbuffer, int simlen);
 static int   transmit(const char *s, unsigned int len);
+static int   flush_output(void);
+static long  write_output(Sock *sock);
+static void  discard_output(Sock *sock);
+static void  note_backlog(void);
+static void  flush_all_output(int all);
 static void  telnet_send(String *cmd);
 static void  telnet_subnegotiation(void);
 static void  f_telnet_recv(int cmd, int opt);
@@ -362,7 +462,7 @@ static void  killsock(Sock *sock);
 
 #define zombiesock(sock)	killsock(sock)
 #define flushxsock() \
-    do { if (xsock->queue.list.head) handle_socket_lines(); } while (0)
+    do { if (xsock->queue.list.head) handle_socket_lines(0); } while (0)
 
 #define telnet_recv(cmd, opt)	f_telnet_recv((UCHAR)cmd, (UCHAR)opt);
 #define no_reply(str) telnet_debug("sent", "[no reply (" str ")", 0)
@@ -375,20 +475,24 @@ static void  killsock(Sock *sock);
 #define PROC_WAIT 100000
 #endif
 
-#define SPAM (4*1024)		/* break loop if this many chars are received */
+#define FG_WEIGHT 4		/* foreground socket's multiplier of its weight */
+#define OUTQ_IOV 64		/* max # of outq chunks per writev() */
+#define OUTQ_EAGER (8*1024)	/* flush outq without waiting for main_loop */
+#define RBUF_MIN (4*1024)	/* initial and minimum size of Sock.rbuf */
+#define RBUF_MAX (256*1024)	/* maximum size of Sock.rbuf */
+#define RBUF_SHRINK 16		/* shrink rbuf after this many small reads */
 
-static fd_set readers;		/* input file descriptors */
-static fd_set active;		/* active file descriptors */
-static fd_set writers;		/* pending connections */
-static fd_set connected;	/* completed connections */
-static unsigned int nfds;	/* max # of readers/writers */
 static Sock *hsock = NULL;	/* head of socket list */
 static Sock *tsock = NULL;	/* tail of socket list */
 static Sock *fsock = NULL;	/* foreground socket */
 static int dead_socks = 0;	/* Number of unnuked dead sockets */
 static int socks_with_lines = 0;/* Number of socks with queued received lines */
+static int socks_with_output = 0;/* Number of socks with queued output */
 static struct timeval prompt_timeout = {0,0};
+static struct timeval attempt_timeout = {0,0}; /* earliest next_attempt */
 static const char *telnet_label[0x100];
+static char plain_char[0x100];	/* chars needing no special input handling */
+static HashTable addr_cache[1];	/* name lookup results, by "host port" */
 STATIC_BUFFER(telbuf);
 
 #define MAXQUIET        25	/* max # of lines to suppress during login */
@@ -576,12 +680,10 @@ void init_sock(void)
 {
     int i;
 
-    FD_ZERO(&readers);
-    FD_ZERO(&active);
-    FD_ZERO(&writers);
-    FD_ZERO(&connected);
-    FD_SET(STDIN_FILENO, &readers);
-    nfds = 1;
+    init_tfselect(NULL);
+    reset_sock_locale();
+    init_hashtable(addr_cache, 31, cstrstructcmp);
+    ev_add(STDIN_FILENO, EV_READ);
 
     set_var_by_id(VAR_async_conn, !!TF_NONBLOCK);
 #ifdef NONBLOCKING_GETHOST
@@ -654,6 +756,7 @@ void main_loop(void)
     static int depth = 0;
     struct timeval tv, *tvp;
     struct timeval refresh_tv;
+    struct timeval slice_end, slice_now;
     STATIC_STRING(low_memory_msg,
 	"% WARNING: memory is low.  Try reducing history sizes.", 0);
 
@@ -671,6 +774,10 @@ void main_loop(void)
         if (proctime.tv_sec && tvcmp(&proctime, &now) <= 0)
 	    runall(0, NULL); /* run timed processes */
 
+        /* race the next address of slow connections */
+        if (attempt_timeout.tv_sec && tvcmp(&attempt_timeout, &now) <= 0)
+	    start_attempts();
+
         if (low_memory_warning) {
             low_memory_warning = 0;
 	    tfputline(low_memory_msg, tferr);
@@ -681,7 +788,7 @@ void main_loop(void)
         /* figure out when next event is so select() can timeout then */
         gettime(&now);
         earliest = proctime;
-#if 1 /* XXX debugging */
+#if DEVELOPMENT
 	{
 	    Sock *s;
 	    int n = 0;
@@ -719,12 +826,23 @@ void main_loop(void)
         if (prompt_timeout.tv_sec > 0) {
 	    set_min_earliest(prompt_timeout);
 	}
+        if (attempt_timeout.tv_sec > 0) {
+	    set_min_earliest(attempt_timeout);
+	}
+
+        /* Send output queued during this loop.  Waiting until now lets
+         * bursts of lines (speedwalks, /repeat, multi-command macros) go
+         * out together in one writev().  Socks already waiting for
+         * writability are flushed when they become writable. */
+        if (socks_with_output)
+            flush_all_output(0);
 
         /* flush pending display_screen output */
         /* must be after all possible output and before select() */
         oflush();
 
-        if (pending_input || pending_line) {
+        if (pending_input || pending_line || socks_with_lines) {
+            /* socks_with_lines: lines left over by the scheduler */
             tvp = &tv;
             tv = tvzero;
         } else if (earliest.tv_sec) {
@@ -772,50 +890,50 @@ void main_loop(void)
 
         /* Wait for next event.
          *   descriptor read:	user input, socket input, or /quote !
-         *   descriptor write:	nonblocking connect()
+         *   descriptor write:	nonblocking connect(), or room for output
          *   timeout:		time for runall() or do_refresh()
-         * Note: if the same descriptor appears in more than one fd_set, some
-         * systems count it only once, some count it once for each occurance.
+         * Count is the number of ready descriptors, not events.
          */
-        active = readers;
-        connected = writers;
-        count = tfselect(nfds, &active, &connected, NULL, tvp);
+        count = tfselect(tvp);
 
         if (count < 0) {
-            /* select() must have exited due to error or interrupt. */
+            /* wait must have exited due to error or interrupt. */
             if (errno != EINTR) core(strerror(errno), __FILE__, __LINE__, 0);
             /* In case we're in a kb tfgetS(), clear things for parent loop. */
-            FD_ZERO(&active);
-            FD_ZERO(&connected);
+            ev_clear_ready();
 	    /* In case the dreaded solaris select bug caused tf to remove stdin
 	     * from readers, user will probably panic and hit ^C, so we add
 	     * stdin back to readers, and recover. */
-	    FD_SET(STDIN_FILENO, &readers);
+	    ev_add(STDIN_FILENO, EV_READ);
 
         } else {
             if (count == 0) {
-                /* select() must have exited due to timeout. */
+                /* wait must have exited due to timeout. */
                 do_refresh();
             }
 
             /* check for user input */
-            if (pending_input || FD_ISSET(STDIN_FILENO, &active)) {
-                if (FD_ISSET(STDIN_FILENO, &active)) count--;
+            if (pending_input || ev_ready(STDIN_FILENO, EV_READ)) {
+                if (ev_ready(STDIN_FILENO, EV_READ)) count--;
                 do_refresh();
-                if (!handle_keyboard_input(FD_ISSET(STDIN_FILENO, &active))) {
+                if (!handle_keyboard_input(ev_ready(STDIN_FILENO, EV_READ))) {
                     /* input is at EOF, stop reading it */
-                    FD_CLR(STDIN_FILENO, &readers);
+                    ev_del(STDIN_FILENO, EV_READ);
                 }
             }
 
             /* Check for socket completion/activity.  We pick up where we
              * left off last time, so sockets near the end of the list aren't
-             * starved.  We stop when we've gone through the list once, or
-             * when we've received a lot of data (so spammy sockets don't
-             * degrade interactive response too much).
+             * starved.  Each socket may receive %sched_bytes and process
+             * %sched_lines lines, times its weight (see sock_budget()), per
+             * visit; whatever is left waits for the next loop.  We stop when
+             * we've gone through the list once, when %sched_slice has been
+             * used up, or when there is keyboard input (so spammy sockets
+             * don't degrade interactive response too much).
              */
             if (hsock) {
-                received = 0;
+                monotime(&slice_end);
+                tvadd(&slice_end, &slice_end, &sched_slice);
                 if (!sock) sock = hsock;
                 stopsock = sock;
 		/* note: count may have been zeroed by nested main_loop */
@@ -823,25 +941,42 @@ void main_loop(void)
 		    prompt_timeout.tv_sec > 0)
 		{
                     xsock = sock;
+                    received = 0;
                     if (sock->constate >= SS_OPEN) {
                         /* do nothing */
-                    } else if (FD_ISSET(xsock->fd, &connected)) {
+                    } else if (xsock->constate < SS_CONNECTED &&
+                        ev_ready(xsock->fd, EV_WRITE))
+                    {
                         count--;
                         establish(xsock);
-                    } else if (FD_ISSET(xsock->fd, &active)) {
+                    } else if (ev_ready(xsock->fd, EV_READ | EV_WRITE) ||
+                        ev_ready(input_fd(xsock), EV_READ))
+                    {
                         count--;
-                        if (xsock->constate == SS_RESOLVING) {
+                        if (ev_ready(xsock->fd, EV_WRITE)) {
+                            /* room for queued output */
+                            flush_output();
+                        }
+                        if (!ev_ready(input_fd(xsock), EV_READ)) {
+                            /* do nothing */
+                        } else if (xsock->constate == SS_RESOLVING) {
                             openconn(xsock);
                         } else if (xsock->constate == SS_CONNECTING) {
                             establish(xsock);
+                        } else if (xsock->queue.list.head) {
+                            /* leave it until its queued lines are done */
                         } else if (xsock == fsock || background) {
                             received += handle_socket_input(NULL, 0);
                         } else {
-                            FD_CLR(xsock->fd, &readers);
+                            ev_del(input_fd(xsock), EV_READ);
                         }
                     }
-		    if (xsock->queue.list.head)
-			handle_socket_lines();
+                    if (xsock->nattempts && xsock->constate == SS_CONNECTING)
+                        count -= check_attempts();
+		    if (xsock->queue.list.head) {
+			handle_socket_lines(sock_budget(xsock, sched_lines));
+			received++;
+		    }
 
 		    /* If there's a partial line that's past prompt_timeout,
 		     * make it a prompt. */
@@ -853,7 +988,16 @@ void main_loop(void)
 		    }
 
                     sock = sock->next ? sock->next : hsock;
-		    if (sock == stopsock || received >= SPAM) break;
+		    if (sock == stopsock) break;
+		    if (received) {
+			monotime(&slice_now);
+			if (tvcmp(&slice_now, &slice_end) >= 0)
+			    break;  /* %sched_slice is used up */
+			tv = tvzero;
+			if (ev_wanted(STDIN_FILENO, EV_READ) &&
+			    ev_wait_fd(STDIN_FILENO, EV_READ, &tv) > 0)
+			    break;  /* keyboard preempts */
+		    }
                 }
 
                 /* fsock and/or xsock may have changed during loop above. */
@@ -899,6 +1043,8 @@ void main_loop(void)
 
     /* end of loop */
     if (!--depth) {
+	/* send whatever was queued before /quit (as much as won't block) */
+	if (socks_with_output) flush_all_output(1);
 	fsock = NULL;
 	xsock = NULL;
         while (hsock) nukesock(hsock);
@@ -907,11 +1053,25 @@ void main_loop(void)
 #endif
     }
 
-    /* If exiting recursive main_loop, count, active, and connected in the
+    /* If exiting recursive main_loop, count and the ready descriptors in the
      * parent main_loop are invalid.  Set count to 0 to indicate that. */
     count = 0;
 }
 
+/* Rebuild the table of chars that handle_socket_input() can copy without
+ * examining individually.  Must be called when the LC_CTYPE locale changes.
+ */
+void reset_sock_locale(void)
+{
+    int c;
+
+    for (c = 0; c < 0x100; c++)
+	plain_char[c] = (localize((char)c) == (char)c);
+    plain_char['\n'] = plain_char['\r'] = plain_char['\0'] = 0;
+    plain_char['\b'] = 0;  /* may end an LP prompt */
+    plain_char[(unsigned char)TN_IAC] = 0;
+}
+
 int sockecho(void)
 {
     return !xsock || (xsock && !TELOPT(xsock, them, TN_ECHO));
@@ -919,24 +1079,24 @@ int sockecho(void)
 
 void close_all(void)
 {
-    while (nfds > 3)
-	close(--nfds);
+    int fd = ev_nfds();
+    while (fd > 3)
+	close(--fd);
 }
 
 int is_active(int fd)
 {
-    return FD_ISSET(fd, &active);
+    return ev_ready(fd, EV_READ);
 }
 
 void readers_clear(int fd)
 {
-    FD_CLR(fd, &readers);
+    ev_del(fd, EV_READ);
 }
 
 void readers_set(int fd)
 {
-    FD_SET(fd, &readers);
-    if (fd >= nfds) nfds = fd + 1;
+    ev_add(fd, EV_READ);
 }
 
 int tog_bg(Var *var)
@@ -945,7 +1105,7 @@ int tog_bg(Var *var)
     if (background)
         for (sock = hsock; sock; sock = sock->next)
             if (sock->constate == SS_CONNECTED)
-                FD_SET(sock->fd, &readers);
+                readers_set(input_fd(sock));
     return 1;
 }
 
@@ -1078,7 +1238,7 @@ static int fg_sock(Sock *sock, int quiet)
 	    sock->alert_id = 0;
 	}
 	if (sock->constate == SS_CONNECTED)
-	    FD_SET(sock->fd, &readers);
+	    readers_set(input_fd(sock));
         if (sock->world->screen->active) {
 	    sock->world->screen->active = 0;
             --active_count;
@@ -1225,13 +1385,26 @@ static int opensock(World *world, int flags)
 	xsock->myaddr = NULL;
 	xsock->addrs = NULL;
 	xsock->addr = NULL;
+	xsock->attempts = NULL;
+	xsock->rbuf = NULL;
+	xsock->rbufsize = 0;
+#if HAVE_MCCP
+	xsock->zbuf = NULL;
+#endif
 #if HAVE_SSL
 	xsock->ssl = NULL;
 #endif
     }
+    xsock->rbufsmall = 0;
     Stringninit(xsock->buffer, 80);  /* data must be allocated */
     Stringninit(xsock->subbuffer, 1);
     init_queue(&xsock->queue);
+    init_queue(&xsock->outq);
+    xsock->nattempts = 0;
+    xsock->next_attempt = tvzero;
+    xsock->outqoff = 0;
+    xsock->outqlen = xsock->outqpeak = 0;
+    xsock->outqwarned = 0;
     xsock->host = NULL;
     xsock->port = NULL;
     xsock->ttype = -1;
@@ -1245,6 +1418,10 @@ static int opensock(World *world, int flags)
 #if HAVE_MCCP
     xsock->zstream = NULL;
 #endif
+#ifdef THREADED_RECV
+    xsock->ring = NULL;
+#endif
+    memset(&xsock->stat, 0, sizeof(xsock->stat));
     VEC_ZERO(&xsock->tn_them);
     VEC_ZERO(&xsock->tn_them_tog);
     VEC_ZERO(&xsock->tn_us);
@@ -1330,17 +1507,14 @@ static int opensock(World *world, int flags)
         /* The name lookup is pending.  We wait for it for a fraction of a
          * second here so "relatively fast" looks "immediate" to the user.
          */
-        fd_set readable;
         struct timeval tv;
-        FD_ZERO(&readable);
-        FD_SET(xsock->fd, &readable);
         tv.tv_sec = 0;
         tv.tv_usec = CONN_WAIT;
-        if (select(xsock->fd + 1, &readable, NULL, NULL, &tv) > 0) {
+        if (ev_wait_fd(xsock->fd, EV_READ, &tv) > 0) {
             /* The lookup completed. */
             return openconn(xsock);
         }
-        /* select() returned 0, or -1 and errno==EINTR.  Either way, the
+        /* wait returned 0, or -1 and errno==EINTR.  Either way, the
          * lookup needs more time.  So we add the fd to the set being
          * watched by main_loop(), and don't block here any longer.
          */
@@ -1399,12 +1573,12 @@ static inline int ai_connect(int s, struct addrinfo *ai)
     return connect(s, ai->ai_addr, ai->ai_addrlen);
 }
 
-static void setupnextconn(Sock *sock)
+/* Returns the address after sock->addr, or NULL if there is none. */
+static struct addrinfo *next_addr(Sock *sock)
 {
     struct addrinfo *ai, *next = sock->addr;
 
-    if (sock->fd >= 0)
-	close(sock->fd);
+    if (!next) return NULL;
 retry:
     next = next->ai_next;
     /* if next address is a duplicate of one we've already done, skip it */
@@ -1413,21 +1587,34 @@ retry:
 	    goto retry;
 	}
     }
-    sock->addr = next;
+    return next;
+}
+
+static void setupnextconn(Sock *sock)
+{
+    if (sock->fd >= 0) {
+	ev_del(sock->fd, EV_READ | EV_WRITE);
+	close(sock->fd);
+	sock->fd = -1;
+    }
+    sock->addr = next_addr(sock);
 }
 
 /* If there are more addresses to try, hook ICONFAIL and try the next;
+ * if other attempts are still pending, hook ICONFAIL and wait for them;
  * otherwise, hook CONFAIL and give up. */
 static int ICONFAIL(Sock *sock, const char *what, const char *why)
 {
     setupnextconn(sock);
 
-    if (sock->addr) {
+    if (sock->addr || sock->nattempts) {
 	do_hook(H_ICONFAIL, ICONFAIL_fmt, "%s %s: %s",
 	    (sock)->world->name, (what), (why));
 	oflush();
-	return openconn(sock);
+	return sock->addr ? openconn(sock) : 2;
     }
+    /* None of the addresses worked; don't reuse them next time. */
+    addr_cache_forget(sock->host, sock->port);
     do_hook(H_CONFAIL, "%% Connection to %s failed: %s: %s", "%s %s: %s",
 	(sock)->world->name, (what), (why));
     oflush();
@@ -1444,7 +1631,7 @@ static int openconn(Sock *sock)
     if (xsock->constate == SS_RESOLVING) {
 	nbgai_hdr_t info = { 0, 0 };
 	struct addrinfo *ai;
-        FD_CLR(xsock->fd, &readers);
+        readers_clear(xsock->fd);
         if (read(xsock->fd, &info, sizeof(info)) < 0 || info.err != 0) {
             if (!info.err)
                 CONFAIL(xsock, "read", strerror(errno));
@@ -1483,6 +1670,7 @@ static int openconn(Sock *sock)
 	    }
 	}
 	xsock->addr = xsock->addrs;
+	addr_cache_put(xsock->host, xsock->port, xsock->addrs);
     }
 #endif /* NONBLOCKING_GETHOST */
 
@@ -1517,16 +1705,6 @@ static int openconn(Sock *sock)
         return 0;
     }
 
-#if HAVE_SSL
-    if (xsock->ssl && SSL_set_fd(xsock->ssl, xsock->fd) <= 0) {
-        CONFAIL(xsock, "SSL", ERR_error_string(ERR_get_error(), NULL));
-        killsock(xsock);
-        return 0;
-    }
-#endif
-
-    if (xsock->fd >= nfds) nfds = xsock->fd + 1;
-
     if (!TF_NONBLOCK) {
         set_var_by_id(VAR_async_conn, 0);
     } else if (async_conn) {
@@ -1557,26 +1735,35 @@ static int openconn(Sock *sock)
 
 #ifdef EINPROGRESS
     } else if (errno == EINPROGRESS) {
-        /* The connection needs more time.  It will select() as writable when
-         * it has connected, or readable when it has failed.  We select() it
-         * briefly here so "fast" looks synchronous to the user.
+        /* The connection needs more time.  It will become writable when
+         * it has connected, or readable when it has failed.  We wait for it
+         * briefly here so "fast" looks synchronous to the user (but not
+         * past the time to start racing the next address, and not at all
+         * if we are already racing).
          */
-        fd_set writeable;
         struct timeval tv;
-        FD_ZERO(&writeable);
-        FD_SET(xsock->fd, &writeable);
         tv.tv_sec = 0;
         tv.tv_usec = CONN_WAIT;
-        if (select(xsock->fd + 1, NULL, &writeable, NULL, &tv) > 0) {
+        schedule_attempt(xsock);
+        if (xsock->nattempts) {
+            tv = tvzero;
+        } else if (xsock->next_attempt.tv_sec && tvcmp(&connect_delay, &tv) < 0)
+        {
+            tv = connect_delay;
+        }
+        if (ev_wait_fd(xsock->fd, EV_WRITE, &tv) > 0) {
             /* The connection completed. */
             return establish(xsock);
         }
-        /* select() returned 0, or -1 and errno==EINTR.  Either way, the
+        /* wait returned 0, or -1 and errno==EINTR.  Either way, the
          * connection needs more time.  So we add the fd to the set being
          * watched by main_loop(), and don't block here any longer.
          */
-        FD_SET(xsock->fd, &writers);
-        FD_SET(xsock->fd, &readers);
+        if (ev_add(xsock->fd, EV_READ | EV_WRITE) < 0) {
+            CONFAIL(xsock, "connect", strerror(errno));
+            killsock(xsock);
+            return 0;
+        }
         return 2;
 #endif /* EINPROGRESS */
 
@@ -1714,6 +1901,97 @@ static void tffreeaddrinfo(struct addrinfo *ai)
     FREE(ai);
 }
 
+/* Copy the list of addresses <src> into a single chunk that can be freed
+ * with tffreeaddrinfo().
+ */
+#define AI_ALIGN(n)  (((n) + sizeof(long) - 1) / sizeof(long) * sizeof(long))
+static struct addrinfo *pack_addrinfo(const struct addrinfo *src)
+{
+    const struct addrinfo *ai;
+    struct addrinfo *res, *dst;
+    size_t size = 0;
+
+    for (ai = src; ai; ai = ai->ai_next)
+	size += AI_ALIGN(sizeof(*ai)) + AI_ALIGN(ai->ai_addrlen);
+    if (!size) return NULL;
+    res = dst = XMALLOC(size);
+    for (ai = src; ai; ai = ai->ai_next) {
+	*dst = *ai;
+	dst->ai_canonname = NULL;
+	dst->ai_addr = (struct sockaddr*)((char*)dst + AI_ALIGN(sizeof(*dst)));
+	memcpy(dst->ai_addr, ai->ai_addr, ai->ai_addrlen);
+	dst->ai_next = !ai->ai_next ? NULL :
+	    (struct addrinfo*)((char*)dst->ai_addr + AI_ALIGN(ai->ai_addrlen));
+	dst = dst->ai_next;
+    }
+    return res;
+}
+
+/* Cache of name lookup results, so reconnecting doesn't need to wait for
+ * another lookup.  Entries expire after %name_cache; and an entry is
+ * dropped if none of its addresses could be connected to, in case they
+ * are stale.
+ */
+typedef struct AddrCache {
+    char *key;			/* "host port" (must be first for hash_*()) */
+    struct addrinfo *addrs;	/* packed by pack_addrinfo() */
+    time_t expires;
+    ListEntry *node;		/* node in addr_cache */
+} AddrCache;
+
+static AddrCache *addr_cache_find(const char *host, const char *port)
+{
+    AddrCache *entry;
+    STATIC_BUFFER(key);
+
+    Sprintf(key, "%s %s", host, port);
+    if (!(entry = hash_find(key->data, addr_cache)))
+	return NULL;
+    if (entry->expires > time(NULL))
+	return entry;
+    hash_remove(entry->node, addr_cache);
+    FREE(entry->key);
+    tffreeaddrinfo(entry->addrs);
+    FREE(entry);
+    return NULL;
+}
+
+/* Returns a new copy of the cached addresses for host/port, or NULL. */
+static struct addrinfo *addr_cache_get(const char *host, const char *port)
+{
+    AddrCache *entry;
+
+    if (name_cache.tv_sec <= 0) return NULL;
+    if (!(entry = addr_cache_find(host, port))) return NULL;
+    return pack_addrinfo(entry->addrs);
+}
+
+static void addr_cache_forget(const char *host, const char *port)
+{
+    AddrCache *entry;
+
+    if ((entry = addr_cache_find(host, port)))
+	entry->expires = 0;
+}
+
+static void addr_cache_put(const char *host, const char *port,
+    const struct addrinfo *addrs)
+{
+    AddrCache *entry;
+
+    if (name_cache.tv_sec <= 0 || !addrs) return;
+    if (!(entry = addr_cache_find(host, port))) {
+	entry = XMALLOC(sizeof(AddrCache));
+	entry->key = XMALLOC(strlen(host) + 1 + strlen(port) + 1);
+	sprintf(entry->key, "%s %s", host, port);
+	entry->node = hash_insert((void*)entry, addr_cache);
+    } else {
+	tffreeaddrinfo(entry->addrs);
+    }
+    entry->addrs = pack_addrinfo(addrs);
+    entry->expires = time(NULL) + name_cache.tv_sec;
+}
+
 /* Convert name or ip number string to a list of struct addrinfo.
  * Returns -1 for failure, 0 for success, or a positive file descriptor
  * connected to a pending name lookup process or thread.
@@ -1736,6 +2014,12 @@ static int get_host_address(Sock *sock, const char **what, int *errp)
     *what = NULL;
     if (*errp == 0) return 0;
 
+    if ((sock->addrs = addr_cache_get(sock->host, sock->port))) {
+	*errp = 0;
+	sock->flags |= SOCKALLOCADDRS;
+	return 0;
+    }
+
 #ifdef NONBLOCKING_GETHOST
     if (async_name) {
 	/* do nonblocking for non-numeric */
@@ -1750,7 +2034,10 @@ static int get_host_address(Sock *sock, const char **what, int *errp)
 	hints.ai_flags &= ~AI_NUMERICHOST;
 	*errp = getaddrinfo(sock->host, sock->port, &hints, &sock->addrs);
 	*what = NULL;
-	if (*errp == 0) return 0;
+	if (*errp == 0) {
+	    addr_cache_put(sock->host, sock->port, sock->addrs);
+	    return 0;
+	}
     }
     return -1;
 }
@@ -1816,6 +2103,106 @@ void os2waitforhostname(threadpara *targs)
 }
 # endif /* PLATFORM_OS2 */
 
+# ifdef THREADED_GETHOST
+/* A small pool of threads that call waitforhostname() for pending lookups.
+ * Threads are created as needed (up to RESOLVER_THREADS) and then wait for
+ * more work, so a lookup costs neither a fork() nor a thread creation.
+ * The threads must not call tf's allocator (which is not thread-safe):
+ * jobs are allocated and freed by the main thread, and finished jobs are
+ * handed back on resolver_done.
+ */
+#define RESOLVER_THREADS 4	/* max number of resolver threads */
+
+typedef struct ResolveJob {
+    struct ResolveJob *next;
+    const char *name, *port;
+    int fd;			/* write end of pipe to main thread */
+} ResolveJob;
+
+static pthread_mutex_t resolver_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolver_cond = PTHREAD_COND_INITIALIZER;
+static ResolveJob *resolver_head = NULL;	/* pending jobs */
+static ResolveJob **resolver_tail = &resolver_head;
+static ResolveJob *resolver_done = NULL;	/* finished jobs */
+static int resolver_threads = 0;		/* number of threads */
+static int resolver_idle = 0;			/* number of idle threads */
+
+static void *resolver_thread(void *arg)
+{
+    ResolveJob *job;
+
+    pthread_mutex_lock(&resolver_lock);
+    while (1) {
+	while (!resolver_head) {
+	    resolver_idle++;
+	    pthread_cond_wait(&resolver_cond, &resolver_lock);
+	    resolver_idle--;
+	}
+	job = resolver_head;
+	if (!(resolver_head = job->next))
+	    resolver_tail = &resolver_head;
+	pthread_mutex_unlock(&resolver_lock);
+
+	waitforhostname(job->fd, job->name, job->port);
+
+	pthread_mutex_lock(&resolver_lock);
+	job->next = resolver_done;
+	resolver_done = job;
+    }
+    return NULL;
+}
+
+/* Queue a lookup of name/port, whose result will be written to fd.
+ * Returns 0 for success, or -1 if there is no thread to do it.
+ */
+static int resolver_submit(int fd, const char *name, const char *port)
+{
+    ResolveJob *job, *done;
+    pthread_t tid;
+    int err = 0;
+
+    job = XMALLOC(sizeof(ResolveJob));
+    job->name = STRDUP(name);
+    job->port = STRDUP(port);
+    job->fd = fd;
+    job->next = NULL;
+
+    pthread_mutex_lock(&resolver_lock);
+    done = resolver_done;
+    resolver_done = NULL;
+    if (resolver_idle == 0 && resolver_threads < RESOLVER_THREADS) {
+	err = tf_thread_create(&tid, resolver_thread, NULL);
+	if (err == 0) {
+	    pthread_detach(tid);
+	    resolver_threads++;
+	}
+    }
+    if (resolver_threads > 0) {
+	*resolver_tail = job;
+	resolver_tail = &job->next;
+	pthread_cond_signal(&resolver_cond);
+	job = NULL;
+    }
+    pthread_mutex_unlock(&resolver_lock);
+
+    while (done) {
+	ResolveJob *next = done->next;
+	FREE(done->name);
+	FREE(done->port);
+	FREE(done);
+	done = next;
+    }
+    if (job) {
+	FREE(job->name);
+	FREE(job->port);
+	FREE(job);
+	errno = err;
+	return -1;
+    }
+    return 0;
+}
+# endif /* THREADED_GETHOST */
+
 static int nonblocking_gethost(const char *name, const char *port,
     struct addrinfo **res, pid_t *pidp, const char **what)
 {
@@ -1825,7 +2212,13 @@ static int nonblocking_gethost(const char *name, const char *port,
     *what = "pipe";
     if (pipe(fds) < 0) return -1;
 
-#ifdef PLATFORM_UNIX
+#if defined(THREADED_GETHOST)
+    {
+        *what = "pthread_create";
+        if (resolver_submit(fds[1], name, port) == 0)
+            return fds[0];
+    }
+#elif defined(PLATFORM_UNIX)
     {
         *what = "fork";
         *pidp = fork();
@@ -1869,44 +2262,45 @@ static int nonblocking_gethost(const char *name, const char *port,
 #endif /* NETDB_H */
 
 
-/* Establish a sock for which connect() has completed. */
-static int establish(Sock *sock)
-{
-    xsock = sock;
 #if TF_NONBLOCK
-    if (xsock->constate == SS_CONNECTING) {
-        int err = 0, flags;
-        socklen_t len = sizeof(err);
+/* Find out whether nonblocking connect() of fd to addr succeeded.  Returns 0
+ * if it did, or an errno value if it didn't; if the failure was in the
+ * test itself, *what is set to the name of the failed operation.
+ */
+static int connect_result(int fd, struct addrinfo *addr, const char **what)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
 
-        /* Old Method 1: If read(fd, buf, 0) fails, the connect() failed, and
-         * errno will explain why.  Problem: on some systems, a read() of
-         * 0 bytes is always successful, even if socket is not connected.
-         */
-        /* Old Method 2: If a second connect() fails with EISCONN, the first
-         * connect() worked.  On the slim chance that the first failed, but
-         * the second worked, use that.  Otherwise, use getsockopt(SO_ERROR)
-         * to find out why the first failed.  If SO_ERROR isn't available,
-         * use read() to get errno.  This method works for all systems, as
-         * well as SOCKS 4.2beta.  Problems: Some socket implementations
-         * give the wrong errno; extra net traffic on failure.
-         */
-        /* CURRENT METHOD:  If possible, use getsockopt(SO_ERROR) to test for
-         * an error.  This avoids the overhead of a second connect(), and the
-         * possibility of getting the error value from the second connect()
-         * (linux).  (Potential problem: it's possible that some systems
-         * don't clear the SO_ERROR value for successful connect().)
-         * If SO_ERROR is not available or we are using SOCKS, we try to read
-         * 0 bytes.  If it fails, the connect() must have failed.  If it
-         * succeeds, we can't know if it's because the connection really
-         * succeeded, or the read() did a no-op for the 0 size, so we try a
-         * second connect().  If the second connect() fails with EISCONN, the
-         * first connect() worked.  If it works (unlikely), use it.  Otherwise,
-         * use read() to get the errno.
-         * Tested on:  Linux, HP-UX, Solaris, Solaris with SOCKS5...
-         */
-        /* Alternative: replace second connect() with getpeername(), and
-         * check for ENOTCONN.  Disadvantage: doesn't work with SOCKS, etc.
-         */
+    /* Old Method 1: If read(fd, buf, 0) fails, the connect() failed, and
+     * errno will explain why.  Problem: on some systems, a read() of
+     * 0 bytes is always successful, even if socket is not connected.
+     */
+    /* Old Method 2: If a second connect() fails with EISCONN, the first
+     * connect() worked.  On the slim chance that the first failed, but
+     * the second worked, use that.  Otherwise, use getsockopt(SO_ERROR)
+     * to find out why the first failed.  If SO_ERROR isn't available,
+     * use read() to get errno.  This method works for all systems, as
+     * well as SOCKS 4.2beta.  Problems: Some socket implementations
+     * give the wrong errno; extra net traffic on failure.
+     */
+    /* CURRENT METHOD:  If possible, use getsockopt(SO_ERROR) to test for
+     * an error.  This avoids the overhead of a second connect(), and the
+     * possibility of getting the error value from the second connect()
+     * (linux).  (Potential problem: it's possible that some systems
+     * don't clear the SO_ERROR value for successful connect().)
+     * If SO_ERROR is not available or we are using SOCKS, we try to read
+     * 0 bytes.  If it fails, the connect() must have failed.  If it
+     * succeeds, we can't know if it's because the connection really
+     * succeeded, or the read() did a no-op for the 0 size, so we try a
+     * second connect().  If the second connect() fails with EISCONN, the
+     * first connect() worked.  If it works (unlikely), use it.  Otherwise,
+     * use read() to get the errno.
+     * Tested on:  Linux, HP-UX, Solaris, Solaris with SOCKS5...
+     */
+    /* Alternative: replace second connect() with getpeername(), and
+     * check for ENOTCONN.  Disadvantage: doesn't work with SOCKS, etc.
+     */
 
 #ifdef SO_ERROR
 # if !SOCKS
@@ -1914,42 +2308,76 @@ static int establish(Sock *sock)
 # endif
 #endif
 
+    *what = NULL;
 #ifdef USE_SO_ERROR
-        if (getsockopt(xsock->fd, SOL_SOCKET, SO_ERROR, (void*)&err, &len) < 0)
-        {
-            return ICONFAIL(xsock, "getsockopt", strerror(errno));
-        }
-
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (void*)&err, &len) < 0) {
+	*what = "getsockopt";
+	return errno;
+    }
 #else
-        {
-            char ch;
-            if (read(xsock->fd, &ch, 0) < 0) {
-		return ICONFAIL(xsock, "nonblocking connect/read", strerror(errno));
-            } else if ((ai_connect(xsock->fd, xsock->addr) < 0) &&
-                errno != EISCONN)
-            {
-                read(xsock->fd, &ch, 1);   /* must fail */
-		return ICONFAIL(xsock, "nonblocking connect 2/read", strerror(errno));
-            }
-        }
+    {
+	char ch;
+	if (read(fd, &ch, 0) < 0) {
+	    *what = "nonblocking connect/read";
+	    return errno;
+	} else if ((ai_connect(fd, addr) < 0) && errno != EISCONN) {
+	    read(fd, &ch, 1);   /* must fail */
+	    *what = "nonblocking connect 2/read";
+	    return errno;
+	}
+    }
 #endif
-        if (err != 0) {
-	    return ICONFAIL_AI(xsock, strerror(err));
+    return err;
+}
+#endif /* TF_NONBLOCK */
+
+/* Establish a sock for which connect() has completed. */
+static int establish(Sock *sock)
+{
+    xsock = sock;
+#if TF_NONBLOCK
+    if (xsock->constate == SS_CONNECTING) {
+        const char *what;
+        int err;
+
+        if ((err = connect_result(xsock->fd, xsock->addr, &what)) != 0) {
+            if (what)
+                return ICONFAIL(xsock, what, strerror(err));
+            return ICONFAIL_AI(xsock, strerror(err));
         }
 
         /* connect() worked.  Clear the pending stuff, and get on with it. */
         xsock->constate = SS_CONNECTED;
-        FD_CLR(xsock->fd, &writers);
+        ev_del(xsock->fd, EV_WRITE);
+    }
 
-        /* Turn off nonblocking (this should help on buggy systems). */
+    if (xsock->constate == SS_CONNECTED) {
+        /* Output is queued and sent when the socket is writable, so the
+         * socket should be nonblocking.  SSL sockets are left blocking,
+         * since SSL_read() and SSL_write() may need to do both.
+         */
+        int flags;
         /* note: 3rd arg to fcntl() is optional on Unix, but required by OS/2 */
-        if ((flags = fcntl(xsock->fd, F_GETFL, 0)) >= 0)
-            fcntl(xsock->fd, F_SETFL, flags & ~TF_NONBLOCK);
+        if ((flags = fcntl(xsock->fd, F_GETFL, 0)) >= 0) {
+#if HAVE_SSL
+            if (xsock->ssl)
+                flags &= ~TF_NONBLOCK;
+            else
+#endif
+                flags |= TF_NONBLOCK;
+            fcntl(xsock->fd, F_SETFL, flags);
+        }
     }
 #endif /* TF_NONBLOCK */
 
-    if (xsock->constate == SS_CONNECTED)
-	FD_SET(xsock->fd, &readers);
+    if (xsock->constate == SS_CONNECTED) {
+	kill_attempts(xsock);	/* xsock->fd won the race */
+#ifdef THREADED_RECV
+	if (recv_thread)
+	    start_recv_thread(xsock);
+#endif
+	readers_set(input_fd(xsock));
+    }
 
     /* hack: sockaddr_in.sin_port and sockaddr_in6.sin6_port coincide */
     if (xsock->addr &&
@@ -1959,6 +2387,11 @@ static int establish(Sock *sock)
 #if HAVE_SSL
     if (xsock->ssl) {
 	int sslret;
+	if (SSL_set_fd(xsock->ssl, xsock->fd) <= 0) {
+	    CONFAIL(xsock, "SSL", ERR_error_string(ERR_get_error(), NULL));
+	    killsock(xsock);
+	    return 0;
+	}
 	sslret = SSL_connect(xsock->ssl);
 	if (sslret <= 0) {
 	    setupnextconn(xsock);
@@ -2009,10 +2442,130 @@ static int establish(Sock *sock)
     return 1;
 }
 
+/* If there is another address to try, schedule a connection attempt to
+ * race the one in progress on sock->fd.
+ */
+static void schedule_attempt(Sock *sock)
+{
+    struct timeval now;
+
+    sock->next_attempt = tvzero;
+    if (!async_conn || tvcmp(&connect_delay, &tvzero) <= 0 || !next_addr(sock))
+	return;
+    gettime(&now);
+    tvadd(&sock->next_attempt, &now, &connect_delay);
+    if (!attempt_timeout.tv_sec || tvcmp(&sock->next_attempt, &attempt_timeout) < 0)
+	attempt_timeout = sock->next_attempt;
+}
+
+/* Start connection attempts that are due.  The attempt in progress on
+ * sock->fd is moved to sock->attempts, and openconn() starts a new one on
+ * the next address.
+ */
+static void start_attempts(void)
+{
+    Sock *sock, *oldxsock = xsock;
+    struct timeval now;
+
+    gettime(&now);
+    attempt_timeout = tvzero;
+    for (sock = hsock; sock; sock = sock->next) {
+	if (!sock->next_attempt.tv_sec) continue;
+	if (tvcmp(&sock->next_attempt, &now) > 0) {
+	    if (!attempt_timeout.tv_sec ||
+		tvcmp(&sock->next_attempt, &attempt_timeout) < 0)
+		    attempt_timeout = sock->next_attempt;
+	    continue;
+	}
+	sock->next_attempt = tvzero;
+	if (sock->constate != SS_CONNECTING || sock->fd < 0) continue;
+	sock->attempts = XREALLOC(sock->attempts,
+	    (sock->nattempts + 1) * sizeof(Attempt));
+	sock->attempts[sock->nattempts].fd = sock->fd;
+	sock->attempts[sock->nattempts].addr = sock->addr;
+	sock->nattempts++;
+	sock->fd = -1;
+	sock->addr = next_addr(sock);
+	openconn(sock);  /* may schedule another, and set attempt_timeout */
+    }
+    xsock = oldxsock;
+}
+
+/* Check the attempts racing xsock->fd.  The first one to connect wins, and
+ * replaces xsock->fd.  Each one that fails is reported with ICONFAIL, or
+ * with CONFAIL if it was the last hope.  Returns the number of ready
+ * descriptors handled.
+ */
+static int check_attempts(void)
+{
+    int i, err, count = 0;
+    const char *what;
+    Attempt attempt;
+
+    for (i = 0; i < xsock->nattempts; i++) {
+	attempt = xsock->attempts[i];
+	if (!ev_ready(attempt.fd, EV_READ | EV_WRITE)) continue;
+	count++;
+	err = connect_result(attempt.fd, attempt.addr, &what);
+	/* remove it from list */
+	xsock->attempts[i--] = xsock->attempts[--xsock->nattempts];
+	if (err == 0) {
+	    /* winner */
+	    if (xsock->fd >= 0) {
+		ev_del(xsock->fd, EV_READ | EV_WRITE);
+		close(xsock->fd);
+	    }
+	    xsock->fd = attempt.fd;
+	    xsock->addr = attempt.addr;
+	    xsock->next_attempt = tvzero;
+	    establish(xsock);
+	    return count;
+	}
+	ev_del(attempt.fd, EV_READ | EV_WRITE);
+	close(attempt.fd);
+	if (!what) what = printai(attempt.addr, NULL);
+	if (xsock->fd < 0 && !xsock->nattempts) {
+	    /* None of the addresses worked; don't reuse them next time. */
+	    addr_cache_forget(xsock->host, xsock->port);
+	    do_hook(H_CONFAIL, CONFAIL_fmt, "%s %s %s",
+		xsock->world->name, what, strerror(err));
+	    oflush();
+	    killsock(xsock);
+	    return count;
+	}
+	do_hook(H_ICONFAIL, ICONFAIL_fmt, "%s %s: %s",
+	    xsock->world->name, what, strerror(err));
+	oflush();
+    }
+    return count;
+}
+
+/* Close all connection attempts racing sock->fd. */
+static void kill_attempts(Sock *sock)
+{
+    while (sock->nattempts > 0) {
+	sock->nattempts--;
+	ev_del(sock->attempts[sock->nattempts].fd, EV_READ | EV_WRITE);
+	close(sock->attempts[sock->nattempts].fd);
+    }
+    if (sock->attempts) {
+	FREE(sock->attempts);
+	sock->attempts = NULL;
+    }
+    sock->next_attempt = tvzero;
+}
+
 /* clear most of sock's fields, but leave it consistent and extant */
 static void killsock(Sock *sock)
 {
     if (sock->constate >= SS_ZOMBIE) return;
+    if (sock->outq.list.head) {
+	/* last chance for output queued since the last flush_output() */
+	if (sock->constate == SS_CONNECTED)
+	    write_output(sock);
+	discard_output(sock);
+    }
+    kill_attempts(sock);
 #if 0 /* There may be a disconnect hook AFTER this function... */
     if (sock == fsock || sock->queue.list.head || sock->world->screen->nnew) {
 	sock->constate = SS_ZOMBIE;
@@ -2055,10 +2608,12 @@ static void killsock(Sock *sock)
 	SSL_shutdown(sock->ssl);
 	/* Don't SSL_free() yet: we still need to be able to use SSL_error() */
     }
+#endif
+#ifdef THREADED_RECV
+    stop_recv_thread(sock);
 #endif
     if (sock->fd >= 0) {
-        FD_CLR(sock->fd, &readers);
-        FD_CLR(sock->fd, &writers);
+        ev_del(sock->fd, EV_READ | EV_WRITE);
         close(sock->fd);
         sock->fd = -1;
     }
@@ -2114,6 +2669,10 @@ static void nukesock(Sock *sock)
 	SSL_free(sock->ssl);
 	sock->ssl = NULL;
     }
+#endif
+    if (sock->rbuf) FREE(sock->rbuf);
+#if HAVE_MCCP
+    if (sock->zbuf) FREE(sock->zbuf);
 #endif
     FREE(sock);
 }
@@ -2145,7 +2704,7 @@ static void nuke_dead_socks(void)
         next = sock->next;
         if (sock->constate == SS_ZOMBIE) {
 	    if (sock->fd >= 0)
-		FD_CLR(sock->fd, &readers);
+		readers_clear(sock->fd);
         } else if (sock->constate == SS_DEAD) {
             nukesock(sock);
             dead_socks--;
@@ -2154,12 +2713,8 @@ static void nuke_dead_socks(void)
     if (quitdone && !hsock) quit_flag = 1;
 }
 
-static void queue_socket_line(Sock *sock, const conString *line, int offset,
-    attr_t attr)
+static void enqueue_socket_line(Sock *sock, String *new, attr_t attr)
 {
-    String *new;
-    (new = StringnewM(NULL, line->len - offset, 0, sock->world->md))->links++;
-    SStringocat(new, line, offset);
     new->attrs |= attr;
     gettime(&new->time);
     sock->time[SOCK_RECV] = new->time;
@@ -2167,6 +2722,29 @@ static void queue_socket_line(Sock *sock, const conString *line, int offset,
     if (!sock->queue.list.head)
 	socks_with_lines++;
     enqueue(&sock->queue, new);
+    if (++sock->stat.queued > sock->stat.queuepeak)
+	sock->stat.queuepeak = sock->stat.queued;
+}
+
+static void queue_socket_line(Sock *sock, const conString *line, int offset,
+    attr_t attr)
+{
+    String *new;
+    (new = StringnewM(NULL, line->len - offset, 0, sock->world->md))->links++;
+    SStringocat(new, line, offset);
+    enqueue_socket_line(sock, new, attr);
+}
+
+/* Like queue_socket_line(), but takes plain text directly from a receive
+ * buffer, so it doesn't have to be copied into sock->buffer first.
+ */
+static void queue_socket_text(Sock *sock, const char *text, int len,
+    attr_t attr)
+{
+    String *new;
+    (new = StringnewM(NULL, len, 0, sock->world->md))->links++;
+    Stringfncat(new, text, len);
+    enqueue_socket_line(sock, new, attr);
 }
 
 static void dc(Sock *s)
@@ -2239,16 +2817,55 @@ static int sockcharcmp(const void *a, const void *b) {
 		       (*(Sock**)b)->world->character);
 }
 
+/* Print a count in 5 columns or less. */
+static const char *fmtcount(char *buf, unsigned long n)
+{
+    if (n < 100000UL) sprintf(buf, "%lu", n);
+    else if (n < 10000000UL) sprintf(buf, "%luk", n / 1000);
+    else if (n < 10000000000UL) sprintf(buf, "%luM", n / 1000000);
+    else sprintf(buf, "%luG", n / 1000000000UL);
+    return buf;
+}
+
+/* Print a time in microseconds in 5 columns or less. */
+static const char *fmtusec(char *buf, long usec)
+{
+    if (usec < 1000) sprintf(buf, "%ldus", usec);
+    else if (usec < 1000000) sprintf(buf, "%ldms", usec / 1000);
+    else sprintf(buf, "%lds", usec / 1000000);
+    return buf;
+}
+
+/* Returns the upper bound (in usec) of the latency histogram bucket that
+ * contains the pct'th percentile of sock's lines, or 0 if there are none.
+ */
+static long latency_percentile(Sock *sock, int pct)
+{
+    unsigned long total = 0, sum = 0;
+    int i;
+
+    for (i = 0; i < LATENCY_BUCKETS; i++)
+	total += sock->stat.latency[i];
+    if (!total) return 0;
+    for (i = 0; i < LATENCY_BUCKETS - 1; i++) {
+	sum += sock->stat.latency[i];
+	if (sum * 100 >= total * pct) break;
+    }
+    return 2L << i;
+}
+
 /* display list of open sockets and their state. */
 struct Value *handle_listsockets_command(String *args, int offset)
 {
     Sock *sock;
     Vector socks = vector_init(32);
-    char idlebuf[16], linebuf[16], addrbuf[64], state;
+    char idlebuf[16], linebuf[16], addrbuf[64], sendqbuf[24], state;
+    char statbuf[9][16];
     const char *ptr;
     time_t now;
     int t, n, opt, i, nnew, nold;
     int error = 0, shortflag = FALSE, mflag = matching, numeric = 0;
+    int sendqflag = FALSE, statflag = FALSE;
     Pattern pat_name, pat_type;
     int typewidth = 11, namewidth = 15, hostwidth = 26;
     int (*cmp)(const void *, const void *) = NULL;
@@ -2256,7 +2873,7 @@ struct Value *handle_listsockets_command(String *args, int offset)
     init_pattern_str(&pat_name, NULL);
     init_pattern_str(&pat_type, NULL);
 
-    startopt(CS(args), "m:sT:nS:");
+    startopt(CS(args), "m:sT:nqvS:");
     while ((opt = nextopt(&ptr, NULL, NULL, &offset))) {
         switch(opt) {
         case 'm':
@@ -2273,6 +2890,12 @@ struct Value *handle_listsockets_command(String *args, int offset)
 	case 'n':
 	    numeric = 1;
 	    break;
+	case 'q':
+	    sendqflag = TRUE;
+	    break;
+	case 'v':
+	    statflag = TRUE;
+	    break;
 	case 'S':
 	    n = strlen(ptr);
 	    if (n == 0 || cstrncmp(ptr, "name", n) == 0)
@@ -2328,13 +2951,28 @@ struct Value *handle_listsockets_command(String *args, int offset)
 	typewidth += 3;
 	hostwidth = 20;
     }
+    if (sendqflag) {
+	/* make room for SENDQ column */
+	if (numeric)
+	    namewidth -= 6;
+	else
+	    hostwidth -= 6;
+    }
 
     now = time(NULL);
 
-    if (!shortflag)
-        oprintf("    %8s %4s %-*s %-*s %-*s %s",
-	    "LINES", "IDLE", typewidth, "TYPE", namewidth, "NAME",
+    if (shortflag) {
+	/* no header */
+    } else if (statflag) {
+        oprintf("    %-*s %5s %5s %5s %5s %5s %5s %6s %4s %5s %5s",
+	    namewidth, "NAME", "RECV", "BYTES", "LINES", "PRMPT", "TELNT",
+	    "QPEAK", "TRIG", "MEMO", "LAT50", "LAT99");
+    } else {
+        oprintf("    %8s %4s%s %-*s %-*s %-*s %s",
+	    "LINES", "IDLE", sendqflag ? " SENDQ" : "",
+	    typewidth, "TYPE", namewidth, "NAME",
 	    hostwidth, "HOST", "PORT");
+    }
     for (i = 0; i < socks.size; i++) {
 	sock = socks.ptrs[i];
         nnew = sock->world->screen->nnew;
@@ -2374,6 +3012,13 @@ struct Value *handle_listsockets_command(String *args, int offset)
         else
             sprintf(idlebuf, "long");
 
+	if (!sendqflag)
+	    sendqbuf[0] = '\0';
+	else if (sock->outqpeak > 99999)
+	    sprintf(sendqbuf, " %4ldk", sock->outqpeak / 1024);
+	else
+	    sprintf(sendqbuf, " %5ld", sock->outqpeak);
+
 	state =
 	    sock->constate < SS_CONNECTED ? '?' :
             sock->constate >= SS_ZOMBIE ? '!' :
@@ -2386,15 +3031,39 @@ struct Value *handle_listsockets_command(String *args, int offset)
 	    '#' /* shouldn't happen */;
 	if (sock->flags & SOCKCOMPRESS)
 	    state = lcase(state);
+	if (statflag) {
+	    if (sock->stat.memolookups)
+		sprintf(statbuf[8], "%3d%%", (int)(100.0 *
+		    sock->stat.memohits / sock->stat.memolookups));
+	    else
+		strcpy(statbuf[8], "-");
+	    oprintf("%c%c%c %-*.*s %5s %5s %5s %5s %5s %5s %6.2f %4s %5s %5s",
+		(sock == xsock ? '*' : ' '),
+		state,
+		(sock->flags & SOCKPROXY ? 'P' : ' '),
+		namewidth, namewidth, sock->world->name,
+		fmtcount(statbuf[0], sock->stat.rawbytes),
+		fmtcount(statbuf[1], sock->stat.bytes),
+		fmtcount(statbuf[2], sock->stat.lines),
+		fmtcount(statbuf[3], sock->stat.prompts),
+		fmtcount(statbuf[4], sock->stat.telnet),
+		fmtcount(statbuf[5], sock->stat.queuepeak),
+		sock->stat.trigtime.tv_sec +
+		    sock->stat.trigtime.tv_usec / 1000000.0,
+		statbuf[8],
+		fmtusec(statbuf[6], latency_percentile(sock, 50)),
+		fmtusec(statbuf[7], latency_percentile(sock, 99)));
+	    continue;
+	}
 	if (!numeric && sock->addr)
 	    sprintf(addrbuf, "%-*.*s %.6s",
 		hostwidth, hostwidth, sock->host, sock->port);
         oprintf("%c%c%c"
-	    " %s %s %-*.*s %-*.*s %s",
+	    " %s %s%s %-*.*s %-*.*s %s",
             (sock == xsock ? '*' : ' '),
 	    state,
 	    (sock->flags & SOCKPROXY ? 'P' : ' '),
-            linebuf, idlebuf,
+            linebuf, idlebuf, sendqbuf,
             typewidth, typewidth, sock->world->type,
 	    namewidth, namewidth, sock->world->name,
 	    !sock->addr ? "" : numeric ? printai(sock->addr, "%-20.20s %d") :
@@ -2470,50 +3139,192 @@ int handle_fake_recv_function(conString *string, const char *world,
 }
 
 
-/* tramsmit text to current socket */
+/* Queue text for transmission on current socket.  It will be sent by
+ * flush_output(), normally just before main_loop() waits for events.
+ */
 static int transmit(const char *str, unsigned int numtowrite)
 {
-    int numwritten, err;
+    String *chunk;
 
     if (!xsock || xsock->constate != SS_CONNECTED)
         return 0;
-    while (numtowrite) {
+    if (!numtowrite)
+        return 1;
+    if (!xsock->outq.list.head)
+        socks_with_output++;
+    (chunk = Stringnew(str, numtowrite, 0))->links++;
+    enqueue(&xsock->outq, chunk);
+    xsock->outqlen += numtowrite;
+    if (ev_wanted(xsock->fd, EV_WRITE)) {
+        /* already waiting for server to accept earlier output */
+        note_backlog();
+    } else if (xsock->outqlen >= OUTQ_EAGER) {
+        /* don't let a long burst pile up if the socket can take it */
+        return flush_output();
+    }
+    return 1;
+}
+
+/* Write as much of sock's output queue as possible with one writev() (or
+ * SSL_write()), and remove what was written from the queue.  Returns the
+ * result of writev() or SSL_write().
+ */
+static long write_output(Sock *sock)
+{
+    ListEntry *node;
+    conString *chunk;
+    long n, len;
+
+#if HAVE_SSL
+    if (sock->ssl) {
+	/* SSL socket is blocking; concatenate the chunks and write them
+	 * all at once. */
+	STATIC_BUFFER(sslbuf);
+	Stringtrunc(sslbuf, 0);
+	for (node = sock->outq.list.tail; node; node = node->prev) {
+	    chunk = node->datum;
+	    Stringfncat(sslbuf, chunk->data, chunk->len);
+	}
+	n = SSL_write(sock->ssl, sslbuf->data + sock->outqoff,
+	    sslbuf->len - sock->outqoff);
+    } else
+#endif /* HAVE_SSL */
+    {
+	struct iovec iov[OUTQ_IOV];
+	int niov = 0;
+	for (node = sock->outq.list.tail; node && niov < OUTQ_IOV;
+	    node = node->prev)
+	{
+	    chunk = node->datum;
+	    iov[niov].iov_base = (char*)chunk->data;
+	    iov[niov].iov_len = chunk->len;
+	    niov++;
+	}
+	iov[0].iov_base = (char*)iov[0].iov_base + sock->outqoff;
+	iov[0].iov_len -= sock->outqoff;
+	n = writev(sock->fd, iov, niov);
+    }
+    if (n <= 0)
+	return n;
+
+    gettime(&sock->time[SOCK_SEND]);
+    sock->outqlen -= n;
+    len = n + sock->outqoff;
+    while (sock->outq.list.tail &&
+	len >= (chunk = sock->outq.list.tail->datum)->len)
+    {
+	len -= chunk->len;
+	conStringfree(dequeue(&sock->outq));
+    }
+    sock->outqoff = len;
+    if (!sock->outq.list.head) {
+	socks_with_output--;
+	sock->outqwarned = 0;
+    }
+    return n;
+}
+
+/* Free sock's output queue without sending it. */
+static void discard_output(Sock *sock)
+{
+    conString *chunk;
+
+    if (!sock->outq.list.head) return;
+    while ((chunk = dequeue(&sock->outq)))
+	conStringfree(chunk);
+    socks_with_output--;
+    sock->outqoff = 0;
+    sock->outqlen = 0;
+    sock->outqwarned = 0;
+}
+
+/* Send queued output on current socket until it is empty or the socket
+ * would block.  In the latter case, main_loop() will call us again when
+ * the socket becomes writable.  Returns 0 if the socket was disconnected.
+ */
+static int flush_output(void)
+{
+    long n;
+    int err;
+
+    while (xsock->outq.list.head) {
+	n = write_output(xsock);
+	if (n > 0) continue;
 #if HAVE_SSL
 	if (xsock->ssl) {
-	    numwritten = SSL_write(xsock->ssl, str, numtowrite);
-	    if (numwritten <= 0) {
-		zombiesock(xsock); /* before hook, so sock state is correct */
-		ssl_io_err(xsock, numwritten, H_DISCONNECT);
-		return 0;
-	    }
-	} else
+	    discard_output(xsock);
+	    zombiesock(xsock); /* before hook, so sock state is correct */
+	    ssl_io_err(xsock, n, H_DISCONNECT);
+	    return 0;
+	}
 #endif /* HAVE_SSL */
+	err = errno;
+	if (err == EINTR || err == EAGAIN
+#ifdef EWOULDBLOCK
+	    || err == EWOULDBLOCK
+#endif
+	    )
 	{
-	    numwritten = send(xsock->fd, str, numtowrite, 0);
-	    if (numwritten < 0) {
-		err = errno;
-		/* Socket is blocking; EAGAIN and EWOULDBLOCK are impossible. */
-		if (err == EINTR) {
-		    return 0;
-		} else if (err == EHOSTUNREACH || err == ENETUNREACH) {
-		    /* XXX there should be an UNREACHABLE hook here */
-		    eprintf("%s: send: %s", xsock->world->name, strerror(err));
-		    return 0;
-		} else {
-		    flushxsock();
-		    zombiesock(xsock); /* before hook, so state is correct */
-		    DISCON(xsock->world->name, "send", strerror(err));
-		    return 0;
-		}
-	    }
+	    break;
+	} else if (err == EHOSTUNREACH || err == ENETUNREACH) {
+	    /* XXX there should be an UNREACHABLE hook here */
+	    eprintf("%s: send: %s", xsock->world->name, strerror(err));
+	    discard_output(xsock);
+	    break;
+	} else {
+	    discard_output(xsock);
+	    flushxsock();
+	    zombiesock(xsock); /* before hook, so state is correct */
+	    DISCON(xsock->world->name, "send", strerror(err));
+	    return 0;
 	}
-        numtowrite -= numwritten;
-        str += numwritten;
-        gettime(&xsock->time[SOCK_SEND]);
     }
+
+    if (!xsock->outq.list.head) {
+	ev_del(xsock->fd, EV_WRITE);
+	return 1;
+    }
+
+    /* Server isn't keeping up; wait until it's ready for more. */
+    ev_add(xsock->fd, EV_WRITE);
+    note_backlog();
     return 1;
 }
 
+/* Flush output queues of all connected socks.  Unless all is set, socks
+ * that are waiting for writability are left for main_loop() to flush.
+ */
+static void flush_all_output(int all)
+{
+    Sock *sock, *oldxsock = xsock;
+
+    for (sock = hsock; sock; sock = sock->next) {
+	if (sock->outq.list.head && sock->constate == SS_CONNECTED &&
+	    (all || !ev_wanted(sock->fd, EV_WRITE)))
+	{
+	    xsock = sock;
+	    flush_output();
+	}
+    }
+    xsock = oldxsock;
+}
+
+/* Record the size of current socket's unsent output, and call the BACKLOG
+ * hook the first time it reaches %backlog_warn.
+ */
+static void note_backlog(void)
+{
+    if (xsock->outqlen > xsock->outqpeak)
+	xsock->outqpeak = xsock->outqlen;
+    if (!xsock->outqwarned && backlog_warn > 0 &&
+	xsock->outqlen >= backlog_warn)
+    {
+	xsock->outqwarned = 1;
+	do_hook(H_BACKLOG, "%% Output to %s is backed up: %ld bytes unsent.",
+	    "%s %ld", xsock->world->name, xsock->outqlen);
+    }
+}
+
 /* send_line
  * Send a line to the server on the current socket.  If there is a prompt
  * associated with the current socket, clear it.
@@ -2585,17 +3396,119 @@ int send_line(const char *src, unsigned int len, int eol_flag)
     return 1;
 }
 
-static void handle_socket_lines(void)
+/* A socket's share of a per-iteration quantity (%sched_bytes or
+ * %sched_lines): base times the world's weight, and more for the
+ * foreground socket so that the world the user is watching stays live.
+ */
+static long sock_budget(Sock *sock, long base)
+{
+    long weight = world_weight(sock->world);
+    if (sock == fsock) weight *= FG_WEIGHT;
+    return base * weight;
+}
+
+/* Count a line received at *then and displayed now in sock's histogram. */
+static void note_latency(Sock *sock, const struct timeval *then)
+{
+    struct timeval now;
+    long usec;
+    int i;
+
+    gettime(&now);
+    usec = (now.tv_sec - then->tv_sec) * 1000000L +
+	(now.tv_usec - then->tv_usec);
+    for (i = 0; usec > 1 && i < LATENCY_BUCKETS - 1; i++)
+	usec >>= 1;
+    sock->stat.latency[i]++;
+}
+
+/* Queued lines decoded ahead of time, so the triggers can be matched
+ * against all of them at once with %match_threads (see prematch_lines()).
+ */
+#define MATCH_BATCH	64
+
+static struct {
+    Sock *sock;
+    int emul;				/* %emulation used to decode */
+    int xtabs, tabsz;			/* %expand_tabs and %tabsize, too */
+    int n, pos;				/* lines in batch, next line */
+    conString *raw[MATCH_BATCH];	/* lines as queued */
+    String *text[MATCH_BATCH];		/* lines decoded */
+    attr_t attrs[MATCH_BATCH];		/* sock->attrs before each line */
+} batch;
+
+/* Forget the rest of the batch, and put xsock's attributes back the way
+ * they were before its first unused line was decoded. */
+static void end_batch(void)
+{
+    if (batch.pos < batch.n && batch.sock == xsock)
+	xsock->attrs = batch.attrs[batch.pos];
+    for ( ; batch.pos < batch.n; batch.pos++) {
+	conStringfree(batch.raw[batch.pos]);
+	Stringfree(batch.text[batch.pos]);
+    }
+    batch.n = batch.pos = 0;
+    prematch_done();
+}
+
+/* Decode <first>, just dequeued from xsock, and up to <max>-1 lines queued
+ * after it, and match them against the triggers. */
+static void start_batch(conString *first, int max)
+{
+    ListEntry *node = xsock->queue.list.tail;
+    conString *line = first;
+
+    batch.sock = xsock;
+    batch.emul = emulation;
+    batch.xtabs = expand_tabs;
+    batch.tabsz = tabsize;
+    batch.n = batch.pos = 0;
+    while (1) {
+	(batch.raw[batch.n] = line)->links++;
+	batch.attrs[batch.n] = xsock->attrs;
+	batch.text[batch.n] = decode_ansi(line->data, xsock->attrs, emulation,
+	    &xsock->attrs);
+	batch.text[batch.n]->time = line->time;
+	batch.text[batch.n]->links++;
+	if (++batch.n == max || !node) break;
+	line = node->datum;
+	node = node->prev;
+	if (line->attrs & (F_TFPROMPT | F_SERVPROMPT)) break;
+    }
+    prematch_lines(xworld(), batch.text, batch.n);
+}
+
+/* Return <line> decoded, from the batch, or NULL if it is not there. */
+static String *take_batch(conString *line)
+{
+    if (batch.pos == batch.n) return NULL;
+    if (batch.sock != xsock || batch.raw[batch.pos] != line ||
+	batch.emul != emulation || batch.xtabs != expand_tabs ||
+	batch.tabsz != tabsize)
+    {
+	/* a trigger flushed the queue or changed how lines are decoded */
+	end_batch();
+	return NULL;
+    }
+    conStringfree(line);
+    conStringfree(batch.raw[batch.pos]);
+    return batch.text[batch.pos++];
+}
+
+/* Process up to limit (or all, if limit is 0) queued lines from xsock. */
+static void handle_socket_lines(long limit)
 {
     static int depth = 0;
     conString *line;
     int is_prompt;
+    struct timeval received, start, end;
 
     if (depth) return;	/* don't recurse */
     if (!(line = dequeue(&xsock->queue)))
 	return;
     depth++;
     do {
+	xsock->stat.queued--;
 	if (!xsock->queue.list.head) /* just dequeued the last line */
 	    socks_with_lines--;
 
@@ -2605,14 +3518,25 @@ static void handle_socket_lines(void)
 	    continue;
 	}
 
-	incoming_text = decode_ansi(line->data, xsock->attrs, emulation,
-	    &xsock->attrs);
-	incoming_text->time = line->time;
 	is_prompt = line->attrs & F_SERVPROMPT;
-	conStringfree(line);
-	incoming_text->links++;
+	if (match_threads > 0 && batch.pos == batch.n && !is_prompt &&
+	    (borg || hilite || gag) && xsock->queue.list.tail)
+	{
+	    start_batch(line, (limit > 0 && limit < MATCH_BATCH) ?
+		limit : MATCH_BATCH);
+	}
+	if ((incoming_text = take_batch(line))) {
+	    received = incoming_text->time;
+	} else {
+	    incoming_text = decode_ansi(line->data, xsock->attrs, emulation,
+		&xsock->attrs);
+	    received = incoming_text->time = line->time;
+	    conStringfree(line);
+	    incoming_text->links++;
+	}
 
 	if (is_prompt) {
+	    xsock->stat.prompts++;
 	    if (do_hook(H_PROMPT, NULL, "%S", incoming_text)) {
 		Stringfree(incoming_text);
 	    } else {
@@ -2620,7 +3544,11 @@ static void handle_socket_lines(void)
 	    }
 
 	} else {
+	    xsock->stat.lines++;
 	    if (borg || hilite || gag) {
+		unsigned long lookups = trig_memo_lookups;
+		unsigned long hits = trig_memo_hits;
+		monotime(&start);
 		if (find_and_run_matches(NULL, -1, &incoming_text, xworld(),
 		    TRUE, 0))
 		{
@@ -2628,6 +3556,11 @@ static void handle_socket_lines(void)
 			do_hook(H_BGTRIG, "%% Trigger in world %s", "%s %S",
 			    xsock->world->name, incoming_text);
 		}
+		monotime(&end);
+		tvsub(&end, &end, &start);
+		tvadd(&xsock->stat.trigtime, &xsock->stat.trigtime, &end);
+		xsock->stat.memolookups += trig_memo_lookups - lookups;
+		xsock->stat.memohits += trig_memo_hits - hits;
 	    }
 
 	    if (is_bamf(incoming_text->data) || is_quiet(incoming_text->data) ||
@@ -2640,11 +3573,14 @@ static void handle_socket_lines(void)
 	    world_output(xsock->world, CS(incoming_text));
 	    Stringfree(incoming_text);
 	}
-    } while ((line = dequeue(&xsock->queue)));
+	note_latency(xsock, &received);
+    } while (--limit != 0 && (line = dequeue(&xsock->queue)));
+    end_batch();
     depth--;
 
-    /* We just emptied the queue; there may be a partial line pending */
-    test_prompt();
+    /* If we emptied the queue, there may be a partial line pending */
+    if (!xsock->queue.list.head)
+	test_prompt();
 }
 
 /* log, record, and display line as if it came from sock */
@@ -2747,6 +3683,7 @@ static void handle_implicit_prompt(void)
 	&xsock->attrs);
     new->links++;
 
+    xsock->stat.prompts++;
     handle_prompt(new, 0, FALSE);
 }
 
@@ -2862,16 +3799,236 @@ static z_stream *new_zstream(void)
 }
 #endif /* HAVE_MCCP */
 
+/* Allocate sock's receive buffer, or resize it to suit recent reads.  A
+ * burst that fills the buffer doubles it, so large bursts (room dumps, who
+ * lists) take fewer reads; a long run of small reads shrinks it again.
+ */
+static void fit_rbuf(Sock *sock)
+{
+    int size = sock->rbufsize;
+
+#if HAVE_MCCP
+    /* Don't move rbuf while it holds compressed input. */
+    if (sock->zstream && sock->zstream->avail_in)
+	goto alloc_zbuf;
+#endif
+    if (!sock->rbuf)
+	size = RBUF_MIN;
+    else if (sock->rbufsmall < 0 && size < RBUF_MAX)
+	size *= 2;
+    else if (sock->rbufsmall >= RBUF_SHRINK && size > RBUF_MIN)
+	size /= 2;
+
+    if (size != sock->rbufsize) {
+	if (sock->rbuf) FREE(sock->rbuf);
+	sock->rbuf = XMALLOC(size);
+	sock->rbufsize = size;
+	sock->rbufsmall = 0;
+#if HAVE_MCCP
+	if (sock->zbuf) FREE(sock->zbuf);
+	sock->zbuf = NULL;
+#endif
+    }
+
+#if HAVE_MCCP
+alloc_zbuf:
+    if (sock->zstream && !sock->zbuf)
+	sock->zbuf = XMALLOC(sock->rbufsize);
+#endif
+}
+
+/* Record the size of a read into sock's receive buffer. */
+static void note_rbuf_use(Sock *sock, int count)
+{
+    if (count >= sock->rbufsize)
+	sock->rbufsmall = -1;  /* grow */
+    else if (count < sock->rbufsize / 4)
+	sock->rbufsmall = (sock->rbufsmall < 0) ? 1 : sock->rbufsmall + 1;
+    else
+	sock->rbufsmall = 0;
+}
+
+#ifdef THREADED_RECV
+/* With %recv_thread on, each new connection (except SSL) gets a thread that
+ * does nothing but recv() into the Sock's RecvRing, so a burst from the
+ * server is taken off the socket while the main thread is busy with
+ * triggers or the screen.  The main thread reads the ring with ring_recv()
+ * instead of the socket; telnet, MCCP, and line processing stay in the
+ * main thread, since they call hooks and tf's allocator, neither of which
+ * is thread-safe.  The thread writes to a pipe to wake the main loop,
+ * which watches that pipe instead of the socket.
+ */
+#define RECV_RING	(64 * 1024)	/* ring size; must be a power of 2 */
+
+#define ring_load(p)		__atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define ring_store(p, v)	__atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+
+static void ring_wake(RecvRing *ring, int force)
+{
+    char c = 0;
+    if (!__atomic_exchange_n(&ring->signalled, 1, __ATOMIC_SEQ_CST) || force)
+	write(ring->wake[1], &c, 1);
+}
+
+static void *recv_thread_main(void *arg)
+{
+    RecvRing *ring = arg;
+    unsigned long head = 0, tail, off, room;
+    struct pollfd pfd;
+    int n;
+
+    pfd.fd = ring->fd;
+    pfd.events = POLLIN;
+    while (!ring_load(&ring->stop)) {
+	tail = ring_load(&ring->tail);
+	if (!(room = RECV_RING - (head - tail))) {
+	    /* Wait for the main thread to consume something. */
+	    pthread_mutex_lock(&ring->lock);
+	    ring_store(&ring->full, 1);
+	    while (!ring_load(&ring->stop) && ring_load(&ring->tail) == tail)
+		pthread_cond_wait(&ring->room, &ring->lock);
+	    ring_store(&ring->full, 0);
+	    pthread_mutex_unlock(&ring->lock);
+	    continue;
+	}
+	off = head & (RECV_RING - 1);
+	if (room > RECV_RING - off) room = RECV_RING - off;
+	n = recv(ring->fd, ring->buf + off, room, 0);
+	if (n > 0) {
+	    head += n;
+	    ring_store(&ring->head, head);
+	    ring_wake(ring, 0);
+	} else if (n < 0 && (errno == EINTR || errno == EAGAIN
+#ifdef EWOULDBLOCK
+	    || errno == EWOULDBLOCK
+#endif
+	    ))
+	{
+	    /* Socket is nonblocking, for the sake of output.  The timeout is
+	     * only a safety net, in case shutdown() doesn't wake us. */
+	    poll(&pfd, 1, 1000);
+	} else {
+	    ring->err = (n < 0) ? errno : 0;
+	    break;
+	}
+    }
+    ring_store(&ring->done, 1);
+    ring_wake(ring, 1);
+    return NULL;
+}
+
+static void start_recv_thread(Sock *sock)
+{
+    RecvRing *ring;
+    int err;
+
+#if HAVE_SSL
+    if (sock->ssl) return;  /* SSL_read() and SSL_write() can't be split */
+#endif
+    ring = XMALLOC(sizeof(RecvRing));
+    memset(ring, 0, sizeof(RecvRing));
+    ring->fd = sock->fd;
+    if (pipe(ring->wake) < 0) {
+	wprintf("recv_thread: pipe: %s", strerror(errno));
+	FREE(ring);
+	return;
+    }
+    fcntl(ring->wake[0], F_SETFL, fcntl(ring->wake[0], F_GETFL, 0) | TF_NONBLOCK);
+    ring->buf = XMALLOC(RECV_RING);
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->room, NULL);
+
+    err = tf_thread_create(&ring->tid, recv_thread_main, ring);
+    if (err) {
+	/* Not fatal: the main thread will just read the socket itself. */
+	wprintf("recv_thread: pthread_create: %s", strerror(err));
+	pthread_mutex_destroy(&ring->lock);
+	pthread_cond_destroy(&ring->room);
+	close(ring->wake[0]);
+	close(ring->wake[1]);
+	FREE(ring->buf);
+	FREE(ring);
+	return;
+    }
+    ev_del(sock->fd, EV_READ);
+    sock->ring = ring;
+}
+
+/* Stop sock's receiving thread, if any.  Unread data in the ring is lost. */
+static void stop_recv_thread(Sock *sock)
+{
+    RecvRing *ring = sock->ring;
+
+    if (!ring) return;
+    ev_del(ring->wake[0], EV_READ);
+    ring_store(&ring->stop, 1);
+    shutdown(ring->fd, SHUT_RD);  /* wake the thread if it's in poll() */
+    pthread_mutex_lock(&ring->lock);
+    pthread_cond_signal(&ring->room);
+    pthread_mutex_unlock(&ring->lock);
+    pthread_join(ring->tid, NULL);
+
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->room);
+    close(ring->wake[0]);
+    close(ring->wake[1]);
+    FREE(ring->buf);
+    FREE(ring);
+    sock->ring = NULL;
+}
+
+/* Like recv(), but from the ring filled by the receiving thread. */
+static int ring_recv(RecvRing *ring, char *buf, int len)
+{
+    unsigned long head, tail = ring->tail, off, chunk;
+    char junk[64];
+    int n = 0;
+
+    if ((head = ring_load(&ring->head)) == tail) {
+	/* Empty.  Rearm the wakeup before looking one last time, so
+	 * anything received after that wakes the main loop again. */
+	ring_store(&ring->signalled, 0);
+	while (read(ring->wake[0], junk, sizeof(junk)) > 0)
+	    /* drain */;
+	if ((head = ring_load(&ring->head)) == tail) {
+	    if (ring_load(&ring->done)) {
+		errno = ring->err;
+		return ring->err ? -1 : 0;
+	    }
+	    errno = EAGAIN;
+	    return -1;
+	}
+    }
+
+    while (n < len && tail != head) {
+	off = tail & (RECV_RING - 1);
+	chunk = RECV_RING - off;
+	if (chunk > head - tail) chunk = head - tail;
+	if (chunk > len - n) chunk = len - n;
+	memcpy(buf + n, ring->buf + off, chunk);
+	n += chunk;
+	tail += chunk;
+    }
+    ring_store(&ring->tail, tail);
+    if (ring_load(&ring->full)) {
+	pthread_mutex_lock(&ring->lock);
+	pthread_cond_signal(&ring->room);
+	pthread_mutex_unlock(&ring->lock);
+    }
+    return n;
+}
+#endif /* THREADED_RECV */
+
 /* handle input from current socket */
 static int handle_socket_input(const char *simbuffer, int simlen)
 {
-    char rawchar, localchar, inbuffer[4096];
+    char rawchar, localchar;
     const char *buffer, *place;
+    int count, n, received = 0;
+    long budget = sock_budget(xsock, sched_bytes);
 #if HAVE_MCCP
-    char outbuffer[4096];
+    int zfull = 0;		/* inflate may have more output for us */
 #endif
-    fd_set readfds;
-    int count, n, received = 0;
     struct timeval timeout;
 
     if (xsock->constate <= SS_CONNECTING || xsock->constate >= SS_ZOMBIE)
@@ -2896,14 +4053,15 @@ static int handle_socket_input(const char *simbuffer, int simlen)
 	    buffer = simbuffer;
 	    count = simlen;
 	} else {
+	    fit_rbuf(xsock);
 #if HAVE_MCCP
-	    if (xsock->zstream && xsock->zstream->avail_in) {
+	    if (xsock->zstream && (xsock->zstream->avail_in || zfull)) {
 		count = 0;  /* no reading */
 	    } else
 #endif
 #if HAVE_SSL
 	    if (xsock->ssl) {
-		count = SSL_read(xsock->ssl, inbuffer, sizeof(inbuffer));
+		count = SSL_read(xsock->ssl, xsock->rbuf, xsock->rbufsize);
 		if (count == 0 &&
 		    SSL_get_error(xsock->ssl, 0) == SSL_ERROR_SYSCALL &&
 		    ERR_peek_error() == 0)
@@ -2922,14 +4080,24 @@ static int handle_socket_input(const char *simbuffer, int simlen)
 		/* We could loop while (count < 0 && errno == EINTR), but if we
 		 * got here because of a mistake in the active fdset and there
 		 * is really nothing to read, the loop would be unbreakable. */
-		count = recv(xsock->fd, inbuffer, sizeof(inbuffer), 0);
+#ifdef THREADED_RECV
+		if (xsock->ring)
+		    count = ring_recv(xsock->ring, xsock->rbuf, xsock->rbufsize);
+		else
+#endif
+		count = recv(xsock->fd, xsock->rbuf, xsock->rbufsize, 0);
 		eof:
 		if (count <= 0) {
 		    int err = errno;
 		    constate_t state = xsock->constate;
-		    if (count < 0 && errno == EINTR)
+		    /* Socket is nonblocking, so EAGAIN or EWOULDBLOCK are
+		     * possible if there was a mistake in the active set. */
+		    if (count < 0 && (errno == EINTR || errno == EAGAIN
+#ifdef EWOULDBLOCK
+			|| errno == EWOULDBLOCK
+#endif
+			))
 			return 0;
-		    /* Socket is blocking; EAGAIN and EWOULDBLOCK impossible. */
 		    if (xsock->buffer->len) {
 			queue_socket_line(xsock, CS(xsock->buffer), 0, 0);
 			Stringtrunc(xsock->buffer, 0);
@@ -2950,24 +4118,33 @@ static int handle_socket_input(const char *simbuffer, int simlen)
 		    return received;
 		}
 	    }
+	    if (count) {
+		note_rbuf_use(xsock, count);
+		xsock->stat.rawbytes += count;
+	    }
 #if HAVE_MCCP
 	    if (xsock->zstream) {
 		int zret;
 		if (count) {
-		    xsock->zstream->next_in = (Bytef*)inbuffer;
+		    xsock->zstream->next_in = (Bytef*)xsock->rbuf;
 		    xsock->zstream->avail_in = count;
 		}
-		xsock->zstream->next_out = (Bytef*)(buffer = outbuffer);
-		xsock->zstream->avail_out = sizeof(outbuffer);
+		xsock->zstream->next_out = (Bytef*)(buffer = xsock->zbuf);
+		xsock->zstream->avail_out = xsock->rbufsize;
 		zret = inflate(xsock->zstream, Z_PARTIAL_FLUSH);
+		zfull = !xsock->zstream->avail_out;
 		switch (zret) {
 		case Z_OK:
-		    count = (char*)xsock->zstream->next_out - outbuffer;
+		    count = (char*)xsock->zstream->next_out - xsock->zbuf;
+		    break;
+		case Z_BUF_ERROR:
+		    /* Nothing more to inflate yet; not an error. */
+		    count = 0;
 		    break;
 		case Z_STREAM_END:
 		    /* handle stuff inflated before stream end */
-		    count = (char*)xsock->zstream->next_out - outbuffer;
-		    received += handle_socket_input(outbuffer, count);
+		    count = (char*)xsock->zstream->next_out - xsock->zbuf;
+		    received += handle_socket_input(xsock->zbuf, count);
 		    /* prepare to handle noncompressed stuff after stream end */
 		    buffer = (char*)xsock->zstream->next_in;
 		    count = xsock->zstream->avail_in;
@@ -2975,6 +4152,8 @@ static int handle_socket_input(const char *simbuffer, int simlen)
 		    inflateEnd(xsock->zstream);
 		    FREE(xsock->zstream);
 		    xsock->zstream = NULL;
+		    FREE(xsock->zbuf);
+		    xsock->zbuf = NULL;
 		    xsock->flags &= ~SOCKCOMPRESS;
 		    break;
 		default:
@@ -2986,9 +4165,10 @@ static int handle_socket_input(const char *simbuffer, int simlen)
 		}
 	    } else
 #endif
-		buffer = inbuffer;
+		buffer = xsock->rbuf;
 	}
 
+        xsock->stat.bytes += count;
         for (place = buffer; place - buffer < count; place++) {
 
             /* We always accept 8-bit data, even though RFCs 854 and 1123
@@ -3007,6 +4187,7 @@ static int handle_socket_input(const char *simbuffer, int simlen)
                 xsock->flags & (SOCKTELNET | SOCKMAYTELNET))
             {
                 int valid = 0;
+                xsock->stat.telnet++;
                 switch (xsock->fsastate = rawchar) {
                 case TN_GA: case TN_EOR:
                     /* This is definitely a prompt. */
@@ -3240,13 +4421,39 @@ non_telnet:
 
             } else {
                 /* Normal character. */
-                const char *end;
-                Stringadd(xsock->buffer, localchar);
+                const char *start, *end, *stop;
+                start = place;
                 end = ++place;
-                /* Quickly skip characters that can't possibly be special. */
-                while (is_print(*end) && *end != TN_IAC && end - buffer < count)
+                stop = buffer + count;
+                /* Quickly skip characters that can't possibly be special,
+                 * and copy them all at once.  Most server output is plain
+                 * text (including ansi codes) between newlines. */
+                while (stop - end >= 4 &&
+                    plain_char[(unsigned char)end[0]] &&
+                    plain_char[(unsigned char)end[1]] &&
+                    plain_char[(unsigned char)end[2]] &&
+                    plain_char[(unsigned char)end[3]])
+                {
+                    end += 4;
+                }
+                while (end < stop && plain_char[(unsigned char)*end])
                     end++;
-                Stringfncat(xsock->buffer, (char*)place, end - place);
+
+                if (!xsock->buffer->len && localchar == rawchar) {
+                    /* If this run is an entire line, queue it straight
+                     * from the receive buffer. */
+                    place = end;
+                    while (place < stop && *place == '\r')
+                        place++;
+                    if (place < stop && *place == '\n') {
+                        queue_socket_text(xsock, start, end - start, 0);
+                        xsock->fsastate = '\n';
+                        continue;
+                    }
+                }
+
+                Stringadd(xsock->buffer, localchar);
+                Stringfncat(xsock->buffer, (char*)start + 1, end - start - 1);
                 place = end - 1;
                 xsock->fsastate = (*place == '*') ? '*' : '\0';
             }
@@ -3258,21 +4465,28 @@ non_telnet:
 
 #if HAVE_MCCP
 	/* If there's still un-inflated stuff, we must process it before we
-	 * exit this loop.
+	 * exit this loop.  (But not if we were called to process the last
+	 * output of the stream, which still has input pending.)
 	 */
-	if (xsock->zstream && xsock->zstream->avail_in) {
-	    n = xsock->zstream->avail_in;
+	if (!simbuffer && xsock->zstream &&
+	    (xsock->zstream->avail_in || zfull))
+	{
+	    n = 1;
 	    continue;
 	}
 #endif
 
-	if (simbuffer || received > SPAM) break; /* after uninflated check */
+	if (simbuffer || received >= budget) break; /* after uninflated check */
 
-        FD_ZERO(&readfds);
-        FD_SET(xsock->fd, &readfds);
 	timeout = tvzero; /* don't use tvzero directly, select may modify it */
-        if ((n = select(xsock->fd + 1, &readfds, NULL, NULL, &timeout)) < 0) {
-            if (errno != EINTR) die("handle_socket_input: select", errno);
+#ifdef THREADED_RECV
+	if (xsock->ring) {
+	    n = ring_load(&xsock->ring->head) != xsock->ring->tail ||
+		ring_load(&xsock->ring->done);
+	} else
+#endif
+        if ((n = ev_wait_fd(xsock->fd, EV_READ, &timeout)) < 0) {
+            if (errno != EINTR) die("handle_socket_input: wait", errno);
         }
 
 	if (interrupted()) break;
@@ -3489,6 +4703,10 @@ const char *world_info(const char *worldname, const char *fieldname)
         result = world->sock && world->sock->flags & SOCKPROXY ? "1" : "0";
     } else if (strcmp("src", fieldname) == 0) {
         result = worldname ? world->myhost : world->sock->myhost;
+    } else if (strcmp("weight", fieldname) == 0) {
+	static char buf[16];
+	sprintf(buf, "%d", world_weight(world));
+	result = buf;
     } else if (strcmp("cipher", fieldname) == 0) {
 	result =
 #if HAVE_SSL
@@ -3500,6 +4718,53 @@ const char *world_info(const char *worldname, const char *fieldname)
     return result ? result : "";
 }
 
+/* sockstat() function */
+struct Value *sockstat(const char *worldname, const char *field)
+{
+    World *world;
+    Sock *sock;
+    int i;
+
+    world = (worldname && *worldname) ? find_world(worldname) : xworld();
+    if (!world || !(sock = world->sock))
+	return shareval(val_blank); /* not an error */
+
+    if (strcmp("recv", field) == 0) {
+	return newint(sock->stat.rawbytes);
+    } else if (strcmp("bytes", field) == 0) {
+	return newint(sock->stat.bytes);
+    } else if (strcmp("lines", field) == 0) {
+	return newint(sock->stat.lines);
+    } else if (strcmp("prompts", field) == 0) {
+	return newint(sock->stat.prompts);
+    } else if (strcmp("telnet", field) == 0) {
+	return newint(sock->stat.telnet);
+    } else if (strcmp("queue", field) == 0) {
+	return newint(sock->stat.queued);
+    } else if (strcmp("queuepeak", field) == 0) {
+	return newint(sock->stat.queuepeak);
+    } else if (strcmp("trigtime", field) == 0) {
+	return newdtime(sock->stat.trigtime.tv_sec,
+	    sock->stat.trigtime.tv_usec);
+    } else if (strcmp("memolookups", field) == 0) {
+	return newint(sock->stat.memolookups);
+    } else if (strcmp("memohits", field) == 0) {
+	return newint(sock->stat.memohits);
+    } else if (strcmp("latency50", field) == 0 ||
+	strcmp("latency99", field) == 0)
+    {
+	long usec = latency_percentile(sock, field[7] == '5' ? 50 : 99);
+	return newdtime(usec / 1000000, usec % 1000000);
+    } else if (strcmp("latency", field) == 0) {
+	String *buf = Stringnew(NULL, LATENCY_BUCKETS * 4, 0);
+	for (i = 0; i < LATENCY_BUCKETS; i++)
+	    Sappendf(buf, i ? " %lu" : "%lu", sock->stat.latency[i]);
+	return newSstr(CS(buf));
+    }
+    eprintf("illegal field name '%s'", field);
+    return shareval(val_blank);
+}
+
 int is_open(const char *worldname)
 {
     World *w;
@@ -29,6 +29,7 @@ extern struct Sock *xsock;
 
 extern void    main_loop(void);
 extern void    init_sock(void);
+extern void    reset_sock_locale(void);
 extern int     sockecho(void);
 extern int     is_active(int fd);
 extern void    readers_clear(int fd);
@@ -49,6 +50,7 @@ extern int     handle_fake_recv_function(conString *string, const char *world,
 		    const char *flags);
 extern int     is_connected(const char *worldname);
 extern int     is_open(const char *worldname);
+extern struct Value *sockstat(const char *worldname, const char *field);
 extern int     nactive(const char *worldname);
 extern int     world_hook(const char *fmt, const char *name);
 
@@ -61,8 +61,7 @@ TFILE *tfalert;         /* current alert queue file */
 Screen *fg_screen;	/* current screen, to which tf writes */
 Screen *default_screen;	/* default screen, used if unconnected or !virtscreen */
 
-static TFILE *filemap[FD_SETSIZE];
-static int selectable_tfiles = 0;
+static Vector pipefiles = vector_init(16);	/* TF_PIPE TFILEs */
 static List userfilelist[1];
 static int max_fileid = 0;
 
@@ -73,10 +72,6 @@ static void queueputline(conString *line, TFILE *file);
 
 void init_tfio(void)
 {
-    int i;
-
-    for (i = 0; i < sizeof(filemap)/sizeof(*filemap); i++)
-        filemap[i] = NULL;
     init_list(userfilelist);
 
     tfin = tfkeyboard = tfopen("<tfkeyboard>", "q");
@@ -236,8 +231,7 @@ TFILE *tfopen(const char *name, const char *mode)
         result->node = NULL;
         result->u.fp = fp;
         result->off = result->len = 0;
-        filemap[fileno(fp)] = result;
-        selectable_tfiles++;
+        vector_add(&pipefiles, result);
         return result;
 #endif
     }
@@ -305,7 +299,7 @@ TFILE *tfopen(const char *name, const char *mode)
  */
 int tfclose(TFILE *file)
 {
-    int result;
+    int result, i;
     List *list;
 
     if (!file) return -1;
@@ -322,8 +316,12 @@ int tfclose(TFILE *file)
         result = fclose(file->u.fp);
         break;
     case TF_PIPE:
-        filemap[fileno(file->u.fp)] = NULL;
-        selectable_tfiles--;
+        for (i = 0; i < pipefiles.size; i++) {
+            if (pipefiles.ptrs[i] == file) {
+                pipefiles.ptrs[i] = pipefiles.ptrs[--pipefiles.size];
+                break;
+            }
+        }
         result = shell_status(pclose(file->u.fp));
         break;
     default:
@@ -335,48 +333,35 @@ int tfclose(TFILE *file)
     return result;
 }
 
-/* tfselect() is like select(), but also checks buffered TFILEs */
-int tfselect(int nfds, fd_set *readers, fd_set *writers, fd_set *excepts,
-    struct timeval *timeout)
+/* tfselect() is like ev_wait(), but also checks buffered TFILEs */
+int tfselect(struct timeval *timeout)
 {
-    int i, count, tfcount = 0;
-    fd_set tfreaders;
-
-    if (!selectable_tfiles)
-        return select(nfds, readers, writers, excepts, timeout);
-
-    FD_ZERO(&tfreaders);
+    int i, fd, count, tfcount = 0;
+    TFILE *file;
+    struct timeval zero;
 
-    for (i = 0; i < nfds; i++) {
-        if (filemap[i] && FD_ISSET(i, readers)) {
-            if (filemap[i]->off < filemap[i]->len) {
-                FD_SET(i, &tfreaders);
-                FD_CLR(i, readers);     /* don't check twice */
-                tfcount++;
-            }
-        }
+    for (i = 0; i < pipefiles.size; i++) {
+        file = pipefiles.ptrs[i];
+        if (file->off < file->len && ev_wanted(fileno(file->u.fp), EV_READ))
+            tfcount++;
     }
 
-    if (!tfcount) {
-        return select(nfds, readers, writers, excepts, timeout);
+    if (!tfcount)
+        return ev_wait(timeout);
 
-    } else {
-        /* we found at least one; poll the rest, but don't wait */
-        struct timeval zero;
-        zero = tvzero;
-        count = select(nfds, readers, writers, excepts, &zero);
-        if (count < 0) return count;
-        count += tfcount;
-
-        for (i = 0; tfcount && i < nfds; i++) {
-            if (FD_ISSET(i, &tfreaders)) {
-                FD_SET(i, readers);
-                tfcount--;
-            }
-        }
+    /* we found at least one; poll the rest, but don't wait */
+    zero = tvzero;
+    count = ev_wait(&zero);
+    if (count < 0) return count;
 
-        return count;
+    for (i = 0; i < pipefiles.size; i++) {
+        file = pipefiles.ptrs[i];
+        fd = fileno(file->u.fp);
+        if (file->off < file->len && ev_wanted(fd, EV_READ))
+            count += ev_set_ready(fd, EV_READ);
     }
+
+    return count;
 }
 
 /**********
@@ -762,11 +747,8 @@ void internal_error2(const char *file, int line, const char *file2, int line2,
 char igetchar(void)
 {
     char c;
-    fd_set readers;
 
-    FD_ZERO(&readers);
-    FD_SET(STDIN_FILENO, &readers);
-    while(select(1, &readers, NULL, NULL, NULL) <= 0);
+    while(ev_wait_fd(STDIN_FILENO, EV_READ, NULL) <= 0);
     read(STDIN_FILENO, &c, 1);
     return c;
 }
@@ -784,15 +766,11 @@ int tfreadable(TFILE *file)
 
     } else {
 	struct timeval timeout = tvzero;
-	fd_set readers;
 	int count;
 
         if (file->len < 0) return 1;  /* tfread will return eof or error */
 
-	FD_ZERO(&readers);
-	FD_SET(fileno(file->u.fp), &readers);
-
-	count = select(fileno(file->u.fp) + 1, &readers, NULL, NULL, &timeout);
+	count = ev_wait_fd(fileno(file->u.fp), EV_READ, &timeout);
 	if (count < 0) {
 	    return -1;
 	} else if (count == 0) {
@@ -0,0 +1,436 @@
+/*************************************************************************
+ *  TinyFugue - programmable mud client
+ *  Copyright (C) 1993, 1994, 1995, 1996, 1997, 1998, 1999, 2002, 2003, 2004, 2005, 2006-2007 Ken Keys
+ *
+ *  TinyFugue (aka "tf") is protected under the terms of the GNU
+ *  General Public License.  See the file "COPYING" for details.
+ ************************************************************************/
+static const char RCSid[] = "$Id$";
+
+
+/***********************************************************
+ * Descriptor event backend
+ *
+ * main_loop() used to rebuild and scan fd_sets on every
+ * iteration, which costs O(highest fd) and can not handle
+ * descriptors beyond FD_SETSIZE.  Descriptors are now
+ * registered once, and the best available of epoll(),
+ * poll(), or select() is used to wait for them.  All
+ * backends are level-triggered, so callers see the same
+ * semantics select() always had.
+ ***********************************************************/
+
+#include "tfconfig.h"
+#include <sys/types.h>
+#if HAVE_SYS_SELECT_H
+# include <sys/select.h>
+#endif
+#include <fcntl.h>
+
+#if HAVE_POLL_H && HAVE_POLL
+# include <poll.h>
+# define USE_POLL 1
+#else
+# define USE_POLL 0
+#endif
+
+#if HAVE_SYS_EPOLL_H && HAVE_EPOLL_CREATE
+# include <sys/epoll.h>
+# define USE_EPOLL 1
+#else
+# define USE_EPOLL 0
+#endif
+
+#include "port.h"
+#include "tf.h"
+#include "util.h"
+#include "tfselect.h"
+
+enum { EVB_SELECT, EVB_POLL, EVB_EPOLL };
+
+typedef struct EvFd {
+    unsigned char want;		/* EV_* flags registered with ev_add() */
+    unsigned char ready;	/* EV_* flags found by last ev_wait() */
+    unsigned char always;	/* backend can't wait for fd; always ready */
+    int pos;			/* index into reg[], or -1 */
+} EvFd;
+
+const int feature_epoll = USE_EPOLL - 0;
+const int feature_poll = USE_POLL - 0;
+
+const char *ev_backend = "select";
+
+static int backend = EVB_SELECT;
+static EvFd *evfd = NULL;	/* per-descriptor state, indexed by fd */
+static int evfd_size = 0;
+static int *reg = NULL;		/* registered descriptors, unordered */
+static int nreg = 0, reg_size = 0;
+static int *readylist = NULL;	/* descriptors with nonzero ready */
+static int nready = 0;
+static int nalways = 0;		/* # of registered "always ready" fds */
+static int high_fd = -1;	/* highest descriptor ever registered */
+
+#if USE_POLL
+static struct pollfd *pfd = NULL;	/* parallel to reg[] */
+#endif
+
+#if USE_EPOLL
+static int epfd = -1;
+static struct epoll_event *epev = NULL;
+static int epev_size = 0;
+#endif
+
+
+void init_tfselect(const char *name)
+{
+    backend = EVB_SELECT;
+    ev_backend = "select";
+#if USE_POLL
+    if (!name || strcmp(name, "select") != 0) {
+	backend = EVB_POLL;
+	ev_backend = "poll";
+    }
+#endif
+#if USE_EPOLL
+    if (!name || strcmp(name, "epoll") == 0) {
+	if ((epfd = epoll_create(64)) >= 0) {
+	    fcntl(epfd, F_SETFD, FD_CLOEXEC);
+	    backend = EVB_EPOLL;
+	    ev_backend = "epoll";
+	}
+    }
+#endif
+}
+
+static void ev_grow(int fd)
+{
+    int i, newsize;
+
+    if (fd < evfd_size) return;
+    for (newsize = evfd_size ? evfd_size : 64; newsize <= fd; newsize *= 2);
+    evfd = XREALLOC(evfd, newsize * sizeof(EvFd));
+    readylist = XREALLOC(readylist, newsize * sizeof(int));
+    for (i = evfd_size; i < newsize; i++) {
+	evfd[i].want = evfd[i].ready = evfd[i].always = 0;
+	evfd[i].pos = -1;
+    }
+    evfd_size = newsize;
+}
+
+static void reg_insert(int fd)
+{
+    if (nreg >= reg_size) {
+	reg_size = reg_size ? reg_size * 2 : 32;
+	reg = XREALLOC(reg, reg_size * sizeof(int));
+#if USE_POLL
+	pfd = XREALLOC(pfd, reg_size * sizeof(struct pollfd));
+#endif
+    }
+    evfd[fd].pos = nreg;
+    reg[nreg] = fd;
+#if USE_POLL
+    pfd[nreg].fd = fd;
+    pfd[nreg].events = 0;
+    pfd[nreg].revents = 0;
+#endif
+    nreg++;
+}
+
+static void reg_remove(int fd)
+{
+    int pos = evfd[fd].pos;
+    if (pos < 0) return;
+    /* move last entry into the hole */
+    nreg--;
+    if (pos != nreg) {
+	reg[pos] = reg[nreg];
+	evfd[reg[pos]].pos = pos;
+#if USE_POLL
+	pfd[pos] = pfd[nreg];
+#endif
+    }
+    evfd[fd].pos = -1;
+}
+
+#if USE_EPOLL
+static int epoll_update(int fd, int oldwant, int newwant)
+{
+    struct epoll_event ev;
+    int op;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.data.fd = fd;
+    ev.events = ((newwant & EV_READ) ? EPOLLIN : 0) |
+		((newwant & EV_WRITE) ? EPOLLOUT : 0);
+
+    op = !newwant ? EPOLL_CTL_DEL : !oldwant ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    if (epoll_ctl(epfd, op, fd, &ev) == 0)
+	return 0;
+
+    /* The fd may have been closed and reopened behind our back (closing an
+     * fd removes it from the epoll set), so retry with the other op. */
+    if (op == EPOLL_CTL_MOD && errno == ENOENT)
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    if (op == EPOLL_CTL_ADD && errno == EEXIST)
+	return epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+    if (op == EPOLL_CTL_DEL && (errno == ENOENT || errno == EBADF))
+	return 0;
+    return -1;
+}
+#endif
+
+/* Register interest in <flags> events on <fd>.  Returns 0 on success, or -1
+ * (with errno set) if the backend can not handle fd.
+ */
+int ev_add(int fd, int flags)
+{
+    int oldwant;
+
+    if (fd < 0) {
+	errno = EBADF;
+	return -1;
+    }
+    if (backend == EVB_SELECT && fd >= FD_SETSIZE) {
+	errno = EMFILE;
+	return -1;
+    }
+    ev_grow(fd);
+    oldwant = evfd[fd].want;
+    if ((oldwant | flags) == oldwant) return 0;  /* nothing new */
+
+#if USE_EPOLL
+    if (backend == EVB_EPOLL && !evfd[fd].always) {
+	if (epoll_update(fd, oldwant, oldwant | flags) < 0) {
+	    /* Regular files and some devices can't be epoll()ed.  select()
+	     * would always report them as ready, so we do the same. */
+	    if (errno != EPERM) return -1;
+	    if (oldwant) epoll_update(fd, oldwant, 0);
+	    evfd[fd].always = 1;
+	    nalways++;
+	}
+    }
+#endif
+
+    evfd[fd].want = oldwant | flags;
+    if (evfd[fd].pos < 0) reg_insert(fd);
+#if USE_POLL
+    pfd[evfd[fd].pos].events =
+	((evfd[fd].want & EV_READ) ? POLLIN : 0) |
+	((evfd[fd].want & EV_WRITE) ? POLLOUT : 0);
+#endif
+    if (fd > high_fd) high_fd = fd;
+    return 0;
+}
+
+/* Unregister interest in <flags> events on <fd>. */
+void ev_del(int fd, int flags)
+{
+    int oldwant;
+
+    if (fd < 0 || fd >= evfd_size) return;
+    oldwant = evfd[fd].want;
+    if (!(oldwant & flags)) return;
+    evfd[fd].want &= ~flags;
+    evfd[fd].ready &= evfd[fd].want;
+
+#if USE_EPOLL
+    if (backend == EVB_EPOLL && !evfd[fd].always)
+	epoll_update(fd, oldwant, evfd[fd].want);
+#endif
+
+    if (!evfd[fd].want) {
+	if (evfd[fd].always) {
+	    evfd[fd].always = 0;
+	    nalways--;
+	}
+	reg_remove(fd);
+#if USE_POLL
+    } else {
+	pfd[evfd[fd].pos].events =
+	    ((evfd[fd].want & EV_READ) ? POLLIN : 0) |
+	    ((evfd[fd].want & EV_WRITE) ? POLLOUT : 0);
+#endif
+    }
+}
+
+int ev_wanted(int fd, int flags)
+{
+    return (fd >= 0 && fd < evfd_size) ? (evfd[fd].want & flags) : 0;
+}
+
+int ev_ready(int fd, int flags)
+{
+    return (fd >= 0 && fd < evfd_size) ? (evfd[fd].ready & flags) : 0;
+}
+
+/* Mark <fd> as ready for <flags>, as if ev_wait() had found it.  Returns 1 if
+ * fd was not already ready for anything, 0 otherwise.
+ */
+int ev_set_ready(int fd, int flags)
+{
+    int was_ready;
+
+    if (fd < 0 || fd >= evfd_size) return 0;
+    flags &= evfd[fd].want;
+    if (!flags) return 0;
+    was_ready = evfd[fd].ready;
+    evfd[fd].ready |= flags;
+    if (!was_ready) {
+	readylist[nready++] = fd;
+	return 1;
+    }
+    return 0;
+}
+
+void ev_clear_ready(void)
+{
+    while (nready > 0)
+	evfd[readylist[--nready]].ready = 0;
+}
+
+/* Convert a timeval to poll()/epoll_wait() milliseconds, rounding up so we
+ * don't wake up early and spin. */
+static int tv2ms(struct timeval *tv)
+{
+    if (!tv) return -1;
+    if (tv->tv_sec > 86400) return 86400 * 1000;
+    return tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
+}
+
+static int select_wait(struct timeval *timeout)
+{
+    fd_set rd, wr;
+    int i, fd, count, nfds = 0;
+
+    FD_ZERO(&rd);
+    FD_ZERO(&wr);
+    for (i = 0; i < nreg; i++) {
+	fd = reg[i];
+	if (evfd[fd].want & EV_READ) FD_SET(fd, &rd);
+	if (evfd[fd].want & EV_WRITE) FD_SET(fd, &wr);
+	if (fd >= nfds) nfds = fd + 1;
+    }
+    if ((count = select(nfds, &rd, &wr, NULL, timeout)) <= 0)
+	return count;
+    for (i = 0; i < nreg; i++) {
+	fd = reg[i];
+	ev_set_ready(fd, (FD_ISSET(fd, &rd) ? EV_READ : 0) |
+	    (FD_ISSET(fd, &wr) ? EV_WRITE : 0));
+    }
+    return nready;
+}
+
+#if USE_POLL
+static int poll_wait(struct timeval *timeout)
+{
+    int i, count, flags;
+
+    if ((count = poll(pfd, nreg, tv2ms(timeout))) <= 0)
+	return count;
+    for (i = 0; count && i < nreg; i++) {
+	if (!pfd[i].revents) continue;
+	count--;
+	flags = 0;
+	/* A hangup or error must be seen by the reader (it will get EOF or
+	 * the error) and by a pending connect (it failed). */
+	if (pfd[i].revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL))
+	    flags |= EV_READ;
+	if (pfd[i].revents & (POLLOUT | POLLHUP | POLLERR | POLLNVAL))
+	    flags |= EV_WRITE;
+	ev_set_ready(pfd[i].fd, flags);
+    }
+    return nready;
+}
+#endif
+
+#if USE_EPOLL
+static int epoll_wait_events(struct timeval *timeout)
+{
+    int i, count, flags;
+
+    if (epev_size < nreg + 1) {
+	epev_size = nreg + 32;
+	epev = XREALLOC(epev, epev_size * sizeof(struct epoll_event));
+    }
+    if ((count = epoll_wait(epfd, epev, epev_size, tv2ms(timeout))) <= 0)
+	return count;
+    for (i = 0; i < count; i++) {
+	flags = 0;
+	if (epev[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+	    flags |= EV_READ;
+	if (epev[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+	    flags |= EV_WRITE;
+	ev_set_ready(epev[i].data.fd, flags);
+    }
+    return nready;
+}
+#endif
+
+/* Wait for an event on any registered descriptor, or until <timeout> (NULL
+ * means forever).  Returns the number of ready descriptors, 0 on timeout,
+ * or -1 on error (errno is set, and may be EINTR).
+ */
+int ev_wait(struct timeval *timeout)
+{
+    struct timeval zero;
+    int count;
+
+    ev_clear_ready();
+
+    if (nalways) {
+	zero = tvzero;
+	timeout = &zero;
+    }
+
+    switch (backend) {
+#if USE_EPOLL
+    case EVB_EPOLL:  count = epoll_wait_events(timeout); break;
+#endif
+#if USE_POLL
+    case EVB_POLL:   count = poll_wait(timeout); break;
+#endif
+    default:         count = select_wait(timeout); break;
+    }
+
+    if (count >= 0 && nalways) {
+	int i;
+	for (i = 0; i < nreg; i++) {
+	    if (evfd[reg[i]].always)
+		ev_set_ready(reg[i], evfd[reg[i]].want);
+	}
+	count = nready;
+    }
+    return count;
+}
+
+/* Wait for <flags> on a single descriptor, which need not be registered.
+ * Does not disturb the results of the last ev_wait().  Returns >0 if ready,
+ * 0 on timeout, or -1 on error.
+ */
+int ev_wait_fd(int fd, int flags, struct timeval *timeout)
+{
+#if USE_POLL
+    struct pollfd p;
+    p.fd = fd;
+    p.events = ((flags & EV_READ) ? POLLIN : 0) |
+	((flags & EV_WRITE) ? POLLOUT : 0);
+    p.revents = 0;
+    return poll(&p, 1, tv2ms(timeout));
+#else
+    fd_set set;
+    if (fd >= FD_SETSIZE) {
+	errno = EMFILE;
+	return -1;
+    }
+    FD_ZERO(&set);
+    FD_SET(fd, &set);
+    return select(fd + 1, (flags & EV_READ) ? &set : NULL,
+	(flags & EV_WRITE) ? &set : NULL, NULL, timeout);
+#endif
+}
+
+/* One more than the highest descriptor ever registered. */
+int ev_nfds(void)
+{
+    return high_fd + 1;
+}
@@ -32,8 +32,28 @@ extern int select();
 #endif /* ndef FD_ZERO */
 
 
-extern int tfselect(int nfds, fd_set *readers, fd_set *writers,
-    fd_set *excepts, struct timeval *timeout);
+/* Event interest/readiness flags.
+ * Descriptors are registered with ev_add() and stay registered until
+ * ev_del(); ev_wait() waits for any of them (level-triggered), and
+ * ev_ready() reports what the last ev_wait() found.
+ */
+#define EV_READ		0x01	/* readable, EOF, or error */
+#define EV_WRITE	0x02	/* writable, or error (nonblocking connect) */
+
+extern const char *ev_backend;	/* name of backend in use */
+
+extern void init_tfselect(const char *backend);
+extern int  ev_add(int fd, int flags);
+extern void ev_del(int fd, int flags);
+extern int  ev_wanted(int fd, int flags);
+extern int  ev_ready(int fd, int flags);
+extern int  ev_set_ready(int fd, int flags);
+extern void ev_clear_ready(void);
+extern int  ev_wait(struct timeval *timeout);
+extern int  ev_wait_fd(int fd, int flags, struct timeval *timeout);
+extern int  ev_nfds(void);
+
+extern int tfselect(struct timeval *timeout);
 
 
 #endif /* TFSELECT_H */
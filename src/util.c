@@ -23,6 +23,10 @@ static const char RCSid[] = "$Id: util.c,v 35004.150 2007/01/13 23:12:39 kkeys E
 #endif
 #include <sys/types.h>
 #include <sys/stat.h>
+#if HAVE_PTHREAD_H && HAVE_PTHREAD_CREATE
+# include <signal.h>
+# include <pthread.h>
+#endif
 #include <limits.h>
 #include "port.h"
 #include "tf.h"
@@ -33,6 +37,7 @@ static const char RCSid[] = "$Id: util.c,v 35004.150 2007/01/13 23:12:39 kkeys E
 #include "output.h"	/* fix_screen() */
 #include "tty.h"	/* reset_tty() */
 #include "signals.h"	/* core() */
+#include "socket.h"	/* reset_sock_locale() */
 #include "variable.h"
 #include "parse.h"	/* for expression in nextopt() numeric option */
 
@@ -61,6 +66,7 @@ AUTO_BUFFER(featurestr);
 struct feature features[] = {
     { "256colors",	&feature_256colors, },
     { "core",		&feature_core, },
+    { "epoll",		&feature_epoll },
     { "float",		&feature_float },
     { "ftime",		&feature_ftime },
     { "history",	&feature_history },
@@ -68,6 +74,7 @@ struct feature features[] = {
     { "locale",		&feature_locale },
     { "MCCPv1",		&feature_MCCPv1 },
     { "MCCPv2",		&feature_MCCPv2 },
+    { "poll",		&feature_poll },
     { "process",	&feature_process },
     { "SOCKS",		&feature_SOCKS },
     { "ssl",		&feature_ssl },
@@ -577,6 +584,7 @@ int ch_locale(Var *var)
      * (typically, locale is set at startup, and then never changed).
      */
     reset_pattern_locale();
+    reset_sock_locale();
 
     return 1;
 #else
@@ -1003,6 +1011,50 @@ void tvadd(struct timeval *a, const struct timeval *b, const struct timeval *c)
     normalize_time(a);
 }
 
+/* Like gettime(), but not affected by changes to the system clock.  Only
+ * differences between monotime() values are meaningful. */
+void monotime(struct timeval *tv)
+{
+#if HAVE_CLOCK_GETTIME && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+        tv->tv_sec = ts.tv_sec;
+        tv->tv_usec = ts.tv_nsec / 1000;
+        return;
+    }
+#endif
+    gettime(tv);
+}
+
+/* Returns monotonic time in nanoseconds, for timing short intervals. */
+double nanotime(void)
+{
+    struct timeval tv;
+#if HAVE_CLOCK_GETTIME && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return ts.tv_sec * 1e9 + ts.tv_nsec;
+#endif
+    gettime(&tv);
+    return tv.tv_sec * 1e9 + tv.tv_usec * 1e3;
+}
+
+#if HAVE_PTHREAD_H && HAVE_PTHREAD_CREATE
+/* Like pthread_create(), but the new thread starts with all signals blocked,
+ * so they are handled by the main thread, and it wakes up. */
+int tf_thread_create(pthread_t *tid, void *(*func)(void *), void *arg)
+{
+    sigset_t all, old;
+    int err;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    err = pthread_create(tid, NULL, func, arg);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return err;
+}
+#endif
+
 void append_usec(String *buf, long usec, int truncflag)
 {
 #if HAVE_GETTIMEOFDAY
@@ -51,6 +51,7 @@ extern struct feature features[];
 
 extern const int feature_256colors;
 extern const int feature_core;
+extern const int feature_epoll;
 extern const int feature_float;
 extern const int feature_ftime;
 extern const int feature_history;
@@ -58,6 +59,7 @@ extern const int feature_IPv6;
 extern const int feature_locale;
 extern const int feature_MCCPv1;
 extern const int feature_MCCPv2;
+extern const int feature_poll;
 extern const int feature_process;
 extern const int feature_SOCKS;
 extern const int feature_ssl;
@@ -125,9 +127,16 @@ extern void   tvsub(struct timeval *a, const struct timeval *b,
 		const struct timeval *c);
 extern void   tvadd(struct timeval *a, const struct timeval *b,
 		const struct timeval *c);
+extern void   monotime(struct timeval *tv);
+extern double nanotime(void);
 extern void   die(const char *why, int err) NORET;
 #if USE_DMALLOC
 extern void   free_util(void);
 #endif
+#if HAVE_PTHREAD_H && HAVE_PTHREAD_CREATE
+# include <pthread.h>
+extern int    tf_thread_create(pthread_t *tid, void *(*func)(void *),
+		void *arg);
+#endif
 
 #endif /* UTIL_H */
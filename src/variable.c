@@ -31,6 +31,7 @@ static const char RCSid[] = "$Id: variable.c,v 35004.110 2007/01/13 23:12:39 kke
 static const char *varchar(Var *var);
 static Var   *findlevelvar(const char *name, List *level);
 static Var   *findlocalvar(const char *name);
+static Var   *findlocalidvar(const Value *idval);
 static int    set_special_var(Var *var, Value *value,
                        int funcflag, int exportflag);
 static void   set_env_var(Var *var, int exportflag);
@@ -59,6 +60,7 @@ static HashTable var_table[1];    /* global variables */
 static int envsize;
 static int envmax;
 static int setting_nearest = 0;
+unsigned int var_gen = 0;         /* incremented when var_table changes */
 
 #define bicode(a, b)  b 
 #include "enumlist.h"
@@ -111,6 +113,7 @@ inline Var *newglobalvar(const char *name)
     Var *var;
     var = newvar(name);
     var->node = hash_insert((void*)var, var_table);
+    var_gen++;
     if (setting_nearest && pedantic) {
 	wprintf("variable '%s' was not previously defined in any "
 	    "scope, so it has been created in the global scope.", name);
@@ -216,18 +219,26 @@ void init_variables(void)
     current_command = oldcommand;
 }
 
-void pushvarscope(struct List *level)
+void pushvarscope(VarScope *scope, int nslots)
 {
-    init_list(level);
-    inlist((void *)level, localvar, NULL);
+    init_list(&scope->vars);
+    scope->nslots = nslots;
+    scope->slot = (nslots <= SCOPE_SLOTS) ? scope->slotbuf :
+	(Var **)XMALLOC(nslots * sizeof(Var *));
+    memset(scope->slot, 0, nslots * sizeof(Var *));
+    inlist((void *)scope, localvar, NULL);
 }
 
 void popvarscope(void)
 {
+    VarScope *scope;
     List *level;
     Var *var;
 
-    level = (List *)unlist(localvar->head, localvar);
+    scope = (VarScope *)unlist(localvar->head, localvar);
+    if (scope->slot != scope->slotbuf)
+	FREE(scope->slot);
+    level = &scope->vars;
     while (level->head) {
         var = (Var *)unlist(level->head, level);
 	assert(var->val.count == 1);
@@ -259,6 +270,33 @@ static Var *findlocalvar(const char *name)
     return var;
 }
 
+/* Like findlocalvar(idval->name), but if idval was given a slot by
+ * compile_tf(), the variable is remembered in that slot of the running
+ * program's scope once it exists there, and found directly after that.
+ */
+static Var *findlocalidvar(const Value *idval)
+{
+    ListEntry *node;
+    VarScope *scope;
+    Var *var;
+    int slot = idval->u.id.slot;
+
+    if (!(node = localvar->head))
+	return NULL;
+    scope = (VarScope *)node->datum;
+    if (slot >= 0 && slot < scope->nslots) {
+	if ((var = scope->slot[slot]))
+	    return var;
+	if ((var = findlevelvar(idval->name, &scope->vars)))
+	    return scope->slot[slot] = var;
+	node = node->next;
+    }
+    for (var = NULL; node && !var; node = node->next) {
+        var = findlevelvar(idval->name, (List *)node->datum);
+    }
+    return var;
+}
+
 /* get char* value of variable */
 static const char *varchar(Var *var)
 {
@@ -281,6 +319,18 @@ Var *ffindglobalvar(const char *name)
     return findglobalvar(name);
 }
 
+/* function form of hfindglobalvar() */
+Var *hffindglobalvar(const char *name, unsigned int hash)
+{
+    return hfindglobalvar(name, hash);
+}
+
+/* Is any local variable scope active (i.e., is a macro running)? */
+int in_local_scope(void)
+{
+    return localvar->head != NULL;
+}
+
 Var *findorcreateglobalvar(const char *name)
 {
     Var *var = findglobalvar(name);
@@ -292,8 +342,8 @@ Var *hfindnearestvar(const Value *idval)
     const char *name = idval->name;
     Var *var;
 
-    if (!(var = findlocalvar(name)) &&
-	!(var = hfindglobalvar(name, idval->u.hash)))
+    if (!(var = findlocalidvar(idval)) &&
+	!(var = hfindglobalvar(name, idval->u.id.hash)))
     {
         if (patmatch(&looks_like_special_sub, NULL, name)) {
             wprintf("\"%s\" in an expression is a variable reference, "
@@ -323,9 +373,9 @@ Var *hsetnearestvar(const Value *idval, conString *value)
 {
     Var *var;
     const char *name = idval->name;
-    unsigned int hash = idval->u.hash;
+    unsigned int hash = idval->u.id.hash;
 
-    if ((var = findlocalvar(name))) {
+    if ((var = findlocalidvar(idval))) {
         set_str_var_direct(var, TYPE_STR, value);
     } else {
         setting_nearest++;
@@ -351,6 +401,7 @@ static Var *newvar(const char *name)
     var->statuses = 0;
     var->statusfmts = 0;
     var->statusattrs = 0;
+    var->version = 0;
     var->val.name = STRDUP(name);
 
     if (patmatch(&looks_like_special_sub, NULL, name)) {
@@ -467,6 +518,7 @@ static void remove_env(const char *str)
     do { \
 	assert(var->val.count == 1); \
 	clearval(&var->val); \
+	var->version++; \
 	var->flags |= VARSET; \
 	var->val.type = type & TYPES_BASIC; \
 	if (!(type & (allowed))) \
@@ -629,6 +681,31 @@ int do_set(const char *name, unsigned int hash, conString *value, int offset,
     return result;
 }
 
+/* /let with a name known at compile time */
+int do_let(const Value *idval, conString *value)
+{
+    conString *svalue;
+    VarScope *scope;
+    Var *var;
+    int slot = idval->u.id.slot;
+
+    if (!localvar->head) {
+        eprintf("illegal at top level.");
+        return 0;
+    }
+    scope = (VarScope *)localvar->head->datum;
+    if (slot >= 0 && slot < scope->nslots) {
+	if (!(var = scope->slot[slot]))
+	    var = scope->slot[slot] = findorcreatelocalvar(idval->name);
+    } else {
+	var = findorcreatelocalvar(idval->name);
+    }
+    (svalue = CS(Stringdup(value)))->links++;
+    set_str_var_direct(var, TYPE_STR, svalue);
+    conStringfree(svalue);
+    return 1;
+}
+
 /* Note: "/set var=value" is handled by OP_SET if "var" is compile-time const */
 int command_set(String *args, int offset, int exportflag, int localflag)
 {
@@ -741,6 +818,7 @@ int unsetvar(Var *var)
     }
 
     var->flags &= ~VARSET;
+    var->version++;
     if (var->flags & VAREXPORT) {
 	remove_env(var->val.name);
         var->flags &= ~VAREXPORT;
@@ -789,6 +867,7 @@ void freevar(Var *var)
 	var->statusfmts || var->statusattrs)
 	    return;
     hash_remove(var->node, var_table);
+    var_gen++;
     FREE(var->val.name);
     FREE(var);
 }
@@ -805,6 +884,7 @@ static int set_special_var(Var *var, Value *value, int funcflag,
     var->val.type &= TYPES_BASIC;
     var->val.sval = NULL;
     var->val.u.ival = 0;
+    var->version++;
 
     oflush();   /* flush buffer now, in case variable affects flushing */
 
@@ -871,7 +951,10 @@ static int set_special_var(Var *var, Value *value, int funcflag,
     }
 
     var->flags |= VARSET;
-    if (!var->node) var->node = hash_insert((void *)var, var_table);
+    if (!var->node) {
+	var->node = hash_insert((void *)var, var_table);
+	var_gen++;
+    }
     set_env_var(var, exportflag);
 
     if (funcflag && var->func) {
@@ -14,12 +14,22 @@
  * Internal, user, and environment variables *
  *********************************************/
 
+/* One level of local variables, pushed by prog_run() */
+#define SCOPE_SLOTS 8
+typedef struct VarScope {
+    List vars;			/* Vars in this level (must be first) */
+    Var **slot;			/* /let locals resolved at compile time */
+    int nslots;
+    Var *slotbuf[SCOPE_SLOTS];	/* slot array, if nslots is small enough */
+} VarScope;
+
 #define set_str_var_by_name(name, sval) \
     set_str_var_by_namehash(name, hash_string(name), CS(sval), 0)
 #define set_var_by_id(id, i) \
     setintvar(&special_var[id], i, FALSE)
 
 extern Pattern looks_like_special_sub_ic;
+extern unsigned int var_gen;
 
 extern void init_variables(void);
 extern Var   *newglobalvar(const char *name);
@@ -29,6 +39,8 @@ extern Value *hgetnearestvarval(const Value *idval);
 extern Value *getvarval(Var *var);
 extern const char *getvar(const char *name);
 extern Var *ffindglobalvar(const char *name);
+extern Var *hffindglobalvar(const char *name, unsigned int hash);
+extern int  in_local_scope(void);
 extern void set_str_var_direct(Var *var, int type, conString *value);
 extern void set_int_var_direct(Var *var, int type, int value);
 extern void set_time_var_direct(Var *var, int type, struct timeval *value);
@@ -47,10 +59,11 @@ extern int  do_set(const char *name, unsigned int hash, conString *value,
 	    int offset, int exportflag, int localflag);
 extern int  command_set(String *args, int offset, int exportflag,
 	    int localflag);
+extern int  do_let(const Value *idval, conString *value);
 extern Var *setlocalstrvar(const char *name, conString *value);
 extern Var *setlocalintvar(const char *name, int value);
 extern Var *setlocaldtimevar(const char *name, struct timeval *value);
-extern void pushvarscope(struct List *level);
+extern void pushvarscope(VarScope *scope, int nslots);
 extern void popvarscope(void);
 
 #if USE_DMALLOC
@@ -47,6 +47,7 @@ vartime(VAR_alert_time,	"alert_time",	5,0,		NULL)
 varflag(VAR_auto_fg,	"auto_fg",	FALSE,		NULL)
 #endif
 varflag(VAR_background,	"background",	TRUE,		tog_bg)
+varint (VAR_backlog_warn,	"backlog_warn",	16384,		NULL)
 varflag(VAR_backslash,	"backslash",	TRUE,		NULL)
 varenum(VAR_bamf,	"bamf",		FALSE,		NULL,	enum_bamf)
 varflag(VAR_beep,	"beep",		TRUE,		NULL)
@@ -58,6 +59,7 @@ varstr (VAR_cecho_attr,	"cecho_attr",	"Cgreen",	ch_attr)
 varflag(VAR_cleardone,	"cleardone",	FALSE,		NULL)
 varflag(VAR_clearfull,	"clearfull",	FALSE,		NULL)
 varenum(VAR_async_conn,	"connect",	TRUE,		NULL,	enum_block)
+vartime(VAR_connect_delay,"connect_delay",0,250000,	NULL)
 varflag(VAR_defcompile,	"defcompile",	FALSE,		NULL)
 varenum(VAR_emulation,	"emulation",	EMUL_ANSI_ATTR,	NULL,	enum_emul)
 varstr (VAR_error_attr,	"error_attr",	NULL,		ch_attr)
@@ -88,6 +90,11 @@ varflag(VAR_login,	"login",	TRUE,		NULL)
 varflag(VAR_lp,		"lp",		FALSE,		tog_lp)
 varflag(VAR_lpquote,	"lpquote",	FALSE,		ch_lpquote)
 vartime(VAR_maildelay,	"maildelay",	60,0,		ch_maildelay)
+#if HAVE_PTHREAD_H && HAVE_PTHREAD_CREATE
+varint (VAR_match_threads,"match_threads",0,		NULL)
+#else
+varenum(VAR_match_threads,"match_threads",0,		NULL,	enum_off)
+#endif
 varenum(VAR_matching,	"matching",	1,		NULL,	enum_match)
 varint (VAR_max_hook,	"max_hook",	1000,		NULL)
 varint (VAR_max_instr,	"max_instr",	1000000,	NULL)
@@ -104,9 +111,12 @@ varstr (VAR_mecho_attr,	"mecho_attr",	NULL,		ch_attr)
 varenum(VAR_meta_esc,	"meta_esc",	META_NONPRINT,	NULL,	enum_meta)
 varflag(VAR_more,	"more",		FALSE,		tog_more)
 varstr (VAR_mprefix,	"mprefix",	"+",		NULL)
+vartime(VAR_name_cache,	"name_cache",	300,0,		NULL)
 varflag(VAR_oldslash,	"oldslash",	TRUE,		NULL)
 varflag(VAR_optimize,	"optimize",	TRUE,		NULL)
 varflag(VAR_pedantic,	"pedantic",	FALSE,		NULL)
+varflag(VAR_profile_macros,"profile_macros",FALSE,	NULL)
+varint (VAR_prog_cache,	"prog_cache",	64,		NULL)
 varstr (VAR_prompt_sec,	"prompt_sec",	NULL,		obsolete_prompt)
 varstr (VAR_prompt_usec,"prompt_usec",	NULL,		obsolete_prompt)
 vartime(VAR_prompt_wait,"prompt_wait",	0,250000,	NULL)
@@ -118,8 +128,16 @@ varstr (VAR_qecho_attr,	"qecho_attr",	NULL,		ch_attr)
 varstr (VAR_qprefix,	"qprefix",	NULL,		NULL)
 varflag(VAR_quiet,	"quiet",	FALSE,		NULL)
 varflag(VAR_quitdone,	"quitdone",	FALSE,		NULL)
+#if HAVE_PTHREAD_H && HAVE_PTHREAD_CREATE && HAVE_POLL && defined(__ATOMIC_SEQ_CST)
+varflag(VAR_recv_thread,"recv_thread",	FALSE,		NULL)
+#else
+varenum(VAR_recv_thread,"recv_thread",	FALSE,		NULL,	enum_off)
+#endif
 varflag(VAR_redef,	"redef",	TRUE,		NULL)
 varint (VAR_refreshtime,"refreshtime",	100000,		NULL)
+varpos (VAR_sched_bytes,"sched_bytes",	4096,		NULL)
+varpos (VAR_sched_lines,"sched_lines",	100,		NULL)
+vartime(VAR_sched_slice,"sched_slice",	0,5000,		NULL)
 varflag(VAR_scroll,	"scroll",	FALSE,		ch_visual)
 varflag(VAR_secho,	"secho",	FALSE,		NULL)
 varstr (VAR_secho_attr,	"secho_attr",	NULL,		ch_attr)
@@ -22,7 +22,7 @@ static const char RCSid[] = "$Id: world.c,v 35004.77 2007/01/13 23:12:39 kkeys E
 #include "history.h"
 #include "world.h"
 #include "process.h"
-#include "macro.h"	/* remove_world_macros() */
+#include "macro.h"	/* remove_world_macros(), world_type_changed(), etc. */
 #include "cmdlist.h"
 #include "socket.h"
 #include "output.h"	/* columns */
@@ -35,6 +35,7 @@ static int  list_worlds(const Pattern *name, const Pattern *type,
     struct TFILE *file, int flags, int (*cmp)(const void *, const void *));
 static void free_world(World *w);
 static World *alloc_world(void);
+static int  new_wtindex(void);
 
 static World *hworld = NULL;
 
@@ -52,6 +53,7 @@ static void free_world(World *w)
     if (w->type)      FREE(w->type);
     if (w->myhost)    FREE(w->myhost);
     if (w->screen)    free_screen(w->screen);
+    free_world_trigtable(w);
 #if !NO_HISTORY
     if (w->history) {
         free_history(w->history);
@@ -80,9 +82,25 @@ static World *alloc_world(void)
     World *result;
     result = (World *) XMALLOC(sizeof(World));
     memset(result, 0, sizeof(World));
+    result->wtindex = new_wtindex();
     return result;
 }
 
+/* Returns the lowest wtindex not used by any world.  Keeping them small
+ * keeps the macros' world type maps small. */
+static int new_wtindex(void)
+{
+    World *w;
+    int i;
+
+    for (i = 0; ; i++) {
+	if (defaultworld && defaultworld->wtindex == i) continue;
+	for (w = hworld; w; w = w->next)
+	    if (w->wtindex == i) break;
+	if (!w) return i;
+    }
+}
+
 /* A NULL name means unnamed; world will be given a temp name. */
 World *new_world(const char *name, const char *type,
     const char *host, const char *port,
@@ -161,6 +179,9 @@ World *new_world(const char *name, const char *type,
     setfield(myhost);
     result->flags |= flags;
 
+    if (!is_redef || (type && *type))
+	world_type_changed(result);
+
 #ifdef PLATFORM_UNIX
 # ifndef __CYGWIN32__
     if (pass && *pass && loadfile && (loadfile->mode & (S_IROTH | S_IRGRP)) &&
@@ -206,6 +227,7 @@ struct Value *handle_unworld_command(String *args, int offset)
         if (defaultworld && cstrcmp(name, "default") == 0) {
             free_world(defaultworld);
             defaultworld = NULL;
+	    world_type_changed(NULL);
         } else if ((w = find_world(name))) {
             result += nuke_world(w);
         } else {
@@ -329,7 +351,8 @@ static int list_worlds(const Pattern *name, const Pattern *type, TFILE *file,
                 width_port, width_port, p->port,
                 p->character);
         } else {
-            if (p->myhost) need = 9;
+            if (p->weight) need = 10;
+            else if (p->myhost) need = 9;
             else if (p->flags & ~WORLD_TEMP) need = 8;
             else if (p->mfile) need = 7;
             else if (p->character || p->pass) need = 6;
@@ -364,6 +387,9 @@ static int list_worlds(const Pattern *name, const Pattern *type, TFILE *file,
             if (need < 9) goto listworld_tail;
             Sappendf(buf, ", \"%q\"", '"', p->myhost);
 
+            if (need < 10) goto listworld_tail;
+            Sappendf(buf, ", %d", p->weight);
+
 listworld_tail:
 	    Stringadd(buf, ')');
             tfputs(buf->data, file);
@@ -26,8 +26,11 @@ struct World {		/* World structure */
     char *myhost;		/* client host name */
     char *mfile;		/* macro file */
     char *type;			/* user-defined server type (tiny, lp...) */
+    int weight;			/* share of socket service (0: default) */
     struct Sock *sock;		/* open socket, if any */
     List triglist[1];		/* trigger macros for this world */
+    struct TrigTable *trigtable; /* triggers for text from this world */
+    int wtindex;		/* bit in each -T macro's world type map */
     List hooklist[1];		/* hook macros for this world */
     Screen *screen;		/* displayed and undisplayed text */
     void *md;			/* mmalloc descriptor */
@@ -50,6 +53,9 @@ extern World *defaultworld;
    (w->pass ? w->pass : defaultworld ? defaultworld->pass : NULL)
 #define world_mfile(w) \
    (w->mfile ? w->mfile : defaultworld ? defaultworld->mfile : NULL)
+#define world_weight(w) \
+   (w->weight ? w->weight : \
+    (defaultworld && defaultworld->weight) ? defaultworld->weight : 1)
 
 
 extern World *new_world(const char *name, const char *type,
@@ -130,18 +130,18 @@
 /def -i bg = /fg -n
 
 
-;;  /ADDWORLD [-pxe] [-T<type>] [-s<srchost>] <name> [[<char> <pass>] <host> <port> [<file>]]
-;;  /ADDWORLD [-T<type>] DEFAULT <char> <pass> [<file>]
+;;  /ADDWORLD [-pxe] [-T<type>] [-s<srchost>] [-W<weight>] <name> [[<char> <pass>] <host> <port> [<file>]]
+;;  /ADDWORLD [-T<type>] [-W<weight>] DEFAULT <char> <pass> [<file>]
 
 /def -i addworld = \
-    /if (!getopts("pxeT:s:", "")) /return 0%; /endif%; \
+    /if (!getopts("pxeT:s:W#", "")) /return 0%; /endif%; \
     /let flags=$[opt_p ?"p":""]$[opt_x?"x":""]$[opt_e?"e":""]%; \
     /if ({1} =/ "default") \
-        /test addworld({1}, opt_T, "", "", {2}, {3}, {4}, flags, opt_s)%;\
+        /test addworld({1}, opt_T, "", "", {2}, {3}, {4}, flags, opt_s, opt_W)%;\
     /elseif ({#} <= 4) \
-        /test addworld({1}, opt_T, {2}, {3}, "", "", {4}, flags, opt_s)%;\
+        /test addworld({1}, opt_T, {2}, {3}, "", "", {4}, flags, opt_s, opt_W)%;\
     /else \
-        /test addworld({1}, opt_T, {4}, {5}, {2}, {3}, {6}, flags, opt_s)%;\
+        /test addworld({1}, opt_T, {4}, {5}, {2}, {3}, {6}, flags, opt_s, opt_W)%;\
     /endif
 
 
@@ -74,7 +74,7 @@ _failmsg:
 #	fi
 
 TF tf$(X):     $(OBJS) $(BUILDERS) $(PCRE)
-	$(CC) $(LDFLAGS) -o tf$(X) $(OBJS) $(LIBS) -lpcre
+	$(CC) $(LDFLAGS) -o tf$(X) $(OBJS) $(LIBS) -lpcre2-8
 #	@# Some stupid linkers return ok status even if they fail.
 	@test -f "tf$(X)"
 #	@# ULTRIX's sh errors here if strip isn't found, despite "true".
@@ -136,6 +136,25 @@ LIBRARY $(TF_LIBDIR): ../tf-lib/tf-help ../tf-lib/tf-help.idx
 makehelp: makehelp.c
 	$(CC) $(CFLAGS) -o makehelp makehelp.c
 
+# event backend benchmark; not installed.
+evbench: evbench.$O tfselect.$O
+	$(CC) $(LDFLAGS) -o evbench evbench.$O tfselect.$O
+
+# glob matching benchmark; not installed.
+globbench: globbench.$O glob.$O
+	$(CC) $(LDFLAGS) -o globbench globbench.$O glob.$O
+
+# loopback MUD emulator; "make bench" runs tf against it.  Not installed.
+mudbench$(X): mudbench.$O
+	$(CC) $(LDFLAGS) -o mudbench$(X) mudbench.$O $(LIBS)
+
+bench: tf$(X) mudbench$(X)
+	./mudbench -t ./tf$(X) $(BENCHFLAGS)
+
+# macro interpreter benchmark script; not installed.
+interpbench: tf$(X)
+	./tf$(X) -n -L`cd ../tf-lib && pwd` -f./interpbench.tf < /dev/null
+
 __always__:
 
 ../tf-lib/tf-help: __always__